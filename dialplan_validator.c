@@ -2,8 +2,10 @@
  * Lightweight standalone Asterisk dialplan syntax validator
  * Based on actual parsing logic from asterisk/pbx/pbx_config.c
  * 
- * Compile: gcc -o dialplan_validator dialplan_validator.c -Wall
+ * Compile: gcc -o dialplan_validator dialplan_validator.c -Wall -pthread
+ * Library: gcc -c -DDPV_NO_MAIN dialplan_validator.c -Wall -pthread (see dialplan_validator.h)
  * Usage: ./dialplan_validator /etc/asterisk/extensions-test.conf
+ *        ./dialplan_validator --jobs 8 /etc/asterisk/extensions_*.conf
  * 
  * GitHub: https://github.com/calvintwells/dialplan_validator
  * License: MIT
@@ -13,501 +15,7977 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <glob.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "dialplan_validator.h"
 
-#define MAX_LINE 4096
-#define MAX_VAR_NAME 80
 #define VERSION "1.3"
 
+// Files at least this large are split into chunks and validated on all workers
+#ifndef PARALLEL_MIN_BYTES
+#define PARALLEL_MIN_BYTES (100L * 1024 * 1024)
+#endif
+#ifndef CHUNK_MIN_BYTES
+#define CHUNK_MIN_BYTES (1L * 1024 * 1024)
+#endif
+#define CHUNKS_PER_WORKER 4
+
+// Read buffer for pipes and standard input; grows only for a longer line
+#ifndef STREAM_BUFFER
+#define STREAM_BUFFER (64 * 1024)
+#endif
+
+// --watch: files are re-checked at least this often (the only trigger without inotify)
+#ifndef WATCH_POLL_MS
+#define WATCH_POLL_MS 1000
+#endif
+#define WATCH_SETTLE_MS 50   // Let an editor finish its write/rename burst
+#define CHUNK_HEADER_WINDOW (64 * 1024)
+
+typedef enum {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_SARIF
+} output_format;
+
+typedef struct app_registry app_registry;
+
+typedef struct {
+    int jobs;               // Worker threads available to this validation
+    int max_errors;         // Stop a file after this many errors (0 = no limit)
+    output_format format;
+    const char *cache_dir;  // --cache: per-context result cache (NULL = off)
+    int follow_includes;    // --includes: validate #include / #tryinclude targets too
+    int xref;               // --xref: check include => and Goto/Gosub targets exist
+    int index;              // Note contexts, extensions, labels and jumps as facts (--xref, --emit-snapshot)
+    int steps;              // Note each line's priority and a hash of what it runs (--diff, --emit-snapshot)
+    int check_patterns;     // --check-patterns: duplicate priorities, unusable patterns
+    int check_globals;      // --check-globals: ${VAR} references nothing defines
+    int check_apps;         // --check-apps: unknown applications and functions, argument counts
+    const app_registry *apps;   // --app-registry: names added to the built-in ones (NULL = none)
+    int stats;              // --stats: time and count the validation stages
+    int profile_contexts;   // --profile-contexts: report the N costliest contexts (0 = off)
+    const char *snapshot;   // --emit-snapshot: write the results here too (NULL = off)
+    int name_files;         // Text output names the file on each line (results printed one at a time)
+} validator_options;
+
+/* Diagnostic codes; the table below must stay in the same order */
+typedef enum {
+    E_FILE_OPEN,
+    E_UNBALANCED_CLOSE,
+    E_UNBALANCED,
+    E_VAR_UNCLOSED,
+    E_EXPR_UNCLOSED,
+    E_CONTEXT_MALFORMED,
+    E_CONTEXT_EMPTY,
+    E_LABEL_UNCLOSED,
+    E_LABEL_EMPTY,
+    E_PRIORITY_INVALID,
+    E_PRIORITY_RANGE,
+    E_EXTEN_ARROW,
+    E_EXTEN_KEYWORD,
+    E_SAME_FORMAT,
+    E_EXTEN_FORMAT,
+    E_INCLUDE_ARROW,
+    E_INCLUDE_EMPTY,
+    E_SWITCH_ARROW,
+    W_UNKNOWN_DIRECTIVE,
+    E_HASH_INCLUDE_EMPTY,
+    E_HASH_INCLUDE_MISSING,
+    W_HASH_EXEC,
+    E_XREF_INCLUDE,
+    E_XREF_CONTEXT,
+    E_XREF_EXTEN,
+    E_XREF_LABEL,
+    E_EXTEN_DUPLICATE,
+    W_PATTERN_UNUSED,
+    E_SAME_NO_EXTEN,
+    W_LABEL_DUPLICATE,
+    W_EOL_MIXED,
+    E_IGNOREPAT_ARROW,
+    E_IGNOREPAT_EMPTY,
+    W_VAR_UNDEFINED,
+    E_EXPR_OPERAND,
+    E_EXPR_OPERATOR,
+    E_EXPR_TERNARY,
+    W_APP_UNKNOWN,
+    W_FUNC_UNKNOWN,
+    W_APP_ARGS,
+    DIAG_CODE_COUNT
+} diag_code;
+
+// Bump when a change alters the diagnostics produced for the same input (or the cache file layout)
+#define CACHE_FORMAT 9
+
+static const struct {
+    const char *id;
+    const char *description;
+} diag_info[DIAG_CODE_COUNT] = {
+    { "E_FILE_OPEN",         "Input file cannot be opened" },
+    { "E_UNBALANCED_CLOSE",  "Closing delimiter without a matching opener" },
+    { "E_UNBALANCED",        "Unbalanced parentheses, brackets or braces" },
+    { "E_VAR_UNCLOSED",      "Unclosed ${...} variable reference" },
+    { "E_EXPR_UNCLOSED",     "Unclosed $[...] expression" },
+    { "E_CONTEXT_MALFORMED", "Context header without a closing ']'" },
+    { "E_CONTEXT_EMPTY",     "Context header with an empty name" },
+    { "E_LABEL_UNCLOSED",    "Priority label without a closing ')'" },
+    { "E_LABEL_EMPTY",       "Empty priority label" },
+    { "E_PRIORITY_INVALID",  "Priority is not a number, 'n' or 'hint'" },
+    { "E_PRIORITY_RANGE",    "Priority is less than 1" },
+    { "E_EXTEN_ARROW",       "Extension without '=>'" },
+    { "E_EXTEN_KEYWORD",     "Extension line that isn't 'exten' or 'same'" },
+    { "E_SAME_FORMAT",       "'same' line without priority and application" },
+    { "E_EXTEN_FORMAT",      "'exten' line without pattern, priority and application" },
+    { "E_INCLUDE_ARROW",     "Include without '=>'" },
+    { "E_INCLUDE_EMPTY",     "Include without a context name" },
+    { "E_SWITCH_ARROW",      "Switch without '=>'" },
+    { "W_UNKNOWN_DIRECTIVE", "Unrecognized line inside a context" },
+    { "E_HASH_INCLUDE_EMPTY",   "#include without a file name" },
+    { "E_HASH_INCLUDE_MISSING", "#include of a file that doesn't exist" },
+    { "W_HASH_EXEC",            "#exec is not run, so its output is not checked" },
+    { "E_XREF_INCLUDE",      "include => names a context that isn't defined" },
+    { "E_XREF_CONTEXT",      "Goto/Gosub target context isn't defined" },
+    { "E_XREF_EXTEN",        "Goto/Gosub target extension isn't defined" },
+    { "E_XREF_LABEL",        "Goto/Gosub target label isn't defined" },
+    { "E_EXTEN_DUPLICATE",   "Extension priority defined twice in one context" },
+    { "W_PATTERN_UNUSED",    "Pattern whose every match is an earlier literal extension" },
+    { "E_SAME_NO_EXTEN",     "'same' line before any 'exten' line in its context" },
+    { "W_LABEL_DUPLICATE",   "Priority label used twice in one extension" },
+    { "W_EOL_MIXED",         "File mixes CRLF and LF line endings" },
+    { "E_IGNOREPAT_ARROW",   "ignorepat without '=>'" },
+    { "E_IGNOREPAT_EMPTY",   "ignorepat without a pattern" },
+    { "W_VAR_UNDEFINED",     "${...} reference to a variable nothing sets" },
+    { "E_EXPR_OPERAND",      "$[...] operator without an operand" },
+    { "E_EXPR_OPERATOR",     "$[...] operands without an operator between them" },
+    { "E_EXPR_TERNARY",      "$[...] '?' and '::' that don't pair up" },
+    { "W_APP_UNKNOWN",       "Application that isn't built in or in --app-registry" },
+    { "W_FUNC_UNKNOWN",      "Dialplan function that isn't built in or in --app-registry" },
+    { "W_APP_ARGS",          "Application or function given too few or too many arguments" },
+};
+
+typedef enum {
+    DIAG_ERROR,
+    DIAG_WARNING
+} diag_level;
+
+#define NO_TEXT UINT32_MAX
+
+/* One diagnostic; strings are offsets into the owning diag_buffer's text arena */
+typedef struct {
+    uint16_t code;     // diag_code
+    uint8_t level;     // diag_level
+    int line;          // 0 for file-level problems
+    int column;        // 1-based; 0 if unknown
+    int span;          // Bytes covered from column; 0 if unknown
+    uint32_t context;  // Context name, or NO_TEXT
+    uint32_t message;
+} diagnostic;
+
+typedef enum {
+    FACT_INCLUDE,          // #include: text = file name as written
+    FACT_TRYINCLUDE,
+    FACT_CONTEXT,          // --xref: text = context defined
+    FACT_EXTEN,            // text = extension pattern defined in context
+    FACT_LABEL,            // text = priority label defined on exten
+    FACT_INCLUDE_CONTEXT,  // include =>: text = context included
+    FACT_GOTO,             // Goto/GotoIf: text = target context, exten, label = target
+    FACT_GOSUB,            // Gosub/GosubIf, likewise
+    FACT_PRIORITY,         // --check-patterns: text = extension[/callerid], label = priority, exten = step (--diff)
+    FACT_SAME,             // same line: label = priority, exten = step (--diff)
+    FACT_VAR_SET,          // --check-globals: text = variable [globals], Set() etc. define
+    FACT_VAR_REF           // text = variable a ${...} reads
+} fact_kind;
+
+/*
+ * Something a file defines or refers to that can only be checked once every
+ * file is done (a #include target, a Goto destination); located like a
+ * diagnostic
+ */
+typedef struct {
+    uint8_t kind;      // fact_kind
+    int line;
+    int column;
+    int span;
+    uint32_t context;  // Context of the line
+    uint32_t text;
+    uint32_t exten;    // NO_TEXT unless the kind uses it
+    uint32_t label;
+} fact;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t off;      // Offset + 1 in the arena, 0 = empty slot
+} name_slot;
+
+/* Diagnostics for one file, collected while validating and emitted once at the end */
+typedef struct {
+    diagnostic *items;
+    size_t count;
+    size_t cap;
+    fact *facts;       // Share the text arena with the diagnostics
+    size_t fact_count;
+    size_t fact_cap;
+    char *text;        // NUL-separated strings
+    size_t text_len;
+    size_t text_cap;
+    name_slot *names;  // Intern index over the arena (see diag_intern())
+    size_t names_cap;  // Power of two
+    size_t name_count;
+} diag_buffer;
+
+typedef struct {
+    uint64_t key;
+    uint64_t value;        // 0 = empty slot
+} id_slot;
+
+/* Open-addressing map from exact 64-bit keys to nonzero values */
+typedef struct {
+    id_slot *slots;
+    size_t count;
+    size_t nslots;         // Power of two
+} id_map;
+
+typedef struct block_cache block_cache;
+
+/*
+ * --stats counters. Every validator_state (one per file, or per chunk of a
+ * split file) has its own, so threads never share them; they are summed
+ * once a file or chunk is done. Stage times are thread time, so with
+ * several workers they can add up to more than the elapsed time.
+ */
+typedef enum {
+    STAGE_READ,              // Counts bytes: open, map or read() the input
+    STAGE_CLASSIFY,          // Counts lines from here on
+    STAGE_EXTENSION,
+    STAGE_BALANCED,
+    STAGE_VARIABLES,
+    STAGE_INCLUDE,
+    STAGE_OUTPUT,            // Counts diagnostics
+    STAGE_COUNT
+} stat_stage;
+
+typedef struct {
+    uint64_t count[STAGE_COUNT];
+    uint64_t ns[STAGE_COUNT];
+    int longest_line;        // Bytes, without leading whitespace or the newline...
+    int longest_at;          // ...and its line number
+    int deepest;             // Most (), [] and {} open at once in an application
+    int deepest_at;
+    int longest_file;        // Result index of each, for the caller that sums files
+    int deepest_file;
+} validator_stats;
+
+/*
+ * --profile-contexts costs, kept per validator_state like the stats. The
+ * walk is charged to the current context a span at a time, from one header
+ * to the next: the thread's CPU clock is read once per span rather than per
+ * line, and bytes and lines are differences of position. Spans of the same
+ * name add up wherever they are, so a context split across chunks or files
+ * is one.
+ */
+typedef struct {
+    uint32_t name;           // Offset in the profile's names ("" before any context)
+    uint64_t bytes;
+    uint64_t lines;
+    uint64_t diagnostics;    // Counted from the results, late ones (--xref etc.) included
+    uint64_t ns;
+} context_cost;
+
+typedef struct {
+    diag_buffer names;       // Only the intern index is used
+    id_map index;            // Name offset -> item + 1
+    context_cost *items;
+    size_t count;
+    size_t cap;
+    const char *mark;        // The span being charged: where it started...
+    int line;                // ...the lines before it...
+    uint64_t since;          // ...and when
+} context_profile;
+
+/*
+ * Priority sequence of the current extension (see track_priority()): the
+ * pattern of the latest exten line, and the priorities and labels given to
+ * it since, cleared whenever the pattern changes. Labels are kept by hash
+ * in a small table whose slots are cleared by bumping the generation.
+ */
+#define SEQ_PRIORITIES 256   // Priorities below this are kept in the bitset
+#define SEQ_LABELS 64        // Power of two
+#define SEQ_LABELS_MAX 48    // Labels past this many aren't checked
+
+typedef struct {
+    uint64_t hash;
+    int line;
+    uint32_t gen;      // Slot is in use if equal to the sequence's generation
+} seq_label;
+
+typedef struct {
+    const char *exten;           // Pattern (with any /callerid) in the buffer; NULL = none yet
+    size_t exten_len;
+    char *copy;                  // Streams: lines don't last, so exten points here instead
+    size_t copy_cap;
+    long last;                   // Priority of the previous line, for 'n' (-1 = unknown)
+    long max;                    // Highest priority in this extension so far (-1 = none)
+    uint64_t seen[SEQ_PRIORITIES / 64];
+    int seen_line[SEQ_PRIORITIES];  // Where each priority in seen was defined
+    uint32_t gen;
+    int labels;
+    seq_label label[SEQ_LABELS];
+} priority_seq;
+
+/*
+ * --check-globals: variables the current context has already set or read,
+ * so each is noted once per context rather than at every use. Slots are
+ * cleared by bumping the generation, as in priority_seq.
+ */
+#define VAR_NAMES 256        // Power of two
+#define VAR_NAMES_MAX 192    // Names past this many are noted at every use
+
+typedef struct {
+    uint64_t key;      // Interned name offset * 2, + 1 for a read
+    uint32_t gen;      // In use if equal to the table's generation + 1
+} var_slot;
+
+typedef struct {
+    uint32_t gen;
+    int count;
+    var_slot slot[VAR_NAMES];
+} var_names;
+
+/* What pbx_config makes of a context's lines */
+typedef enum {
+    SECTION_DIALPLAN,   // Any other context, or none yet
+    SECTION_GENERAL,    // [general]: settings
+    SECTION_GLOBALS     // [globals]: global variables
+} section_kind;
+
+typedef enum {
+    EOL_UNKNOWN,    // No complete line yet
+    EOL_LF,
+    EOL_CRLF
+} eol_style;
+
+typedef struct {
+    const validator_options *opts;
+    int errors;
+    int warnings;
+    int line_num;
+    int in_context;
+    int stopped;               // --max-errors reached
+    uint32_t context;          // Current context name: offset + 1 in diags (0 = none)
+    uint32_t exten;            // --xref: pattern of the latest exten line, for 'same' (likewise)
+    uint8_t section;           // section_kind of the current context
+    priority_seq seq;
+    var_names vars;
+    validator_stats *stats;    // --stats: this state's counters (NULL = off)
+    context_profile *profile;  // --profile-contexts: this state's costs (NULL = off)
+    const char *line_start;    // Raw start of the current line, for columns
+    uint8_t eol;               // eol_style of the first line
+    int eol_mixed;             // First line that ends the other way (0 = none)
+    diag_buffer diags;
+    block_cache *resident;    // --watch: per-context results kept between runs
+} validator_state;
+
+/*
+ * Read-only slice of the input (a line or a field within one).
+ * Views point straight into the mapped file and are never NUL-terminated,
+ * so every helper below works on (ptr, len) and never writes to the text.
+ */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} str_view;
+
+static str_view make_view(const char *ptr, size_t len) {
+    str_view v = { ptr, len };
+    return v;
+}
+
+#define NO_VIEW make_view(NULL, 0)
+
+/* Sub-view from p to the end of v */
+static str_view view_from(str_view v, const char *p) {
+    return make_view(p, v.len - (size_t)(p - v.ptr));
+}
+
+/* Sub-view from the start of v up to (not including) p */
+static str_view view_until(str_view v, const char *p) {
+    return make_view(v.ptr, (size_t)(p - v.ptr));
+}
+
+static const char *view_chr(str_view v, char c) {
+    return v.len ? memchr(v.ptr, c, v.len) : NULL;
+}
+
+/* Find a two-character token such as "=>" */
+static const char *view_find2(str_view v, char a, char b) {
+    const char *p = v.ptr, *end = v.ptr + v.len;
+    while (p < end && (p = memchr(p, a, (size_t)(end - p))) != NULL) {
+        if (p + 1 < end && p[1] == b) return p;
+        p++;
+    }
+    return NULL;
+}
+
+static int view_eq(str_view v, const char *s) {
+    size_t n = strlen(s);
+    return v.len == n && memcmp(v.ptr, s, n) == 0;
+}
+
+static int view_eq_ci(str_view v, const char *s) {
+    size_t n = strlen(s);
+    return v.len == n && strncasecmp(v.ptr, s, n) == 0;
+}
+
+static int view_prefix_ci(str_view v, const char *s) {
+    size_t n = strlen(s);
+    return v.len >= n && strncasecmp(v.ptr, s, n) == 0;
+}
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* 64-bit content hash, 8 bytes per step (not cryptographic) */
+static uint64_t hash_bytes(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = data;
+    uint64_t h = seed ^ (len * 0x9E3779B97F4A7C15ULL);
+    
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ mix64(w)) * 0x9E3779B97F4A7C15ULL;
+        h = (h << 29) | (h >> 35);
+        p += 8;
+        len -= 8;
+    }
+    
+    uint64_t w = 0;
+    memcpy(&w, p, len);
+    return mix64(h ^ mix64(w ^ len));
+}
+
+static uint64_t id_map_get(const id_map *m, uint64_t key) {
+    if (!m->nslots) return 0;
+    for (size_t i = (size_t)mix64(key) & (m->nslots - 1);; i = (i + 1) & (m->nslots - 1)) {
+        if (!m->slots[i].value || m->slots[i].key == key) return m->slots[i].value;
+    }
+}
+
+/* Slot for key, added with value 0 (for the caller to set) if new; NULL on OOM */
+static id_slot *id_map_slot(id_map *m, uint64_t key) {
+    if ((m->count + 1) * 2 > m->nslots) {
+        size_t nslots = m->nslots ? m->nslots * 2 : 256;
+        id_slot *slots = calloc(nslots, sizeof(id_slot));
+        if (!slots) return NULL;
+        for (size_t e = 0; e < m->nslots; e++) {
+            if (!m->slots[e].value) continue;
+            size_t i = (size_t)mix64(m->slots[e].key) & (nslots - 1);
+            while (slots[i].value) i = (i + 1) & (nslots - 1);
+            slots[i] = m->slots[e];
+        }
+        free(m->slots);
+        m->slots = slots;
+        m->nslots = nslots;
+    }
+    
+    size_t i = (size_t)mix64(key) & (m->nslots - 1);
+    while (m->slots[i].value && m->slots[i].key != key) i = (i + 1) & (m->nslots - 1);
+    if (!m->slots[i].value) {
+        m->slots[i].key = key;
+        m->count++;
+    }
+    return &m->slots[i];
+}
+
+/*
+ * Diagnostics
+ *
+ * report() records a diagnostic in the state's diag_buffer instead of
+ * writing it out; the records are emitted once, in file order, as text,
+ * JSON or SARIF (see emit_results()).
+ */
+static int diag_reserve_text(diag_buffer *d, size_t need) {
+    if (d->text_len + need <= d->text_cap) return 1;
+    size_t cap = d->text_cap ? d->text_cap : 4096;
+    while (cap < d->text_len + need) cap *= 2;
+    if (cap > UINT32_MAX) return 0;
+    char *text = realloc(d->text, cap);
+    if (!text) return 0;
+    d->text = text;
+    d->text_cap = cap;
+    return 1;
+}
+
+static uint32_t diag_add_text(diag_buffer *d, const char *s, size_t len) {
+    // s may point into the arena itself (re-interning a name), which can move
+    uintptr_t base = (uintptr_t)d->text, at = (uintptr_t)s;
+    int inside = d->text && at >= base && at < base + d->text_len;
+    
+    if (!diag_reserve_text(d, len + 1)) return NO_TEXT;
+    if (inside) s = d->text + (at - base);
+    uint32_t off = (uint32_t)d->text_len;
+    memcpy(d->text + off, s, len);
+    d->text[off + len] = '\0';
+    d->text_len += len + 1;
+    return off;
+}
+
+static uint32_t diag_vformat(diag_buffer *d, const char *fmt, va_list ap) {
+    va_list copy;
+    va_copy(copy, ap);
+    int len = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    if (len < 0 || !diag_reserve_text(d, (size_t)len + 1)) return NO_TEXT;
+    
+    uint32_t off = (uint32_t)d->text_len;
+    vsnprintf(d->text + off, (size_t)len + 1, fmt, ap);
+    d->text_len += (size_t)len + 1;
+    return off;
+}
+
+static const char *diag_text(const diag_buffer *d, uint32_t off) {
+    return off == NO_TEXT ? NULL : d->text + off;
+}
+
+static int diag_push(diag_buffer *d, const diagnostic *item) {
+    if (d->count == d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 64;
+        diagnostic *items = realloc(d->items, cap * sizeof(diagnostic));
+        if (!items) return 0;
+        d->items = items;
+        d->cap = cap;
+    }
+    d->items[d->count++] = *item;
+    return 1;
+}
+
+static int fact_push(diag_buffer *d, const fact *item) {
+    if (d->fact_count == d->fact_cap) {
+        size_t cap = d->fact_cap ? d->fact_cap * 2 : 16;
+        fact *facts = realloc(d->facts, cap * sizeof(fact));
+        if (!facts) return 0;
+        d->facts = facts;
+        d->fact_cap = cap;
+    }
+    d->facts[d->fact_count++] = *item;
+    return 1;
+}
+
+static void diag_free(diag_buffer *d) {
+    free(d->items);
+    free(d->facts);
+    free(d->text);
+    free(d->names);
+    memset(d, 0, sizeof(*d));
+}
+
+/* Empty d but keep its memory, so the next file on the thread starts warm */
+static void diag_clear(diag_buffer *d) {
+    d->count = 0;
+    d->fact_count = 0;
+    d->text_len = 0;
+    d->name_count = 0;
+    if (d->names) memset(d->names, 0, d->names_cap * sizeof(name_slot));
+}
+
+/* Diagnostics from first_late on were found after the rest; interleave them by line */
+static void merge_late_diags(diag_buffer *d, size_t first_late) {
+    size_t n = d->count;
+    if (first_late == 0 || first_late == n || d->items[first_late - 1].line <= d->items[first_late].line) {
+        return;  // Already in order
+    }
+    
+    diagnostic *merged = malloc(n * sizeof(diagnostic));
+    if (!merged) return;  // Out of order is still correct, just less tidy
+    
+    size_t i = 0, j = first_late, k = 0;
+    while (i < first_late && j < n) {
+        merged[k++] = (d->items[j].line < d->items[i].line) ? d->items[j++] : d->items[i++];
+    }
+    while (i < first_late) merged[k++] = d->items[i++];
+    while (j < n) merged[k++] = d->items[j++];
+    free(d->items);
+    d->items = merged;
+    d->cap = n;
+}
+
+/*
+ * Names (contexts, extension patterns, labels) are interned: each distinct
+ * one is stored once in the arena and referred to by its 32-bit offset,
+ * found through an open-addressing index. NO_TEXT on OOM.
+ */
+static uint32_t diag_intern(diag_buffer *d, const char *s, size_t len) {
+    uint32_t h = (uint32_t)hash_bytes(s, len, 0);
+    
+    if ((d->name_count + 1) * 2 > d->names_cap) {
+        size_t cap = d->names_cap ? d->names_cap * 2 : 64;
+        name_slot *names = calloc(cap, sizeof(name_slot));
+        if (!names) return NO_TEXT;
+        for (size_t i = 0; i < d->names_cap; i++) {
+            if (!d->names[i].off) continue;
+            size_t j = d->names[i].hash & (cap - 1);
+            while (names[j].off) j = (j + 1) & (cap - 1);
+            names[j] = d->names[i];
+        }
+        free(d->names);
+        d->names = names;
+        d->names_cap = cap;
+    }
+    
+    size_t i = h & (d->names_cap - 1);
+    for (; d->names[i].off; i = (i + 1) & (d->names_cap - 1)) {
+        const char *name = d->text + d->names[i].off - 1;
+        if (d->names[i].hash == h && strncmp(name, s, len) == 0 && name[len] == '\0') {
+            return d->names[i].off - 1;
+        }
+    }
+    
+    uint32_t off = diag_add_text(d, s, len);
+    if (off == NO_TEXT) return NO_TEXT;
+    d->names[i].hash = h;
+    d->names[i].off = off + 1;
+    d->name_count++;
+    return off;
+}
+
+/* Offset of an interned name, or NO_TEXT if it isn't one */
+static uint32_t diag_find(const diag_buffer *d, const char *s, size_t len) {
+    uint32_t h = (uint32_t)hash_bytes(s, len, 0);
+    
+    if (!d->names_cap) return NO_TEXT;
+    for (size_t i = h & (d->names_cap - 1); d->names[i].off; i = (i + 1) & (d->names_cap - 1)) {
+        const char *name = d->text + d->names[i].off - 1;
+        if (d->names[i].hash == h && strncmp(name, s, len) == 0 && name[len] == '\0') {
+            return d->names[i].off - 1;
+        }
+    }
+    return NO_TEXT;
+}
+
+/* Intern a NUL-terminated name; NULL and "" give NO_TEXT */
+static uint32_t diag_name(diag_buffer *d, const char *s) {
+    return (s && s[0]) ? diag_intern(d, s, strlen(s)) : NO_TEXT;
+}
+
+/* Copy one diagnostic from src to dst along with its strings */
+static int diag_copy(diag_buffer *dst, const diag_buffer *src, const diagnostic *item, int line_offset) {
+    diagnostic copy = *item;
+    const char *message = diag_text(src, item->message);
+    const char *context = diag_text(src, item->context);
+    
+    if (copy.line > 0) copy.line += line_offset;
+    copy.message = message ? diag_add_text(dst, message, strlen(message)) : NO_TEXT;
+    copy.context = diag_name(dst, context);
+    return diag_push(dst, &copy);
+}
+
+static int fact_copy(diag_buffer *dst, const diag_buffer *src, const fact *item, int line_offset) {
+    fact copy = *item;
+    const char *text = diag_text(src, item->text);
+    const char *context = diag_text(src, item->context);
+    
+    const char *exten = diag_text(src, item->exten);
+    const char *label = diag_text(src, item->label);
+    
+    copy.line += line_offset;
+    copy.text = diag_name(dst, text);
+    copy.context = diag_name(dst, context);
+    copy.exten = diag_name(dst, exten);
+    copy.label = diag_name(dst, label);
+    return fact_push(dst, &copy);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Start timing a stage; free when --stats is off */
+static uint64_t stat_start(const validator_state *state) {
+    return state->stats ? now_ns() : 0;
+}
+
+static void stat_stop(validator_state *state, stat_stage stage, uint64_t start, uint64_t count) {
+    if (!state->stats) return;
+    state->stats->count[stage] += count;
+    state->stats->ns[stage] += now_ns() - start;
+}
+
+/* Sum counters; file is the result index of from's lines (-1 to keep its own) */
+static void stats_add(validator_stats *to, const validator_stats *from, int file) {
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        to->count[i] += from->count[i];
+        to->ns[i] += from->ns[i];
+    }
+    if (from->longest_line > to->longest_line) {
+        to->longest_line = from->longest_line;
+        to->longest_at = from->longest_at;
+        to->longest_file = file >= 0 ? file : from->longest_file;
+    }
+    if (from->deepest > to->deepest) {
+        to->deepest = from->deepest;
+        to->deepest_at = from->deepest_at;
+        to->deepest_file = file >= 0 ? file : from->deepest_file;
+    }
+}
+
+/* Record a diagnostic for the current line; at/span locate it within the line if known */
+static void report(validator_state *state, diag_level level, diag_code code,
+                   const char *at, size_t span, const char *fmt, ...) {
+    diagnostic item;
+    va_list ap;
+    
+    if (level == DIAG_ERROR) state->errors++;
+    else state->warnings++;
+    
+    item.code = (uint16_t)code;
+    item.level = (uint8_t)level;
+    item.line = state->line_num;
+    item.column = (at && state->line_start) ? (int)(at - state->line_start) + 1 : 0;
+    item.span = (int)span;
+    item.context = state->context ? state->context - 1 : NO_TEXT;
+    va_start(ap, fmt);
+    item.message = diag_vformat(&state->diags, fmt, ap);
+    va_end(ap);
+    diag_push(&state->diags, &item);
+    
+    if (level == DIAG_ERROR && state->opts && state->opts->max_errors > 0 &&
+        state->errors >= state->opts->max_errors) {
+        state->stopped = 1;
+    }
+}
+
+/* Offset of a view that is already a name in the arena (see state_name()), else NO_TEXT */
+static uint32_t arena_name(const diag_buffer *d, str_view v) {
+    uintptr_t p = (uintptr_t)v.ptr, base = (uintptr_t)d->text;
+    return (v.ptr && d->text && p >= base && p < base + d->text_len) ? (uint32_t)(p - base) : NO_TEXT;
+}
+
+/* Intern v unless ref already locates it */
+static uint32_t fact_text(diag_buffer *d, str_view v, uint32_t ref) {
+    if (ref != NO_TEXT) return ref;
+    return v.ptr ? diag_intern(d, v.ptr, v.len) : NO_TEXT;
+}
+
+/* Record a fact about the current line, located at at; exten/label may be NULL views */
+static void note_fact(validator_state *state, fact_kind kind, str_view at,
+                      str_view text, str_view exten, str_view label) {
+    fact item;
+    
+    item.kind = (uint8_t)kind;
+    item.line = state->line_num;
+    item.column = state->line_start ? (int)(at.ptr - state->line_start) + 1 : 0;
+    item.span = (int)at.len;
+    item.context = state->context ? state->context - 1 : NO_TEXT;
+    
+    // Interning may move the arena, so find views into it (names from state_name()) first
+    uint32_t exten_ref = arena_name(&state->diags, exten), label_ref = arena_name(&state->diags, label);
+    item.text = fact_text(&state->diags, text, arena_name(&state->diags, text));
+    item.exten = fact_text(&state->diags, exten, exten_ref);
+    item.label = fact_text(&state->diags, label, label_ref);
+    fact_push(&state->diags, &item);
+}
+
+/*
+ * Fold diagnostics produced elsewhere (a chunk, a cached block) into state,
+ * shifting their line numbers by line_offset and honoring --max-errors.
+ * Facts are kept up to the line where that stopped the file.
+ */
+static void state_absorb(validator_state *state, const diag_buffer *src, int line_offset) {
+    int last_line = INT_MAX;
+    
+    if (state->stopped) return;
+    for (size_t i = 0; i < src->count && !state->stopped; i++) {
+        const diagnostic *item = &src->items[i];
+        diag_copy(&state->diags, src, item, line_offset);
+        
+        if (item->level == DIAG_WARNING) {
+            state->warnings++;
+        } else if (++state->errors == (state->opts ? state->opts->max_errors : 0)) {
+            state->stopped = 1;
+            last_line = item->line;
+        }
+    }
+    for (size_t i = 0; i < src->fact_count && src->facts[i].line <= last_line; i++) {
+        fact_copy(&state->diags, src, &src->facts[i], line_offset);
+    }
+}
+
+/* Trim leading/trailing whitespace */
+static str_view trim(str_view v) {
+    while (v.len && isspace((unsigned char)*v.ptr)) { v.ptr++; v.len--; }
+    while (v.len && isspace((unsigned char)v.ptr[v.len - 1])) v.len--;
+    return v;
+}
+
+/*
+ * Name of a [context] header line (already trimmed), following the same
+ * rules as parse_context(); returns 0 if the header is malformed or empty
+ */
+static int header_name(str_view line, str_view *name) {
+    const char *close = view_chr(line, ']');
+    if (!close) return 0;
+    *name = trim(make_view(line.ptr + 1, (size_t)(close - line.ptr - 1)));
+    return name->len > 0;
+}
+
+/* Name behind a state's context/exten reference ("" for none) */
+static str_view state_name(const validator_state *state, uint32_t ref) {
+    if (!ref) return make_view("", 0);
+    const char *name = state->diags.text + ref - 1;
+    return make_view(name, strlen(name));
+}
+
+static uint32_t state_intern(validator_state *state, str_view name) {
+    uint32_t off = name.len ? diag_intern(&state->diags, name.ptr, name.len) : NO_TEXT;
+    return off == NO_TEXT ? 0 : off + 1;
+}
+
+static void set_context(validator_state *state, str_view name) {
+    state->context = state_intern(state, name);
+    state->section = view_eq_ci(name, "globals") ? SECTION_GLOBALS :
+                     view_eq_ci(name, "general") ? SECTION_GENERAL : SECTION_DIALPLAN;
+}
+
+/* The profile's entry for a context name, added if new; NULL on OOM */
+static context_cost *profile_entry(context_profile *p, const char *name, size_t len) {
+    uint32_t off = diag_intern(&p->names, name, len);
+    if (off == NO_TEXT) return NULL;
+    
+    id_slot *slot = id_map_slot(&p->index, off);
+    if (!slot) return NULL;
+    if (!slot->value) {
+        if (p->count == p->cap) {
+            size_t cap = p->cap ? p->cap * 2 : 64;
+            context_cost *items = realloc(p->items, cap * sizeof(context_cost));
+            if (!items) return NULL;
+            p->items = items;
+            p->cap = cap;
+        }
+        memset(&p->items[p->count], 0, sizeof(context_cost));
+        p->items[p->count].name = off;
+        slot->value = ++p->count;
+    }
+    return &p->items[slot->value - 1];
+}
+
+/* Thread CPU time: a span isn't charged for the time the thread was preempted */
+static uint64_t thread_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Start a span at at, after line lines */
+static void profile_begin(context_profile *p, const char *at, int line) {
+    p->mark = at;
+    p->line = line;
+    p->since = thread_ns();
+}
+
+/* Charge the span up to at (line lines in) to the current context and start the next */
+static void profile_span(validator_state *state, const char *at, int line) {
+    context_profile *p = state->profile;
+    str_view name = state_name(state, state->context);
+    context_cost *c = line > p->line ? profile_entry(p, name.ptr, name.len) : NULL;  // A header first is no span
+    uint64_t now = thread_ns();
+    
+    if (c) {
+        // --max-errors can stop a walk before the position it reports, so at may be behind
+        if (at > p->mark) c->bytes += (uint64_t)(at - p->mark);
+        c->lines += (uint64_t)(line - p->line);
+        c->ns += now - p->since;
+    }
+    if (at > p->mark) p->mark = at;
+    p->line = line;
+    p->since = now;
+}
+
+/* Add from's costs to to's, by name */
+static void profile_add(context_profile *to, const context_profile *from) {
+    for (size_t i = 0; i < from->count; i++) {
+        const context_cost *f = &from->items[i];
+        const char *name = from->names.text + f->name;
+        context_cost *c = profile_entry(to, name, strlen(name));
+        if (!c) return;
+        c->bytes += f->bytes;
+        c->lines += f->lines;
+        c->diagnostics += f->diagnostics;
+        c->ns += f->ns;
+    }
+}
+
+static void profile_free(context_profile *p) {
+    diag_free(&p->names);
+    free(p->index.slots);
+    free(p->items);
+    memset(p, 0, sizeof(*p));
+}
+
+/*
+ * Fused delimiter/variable scanner
+ *
+ * One table-driven pass over the data after '=>' finds the top-level comma
+ * positions (ignoring commas inside () and []) and, for the application
+ * field, the paren/bracket/brace balance and whether a ${...} or $[...]
+ * is left open. check_balanced() and check_variable_syntax() only report
+ * from the result.
+ */
+enum {
+    SC_NONE,
+    SC_LPAREN, SC_RPAREN,
+    SC_LBRACKET, SC_RBRACKET,
+    SC_LBRACE, SC_RBRACE,
+    SC_COMMA,
+    SC_DOLLAR
+};
+
+static const unsigned char scan_class[256] = {
+    ['('] = SC_LPAREN,   [')'] = SC_RPAREN,
+    ['['] = SC_LBRACKET, [']'] = SC_RBRACKET,
+    ['{'] = SC_LBRACE,   ['}'] = SC_RBRACE,
+    [','] = SC_COMMA,    ['$'] = SC_DOLLAR
+};
+
+#define MAX_FIELDS 3
+
+typedef struct {
+    str_view field[MAX_FIELDS];  // Untrimmed fields; the last one runs to the end
+    int nfields;
+    
+    // Application field
+    int has_paren;
+    int parens, brackets, braces;   // Final balance
+    const char *overclose;          // First closing delimiter that went negative
+    const char *unclosed;           // Outermost opening delimiter never closed
+    int depth;                      // Most delimiters open at once
+    char open_var;                  // '{' or '[' if a ${...} / $[...] is never closed
+    const char *open_var_at;        // Its '$'
+    const char *expr;               // First $[ (NULL = none)
+} line_scan;
+
+/* Split data into app_field + 1 fields and scan the last one */
+static void scan_fields(str_view data, int app_field, line_scan *scan) {
+    const char *p = data.ptr, *end = data.ptr + data.len;
+    const char *field_start = p;
+    int parens = 0, brackets = 0;
+    int nf = 0;
+    
+    memset(scan, 0, sizeof(*scan));
+    
+    // Fields before the application: only top-level commas matter
+    for (; p < end && nf < app_field; p++) {
+        switch (scan_class[(unsigned char)*p]) {
+            case SC_LPAREN: parens++; break;
+            case SC_RPAREN: parens--; break;
+            case SC_LBRACKET: brackets++; break;
+            case SC_RBRACKET: brackets--; break;
+            case SC_COMMA:
+                if (parens == 0 && brackets == 0) {
+                    scan->field[nf++] = make_view(field_start, (size_t)(p - field_start));
+                    field_start = p + 1;
+                }
+                break;
+        }
+    }
+    
+    scan->field[nf] = make_view(field_start, (size_t)(end - field_start));
+    scan->nfields = nf + 1;
+    if (nf < app_field) {
+        return;  // Too few fields; the caller reports it
+    }
+    
+    // Application field: balance and variable closure in the same pass
+    char var = 0;
+    int var_depth = 0, depth = 0;
+    const char *opened[3] = { NULL, NULL, NULL };   // Where each kind last went from 0 to 1 open
+    
+    for (p = field_start; p < end; p++) {
+        switch (scan_class[(unsigned char)*p]) {
+            case SC_LPAREN:
+                scan->has_paren = 1;
+                if (scan->parens++ == 0) opened[0] = p;
+                if (++depth > scan->depth) scan->depth = depth;
+                break;
+            case SC_RPAREN:
+                if (--scan->parens < 0 && !scan->overclose) scan->overclose = p;
+                depth--;
+                break;
+            case SC_LBRACKET:
+                if (scan->brackets++ == 0) opened[1] = p;
+                if (++depth > scan->depth) scan->depth = depth;
+                if (var == '[') var_depth++;
+                break;
+            case SC_RBRACKET:
+                if (--scan->brackets < 0 && !scan->overclose) scan->overclose = p;
+                depth--;
+                if (var == '[' && --var_depth == 0) var = 0;
+                break;
+            case SC_LBRACE:
+                if (scan->braces++ == 0) opened[2] = p;
+                if (++depth > scan->depth) scan->depth = depth;
+                if (var == '{') var_depth++;
+                break;
+            case SC_RBRACE:
+                if (--scan->braces < 0 && !scan->overclose) scan->overclose = p;
+                depth--;
+                if (var == '{' && --var_depth == 0) var = 0;
+                break;
+            case SC_DOLLAR:
+                if (!scan->expr && p + 1 < end && p[1] == '[') scan->expr = p;
+                // Only the outermost reference is tracked; nested ones close with it
+                if (!var && p + 1 < end && (p[1] == '{' || p[1] == '[')) {
+                    var = p[1];
+                    var_depth = 0;
+                    scan->open_var_at = p;
+                }
+                break;
+        }
+    }
+    
+    scan->open_var = var;
+    
+    // Of the kinds left open, the delimiter that opened first
+    int open[3] = { scan->parens > 0, scan->brackets > 0, scan->braces > 0 };
+    for (int i = 0; i < 3; i++) {
+        if (open[i] && (!scan->unclosed || opened[i] < scan->unclosed)) scan->unclosed = opened[i];
+    }
+}
+
+/* Check balanced delimiters - EXCLUDES quotes (too context-sensitive in Asterisk) */
+static int check_balanced(const line_scan *scan, validator_state *state) {
+    // Check for negative counts (too many closing delimiters)
+    if (scan->overclose) {
+        report(state, DIAG_ERROR, E_UNBALANCED_CLOSE, scan->overclose, 1,
+               "Unbalanced delimiters (too many closing)");
+        return 0;
+    }
+    
+    // Check final balance
+    if (scan->parens != 0 || scan->brackets != 0 || scan->braces != 0) {
+        // From the delimiter left open to the end of the application
+        str_view app = trim(scan->field[scan->nfields - 1]);
+        const char *at = scan->unclosed ? scan->unclosed : app.ptr;
+        report(state, DIAG_ERROR, E_UNBALANCED, at, (size_t)(app.ptr + app.len - at),
+               "Unbalanced delimiters (parens=%d, brackets=%d, braces=%d)",
+               scan->parens, scan->brackets, scan->braces);
+        return 0;
+    }
+    
+    return 1;
+}
+
+/*
+ * $[...] expressions
+ *
+ * Checked the way ast_expr2 tokenizes them: operands are words (which may
+ * contain ${...}), "quoted strings", nested $[...] and function calls, and
+ * must alternate with the binary operators | & = == != < > <= >= + - * / %
+ * : =~ ~~; '-' and '!' may also prefix an operand. ( and ?, whose '::'
+ * closes it, are kept on a fixed stack. Precedence never makes a
+ * well-formed expression malformed, so the check is a single left-to-right
+ * pass with no tree, and each expression costs time linear in its length.
+ */
+#define EXPR_DEPTH 32   // Groups open at once; an expression nested deeper isn't checked
+
+/* Length of the binary operator at p, 0 if there isn't one */
+static size_t expr_operator(const char *p, const char *end) {
+    char next = p + 1 < end ? p[1] : '\0';
+    
+    switch (*p) {
+        case '=': return (next == '=' || next == '~') ? 2 : 1;
+        case '<': case '>': return next == '=' ? 2 : 1;
+        case '!': return next == '=' ? 2 : 0;
+        case '~': return next == '~' ? 2 : 0;
+        case ':': return next == ':' ? 2 : 1;
+        case '|': case '&': case '+': case '-': case '*': case '/': case '%': case '?':
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* Past the ${...} or $[...] at p; NULL if it never closes */
+static const char *expr_skip_reference(const char *p, const char *end) {
+    char open = p[1], close = open == '{' ? '}' : ']';
+    int depth = 0;
+    
+    for (p++; p < end; p++) {
+        if (*p == open) depth++;
+        else if (*p == close && --depth == 0) return p + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Past the operand at p. A regex (after : or =~) may be unquoted and hold
+ * operators and parentheses, so it runs to whitespace or an unmatched ')'.
+ */
+static const char *expr_skip_operand(const char *p, const char *end, int in_call, int regex) {
+    int parens = 0;
+    
+    if (*p == '"') {
+        for (p++; p < end && *p != '"'; p++) {
+            if (*p == '\\' && p + 1 < end) p++;
+        }
+        return p < end ? p + 1 : end;
+    }
+    while (p < end && !isspace((unsigned char)*p)) {
+        if (*p == '$' && p + 1 < end && (p[1] == '{' || p[1] == '[')) {
+            p = expr_skip_reference(p, end);
+            if (!p) return end;
+            continue;
+        }
+        if (regex) {
+            if (*p == '(') parens++;
+            else if (*p == ')' && parens-- == 0) break;
+        } else if (*p == '(' || *p == ')' || *p == '"' || (*p == ',' && in_call) || expr_operator(p, end)) {
+            break;
+        }
+        p++;
+    }
+    return p;
+}
+
+/* Check the text between $[ and its ]; reports the first problem */
+static int check_expression(str_view expr, validator_state *state) {
+    char stack[EXPR_DEPTH];   // '(' group, 'f' function call, '?' ternary
+    int depth = 0;
+    int want_operand = 1, regex = 0;
+    const char *p = expr.ptr, *end = expr.ptr + expr.len;
+    const char *op = NULL;    // The operator (or '(' / ',') an operand is due after
+    size_t op_len = 0;
+    
+    while (p < end) {
+        if (isspace((unsigned char)*p)) {
+            p++;
+            continue;
+        }
+        
+        // Commas separate arguments when the innermost group is a call, ternaries aside
+        int group = depth;
+        while (group > 0 && stack[group - 1] == '?') group--;
+        int in_call = group > 0 && stack[group - 1] == 'f';
+        size_t len;
+        if (want_operand) {
+            if (*p == '(' || ((*p == '-' || *p == '!') && !regex && !(*p == '!' && p + 1 < end && p[1] == '='))) {
+                if (*p == '(') {
+                    if (depth == EXPR_DEPTH) return 1;
+                    stack[depth++] = '(';
+                }
+                op = p;
+                op_len = 1;
+                p++;
+                continue;
+            }
+            if (*p == ')' && in_call && op && *op == '(') {
+                depth--;  // Function without arguments
+                want_operand = 0;
+                p++;
+                continue;
+            }
+            if (*p == ')' || (*p == ',' && in_call) || (!regex && (len = expr_operator(p, end)) != 0)) {
+                if (!op) {
+                    report(state, DIAG_ERROR, E_EXPR_OPERAND, p, 1,
+                           "Expression starts with '%c' but needs an operand first", *p);
+                } else {
+                    report(state, DIAG_ERROR, E_EXPR_OPERAND, op, op_len,
+                           "Missing operand after '%.*s' in expression", (int)op_len, op);
+                }
+                return 0;
+            }
+            p = expr_skip_operand(p, end, in_call, regex);
+            want_operand = regex = 0;
+            continue;
+        }
+        
+        if (*p == ')' || (*p == ',' && in_call)) {
+            if (depth == 0) return 1;  // Closes outside the expression; balance is checked elsewhere
+            if (stack[depth - 1] == '?') {
+                report(state, DIAG_ERROR, E_EXPR_TERNARY, p, 1,
+                       "'?' in expression without a matching '::' before '%c'", *p);
+                return 0;
+            }
+            if (*p == ')') depth--;
+            else want_operand = 1;
+            op = p;
+            op_len = 1;
+            p++;
+            continue;
+        }
+        if (*p == '(') {
+            // NAME(args): a function call
+            if (depth == EXPR_DEPTH) return 1;
+            stack[depth++] = 'f';
+            op = p;
+            op_len = 1;
+            want_operand = 1;
+            p++;
+            continue;
+        }
+        
+        len = expr_operator(p, end);
+        if (!len) {
+            const char *word = expr_skip_operand(p, end, in_call, 0);
+            if (word == p) word = p + 1;
+            report(state, DIAG_ERROR, E_EXPR_OPERATOR, p, (size_t)(word - p),
+                   "Missing operator before '%.*s' in expression", (int)(word - p), p);
+            return 0;
+        }
+        if (len == 1 && *p == '?') {
+            if (depth == EXPR_DEPTH) return 1;
+            stack[depth++] = '?';
+        } else if (len == 2 && *p == ':') {
+            if (depth == 0 || stack[depth - 1] != '?') {
+                report(state, DIAG_ERROR, E_EXPR_TERNARY, p, 2, "'::' in expression without a '?' before it");
+                return 0;
+            }
+            depth--;
+        }
+        regex = (len == 1 && *p == ':') || (len == 2 && p[1] == '~' && *p == '=');
+        op = p;
+        op_len = len;
+        want_operand = 1;
+        p += len;
+    }
+    
+    if (want_operand && op && *op != '(') {
+        report(state, DIAG_ERROR, E_EXPR_OPERAND, op, op_len,
+               "Missing operand after '%.*s' in expression", (int)op_len, op);
+        return 0;
+    }
+    for (int i = 0; i < depth; i++) {
+        if (stack[i] != '?') continue;
+        report(state, DIAG_ERROR, E_EXPR_TERNARY, expr.ptr, expr.len, "'?' in expression without a matching '::'");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Check every $[...] in the application, nested ones included, from the first
+ * at expr. Each is checked within the ones around it, so they are only followed
+ * EXPR_DEPTH deep: deeper ones would make the cost grow with the square of the
+ * nesting ($[$[$[...]]] thousands deep) and are left unchecked.
+ */
+static int check_expressions(const char *expr, const char *end, validator_state *state) {
+    const char *outer[EXPR_DEPTH];   // Ends of the expressions p is inside
+    int depth = 0;
+    
+    for (const char *p = expr; p && p + 1 < end; p = memchr(p + 1, '$', (size_t)(end - p - 1))) {
+        if (p[1] != '[') continue;
+        while (depth > 0 && p >= outer[depth - 1]) depth--;
+        if (depth == EXPR_DEPTH) continue;
+        const char *close = expr_skip_reference(p, end);
+        if (!close) return 1;  // Unclosed: reported already
+        if (!check_expression(make_view(p + 2, (size_t)(close - p - 3)), state)) return 0;
+        outer[depth++] = close;
+    }
+    return 1;
+}
+
+/* Validate variable syntax ${...} and $[...] */
+static int check_variable_syntax(const line_scan *scan, validator_state *state) {
+    str_view app = scan->field[scan->nfields - 1];
+    
+    // An unclosed reference runs from its '$' to the end of the application
+    if (scan->open_var) {
+        str_view rest = trim(view_from(app, scan->open_var_at));
+        if (scan->open_var == '{') {
+            report(state, DIAG_ERROR, E_VAR_UNCLOSED, rest.ptr, rest.len,
+                   "Unclosed ${...} variable reference");
+        } else {
+            report(state, DIAG_ERROR, E_EXPR_UNCLOSED, rest.ptr, rest.len,
+                   "Unclosed $[...] expression");
+        }
+        return 0;
+    }
+    
+    if (scan->expr) return check_expressions(scan->expr, app.ptr + app.len, state);
+    return 1;
+}
+
+/* Parse context line [context-name] */
+static int parse_context(str_view line, validator_state *state) {
+    const char *end = view_chr(line, ']');
+    if (!end) {
+        report(state, DIAG_ERROR, E_CONTEXT_MALFORMED, line.ptr, line.len,
+               "Malformed context (missing ']')");
+        return 0;
+    }
+    
+    str_view context = trim(make_view(line.ptr + 1, (size_t)(end - line.ptr - 1)));
+    
+    if (context.len == 0) {
+        report(state, DIAG_ERROR, E_CONTEXT_EMPTY, line.ptr, (size_t)(end - line.ptr) + 1,
+               "Empty context name");
+        return 0;
+    }
+    
+    set_context(state, context);
+    if (state->opts && (state->opts->index || state->opts->check_patterns)) {
+        note_fact(state, FACT_CONTEXT, context, context, NO_VIEW, NO_VIEW);
+    }
+    return 1;
+}
+
+/* Priority field of an exten / same line */
+typedef struct {
+    str_view exten;      // exten lines: the pattern field, with any /callerid
+    str_view priority;   // Without its label; NO_VIEW if the line has no priority field
+    str_view label;      // NO_VIEW unless closed and not empty
+    const char *lparen;  // Label delimiters, NULL if absent
+    const char *rparen;
+    str_view at;         // Where to report: pattern through priority, or the priority of 'same'
+} priority_field;
+
+static void split_priority(int is_same, const line_scan *scan, priority_field *pf) {
+    int pri_field = is_same ? 0 : 1;
+    
+    pf->exten = is_same ? NO_VIEW : trim(scan->field[0]);
+    pf->priority = pf->label = NO_VIEW;
+    pf->lparen = pf->rparen = NULL;
+    pf->at = pf->exten;
+    if (scan->nfields <= pri_field) return;
+    
+    str_view priority = trim(scan->field[pri_field]);
+    const char *lparen = view_chr(priority, '(');
+    if (lparen) {
+        const char *rparen = view_chr(view_from(priority, lparen), ')');
+        if (rparen) pf->label = trim(make_view(lparen + 1, (size_t)(rparen - lparen - 1)));
+        if (!pf->label.len) pf->label = NO_VIEW;
+        pf->lparen = lparen;
+        pf->rparen = rparen;
+        priority = trim(view_until(priority, lparen));
+    }
+    pf->priority = priority;
+    pf->at = is_same ? priority
+                     : make_view(pf->exten.ptr, (size_t)(priority.ptr + priority.len - pf->exten.ptr));
+}
+
+/* 
+ * Extract label from priority string and validate priority
+ * This mimics Asterisk's logic in pbx_config.c
+ * 
+ * Asterisk logic:
+ *   if (strchr(pri, '(')) {
+ *       char *lparen = strchr(pri, '(');
+ *       char *rparen = strchr(lparen, ')');
+ *       if (rparen) {
+ *           *lparen = '\0';
+ *           lparen++;
+ *           *rparen = '\0';
+ *           label = lparen;
+ *       }
+ *   }
+ *
+ * Here the split is done with views instead of writing NULs into the line,
+ * once per line by split_priority().
+ */
+static int validate_priority_with_label(const priority_field *pf, validator_state *state) {
+    str_view pri_part = pf->priority;
+    
+    // Check if priority contains a label: n(label) or 1(label)
+    const char *lparen = pf->lparen;
+    if (lparen) {
+        const char *rparen = pf->rparen;
+        if (!rparen) {
+            report(state, DIAG_ERROR, E_LABEL_UNCLOSED, lparen, 1,
+                   "Unclosed '(' in priority label");
+            return 0;
+        }
+        
+        // Extract label (between parentheses); pri_part is already the priority without it
+        str_view label = make_view(lparen + 1, (size_t)(rparen - lparen - 1));
+        
+        // Validate label is not empty
+        if (label.len == 0) {
+            report(state, DIAG_ERROR, E_LABEL_EMPTY, lparen, 2, "Empty label in priority");
+            return 0;
+        }
+    }
+    
+    // Validate the priority part (without label)
+    // Valid formats: 'hint', 'n', or a positive integer
+    
+    if (view_eq(pri_part, "hint")) {
+        return 1;  // 'hint' is valid
+    }
+    
+    if (view_eq(pri_part, "n")) {
+        return 1;  // 'n' (next) is valid
+    }
+    
+    // Must be a positive integer (same acceptance as strtol: sign, then digits;
+    // a sign without digits is no number, so the parse ends before the sign)
+    const char *p = pri_part.ptr, *end = pri_part.ptr + pri_part.len;
+    const char *digits;
+    int negative = 0;
+    long pri = 0;
+    if (p < end && (*p == '+' || *p == '-')) negative = (*p++ == '-');
+    digits = p;
+    while (p < end && isdigit((unsigned char)*p)) {
+        if (pri < 100000000L) pri = pri * 10 + (*p - '0');
+        p++;
+    }
+    if (p == digits) p = pri_part.ptr;
+    if (negative) pri = -pri;
+    
+    if (p != end) {
+        report(state, DIAG_ERROR, E_PRIORITY_INVALID, pri_part.ptr, pri_part.len,
+               "Invalid priority '%.*s' (must be number, 'n', or 'hint')",
+               (int)pri_part.len, pri_part.ptr);
+        return 0;
+    }
+    
+    if (pri < 1) {
+        report(state, DIAG_ERROR, E_PRIORITY_RANGE, pri_part.ptr, pri_part.len,
+               "Priority must be >= 1");
+        return 0;
+    }
+    
+    return 1;
+}
+
+/*
+ * Cross-reference facts (--xref)
+ *
+ * Extension lines record what they define (extension, label) and where a
+ * Goto / Gosub family application sends the call. Missing parts of a
+ * destination are filled in from the line's own context and extension, so
+ * every reference is a full (context, extension, priority) triple, checked
+ * once all files are done. Destinations built from variables can't be
+ * checked and are skipped.
+ */
+
+/* Extension pattern of an exten line's first field, without a /callerid match */
+static str_view exten_pattern(str_view field) {
+    str_view pattern = trim(field);
+    const char *slash = view_chr(pattern, '/');
+    return slash ? trim(view_until(pattern, slash)) : pattern;
+}
+
+static void set_exten(validator_state *state, str_view pattern) {
+    state->exten = state_intern(state, pattern);
+}
+
+/* Split v at top-level occurrences of sep (not inside (), [] or {}); returns the count */
+static int split_top(str_view v, char sep, str_view *parts, int max) {
+    int n = 0, depth = 0;
+    const char *start = v.ptr;
+    
+    for (size_t i = 0; i < v.len; i++) {
+        char c = v.ptr[i];
+        if (c == '(' || c == '[' || c == '{') depth++;
+        else if ((c == ')' || c == ']' || c == '}') && depth > 0) depth--;
+        else if (c == sep && depth == 0) {
+            if (n == max) return max + 1;
+            parts[n++] = trim(make_view(start, (size_t)(v.ptr + i - start)));
+            start = v.ptr + i + 1;
+        }
+    }
+    if (n == max) return max + 1;
+    parts[n++] = trim(make_view(start, (size_t)(v.ptr + v.len - start)));
+    return n;
+}
+
+/* Record one Goto/Gosub destination: [[context,]exten,]priority */
+static void note_destination(fact_kind kind, str_view dest, validator_state *state) {
+    str_view parts[3];
+    str_view context = state_name(state, state->context);
+    str_view exten = state_name(state, state->exten);
+    
+    dest = trim(dest);
+    if (dest.len == 0 || view_chr(dest, '$')) return;
+    
+    int n = split_top(dest, ',', parts, 3);
+    if (n > 3) return;
+    
+    str_view priority = parts[n - 1];
+    if (n >= 2) exten = parts[n - 2];
+    if (n == 3) context = parts[0];
+    
+    // Gosub priorities may carry arguments: s,1(arg1,arg2)
+    const char *args = view_chr(priority, '(');
+    if (args) priority = trim(view_until(priority, args));
+    
+    if (context.len == 0 || exten.len == 0 || priority.len == 0) return;
+    note_fact(state, kind, dest, context, exten, priority);
+}
+
+/*
+ * Record what an extension line defines and where its application jumps to;
+ * pattern is an exten line's pattern as written (a NULL view for 'same')
+ */
+static void index_extension(str_view pattern, str_view priority, str_view app, validator_state *state) {
+    if (!state->exten) return;  // 'same' before any 'exten'
+    
+    str_view exten = state_name(state, state->exten);
+    const char *lparen = view_chr(priority, '(');
+    str_view pri_part = lparen ? trim(view_until(priority, lparen)) : priority;
+    if (view_eq(pri_part, "hint")) return;  // A hint doesn't make the extension reachable
+    
+    if (pattern.ptr) note_fact(state, FACT_EXTEN, pattern, exten, NO_VIEW, NO_VIEW);
+    if (lparen) {
+        const char *rparen = view_chr(view_from(priority, lparen), ')');
+        str_view label = trim(make_view(lparen + 1, (size_t)(rparen - lparen - 1)));
+        if (label.len) note_fact(state, FACT_LABEL, label, label, exten, NO_VIEW);
+    }
+    
+    // Application name and its argument text
+    const char *open = view_chr(app, '(');
+    if (!open) return;
+    str_view name = trim(view_until(app, open));
+    str_view args = view_from(app, open + 1);
+    if (args.len && args.ptr[args.len - 1] == ')') args.len--;
+    
+    int conditional = 0;
+    fact_kind kind;
+    if (view_eq_ci(name, "Goto")) {
+        kind = FACT_GOTO;
+    } else if (view_eq_ci(name, "Gosub")) {
+        kind = FACT_GOSUB;
+    } else if (view_eq_ci(name, "GotoIf")) {
+        kind = FACT_GOTO;
+        conditional = 1;
+    } else if (view_eq_ci(name, "GosubIf")) {
+        kind = FACT_GOSUB;
+        conditional = 1;
+    } else {
+        return;
+    }
+    
+    if (!conditional) {
+        note_destination(kind, args, state);
+        return;
+    }
+    
+    // condition?iftrue:iffalse - the branches follow the last top-level '?'
+    const char *question = NULL;
+    int depth = 0;
+    for (size_t i = 0; i < args.len; i++) {
+        char c = args.ptr[i];
+        if (c == '(' || c == '[' || c == '{') depth++;
+        else if ((c == ')' || c == ']' || c == '}') && depth > 0) depth--;
+        else if (c == '?' && depth == 0) question = args.ptr + i;
+    }
+    if (!question) return;
+    
+    str_view branches[2];
+    int n = split_top(view_from(args, question + 1), ':', branches, 2);
+    for (int i = 0; i < n && i < 2; i++) note_destination(kind, branches[i], state);
+}
+
+/*
+ * --check-globals: the variables a line sets and reads, each noted once per
+ * context for globals_check(), which runs once every file is done
+ */
+static const char *const builtin_variables[] = {   // Sorted (strcmp)
+    "ACCOUNTCODE", "AGISTATUS", "AMDCAUSE", "AMDSTATUS", "ANSWEREDTIME", "AQMSTATUS",
+    "ASTAGIDIR", "ASTDATADIR", "ASTDBDIR", "ASTETCDIR", "ASTKEYDIR", "ASTLOGDIR",
+    "ASTMODDIR", "ASTRUNDIR", "ASTSPOOLDIR", "ASTVARLIBDIR", "BLINDTRANSFER",
+    "BRIDGEPEER", "CHANNEL", "CONTEXT", "DB_RESULT", "DIALEDPEERNAME",
+    "DIALEDPEERNUMBER", "DIALEDTIME", "DIALSTATUS", "ENTITYID", "EPOCH", "EXTEN",
+    "GOSUB_RETVAL", "HANGUPCAUSE", "INVALID_EXTEN", "MACRO_CONTEXT", "MACRO_EXTEN",
+    "MACRO_PRIORITY", "MACRO_RESULT", "MEETMESECS", "MEMBERINTERFACE",
+    "MIXMONITOR_FILENAME", "ORIGINATE_STATUS", "PLAYBACKSTATUS", "PQMSTATUS",
+    "PRIORITY", "QUEUESTATUS", "READEXTENSTATUS", "READSTATUS", "RECORDED_FILE",
+    "RECORD_STATUS", "RQMSTATUS", "SIPCALLID", "SIPDOMAIN", "SIPURI", "SIPUSERAGENT",
+    "SYSTEMNAME", "SYSTEMSTATUS", "TRANSFER_CONTEXT", "TRYSTATUS", "UNIQUEID",
+    "UPQMSTATUS", "VMSTATUS"
+};
+
+#define MSET_NAMES 16   // MSet() assignments looked at per line
+
+/* Set by Asterisk rather than the dialplan; ARGn are a Gosub's arguments */
+static int builtin_variable(str_view name) {
+    if (name.len > 3 && memcmp(name.ptr, "ARG", 3) == 0) {
+        size_t i = 3;
+        while (i < name.len && isdigit((unsigned char)name.ptr[i])) i++;
+        if (i == name.len) return 1;
+    }
+    
+    size_t lo = 0, hi = sizeof(builtin_variables) / sizeof(builtin_variables[0]);
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        const char *s = builtin_variables[mid];
+        int c = strncmp(s, name.ptr, name.len);
+        if (c == 0 && s[name.len]) c = 1;
+        if (c == 0) return 1;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return 0;
+}
+
+/* Whether this context hasn't set (or read) the interned name before; a full table says yes */
+static int var_first(var_names *v, uint32_t name, int read) {
+    uint64_t key = (uint64_t)name * 2 + (uint64_t)read;
+    
+    if (v->count >= VAR_NAMES_MAX) return 1;
+    size_t i = mix64(key) & (VAR_NAMES - 1);
+    for (; v->slot[i].gen == v->gen + 1; i = (i + 1) & (VAR_NAMES - 1)) {
+        if (v->slot[i].key == key) return 0;
+    }
+    v->slot[i].key = key;
+    v->slot[i].gen = v->gen + 1;
+    v->count++;
+    return 1;
+}
+
+static void note_var(validator_state *state, fact_kind kind, str_view name) {
+    uint32_t off = diag_intern(&state->diags, name.ptr, name.len);
+    if (off == NO_TEXT || !var_first(&state->vars, off, kind == FACT_VAR_REF)) return;
+    note_fact(state, kind, name, make_view(state->diags.text + off, name.len), NO_VIEW, NO_VIEW);
+}
+
+/* Variable the left side of an assignment sets: _X and __X are X, as are LOCAL(X) and GLOBAL(X) */
+static str_view assigned_name(str_view lhs) {
+    lhs = trim(lhs);
+    for (int i = 0; i < 2 && lhs.len && lhs.ptr[0] == '_'; i++) lhs = make_view(lhs.ptr + 1, lhs.len - 1);
+    
+    const char *open = view_chr(lhs, '(');
+    if (open) {
+        // Any other function (CDR(), CALLERID()...) isn't a variable
+        str_view function = trim(view_until(lhs, open));
+        if (!view_eq_ci(function, "LOCAL") && !view_eq_ci(function, "GLOBAL")) return NO_VIEW;
+        lhs = view_from(lhs, open + 1);
+        const char *close = view_chr(lhs, ')');
+        if (!close) return NO_VIEW;
+        lhs = trim(view_until(lhs, close));
+    }
+    return view_chr(lhs, '$') ? NO_VIEW : lhs;
+}
+
+/* Note what Set(), MSet(), Read() or ReadExten() sets and every plain ${NAME} the application reads */
+static void note_variables(str_view app, validator_state *state) {
+    const char *open = view_chr(app, '(');
+    if (open) {
+        str_view name = trim(view_until(app, open));
+        str_view args = view_from(app, open + 1);
+        str_view parts[MSET_NAMES];
+        int n = 0, assign = 1;
+        if (args.len && args.ptr[args.len - 1] == ')') args.len--;
+        
+        if (view_eq_ci(name, "Set")) {
+            parts[n++] = args;  // The value may hold commas
+        } else if (view_eq_ci(name, "MSet")) {
+            n = split_top(args, ',', parts, MSET_NAMES);
+            if (n > MSET_NAMES) n = MSET_NAMES;
+        } else if (view_eq_ci(name, "Read") || view_eq_ci(name, "ReadExten")) {
+            n = split_top(args, ',', parts, 1) > 0;
+            assign = 0;
+        }
+        
+        for (int i = 0; i < n; i++) {
+            str_view lhs = parts[i];
+            const char *eq = view_chr(lhs, '=');
+            if (assign && !eq) continue;
+            if (assign) lhs = view_until(lhs, eq);
+            lhs = assigned_name(lhs);
+            if (lhs.len) note_var(state, FACT_VAR_SET, lhs);
+        }
+    }
+    
+    // ${NAME} and ${NAME:offset:length}; functions and names built from others are left alone
+    const char *p = app.ptr, *end = app.ptr + app.len;
+    while ((p = memchr(p, '$', (size_t)(end - p))) != NULL) {
+        if (++p == end || *p != '{') continue;
+        const char *s = ++p, *e = s;
+        while (e < end && *e != '}' && *e != ':' && *e != '$' && *e != '(' && *e != '[') e++;
+        if (e == end || (*e != '}' && *e != ':')) continue;
+        
+        str_view name = trim(make_view(s, (size_t)(e - s)));
+        if (name.len && !builtin_variable(name)) note_var(state, FACT_VAR_REF, name);
+    }
+}
+
+/*
+ * --check-apps: applications and dialplan functions are looked up in a
+ * built-in table laid out by a minimal perfect hash (hash and displace):
+ * a name's hash picks a bucket, the bucket's displacement turns the same
+ * hash into the name's slot, and one comparison there settles it. Names
+ * are matched case-insensitively, and an application and a function of the
+ * same name (MixMonitor, MIXMONITOR) are different entries. --app-registry
+ * adds names from a file, which are looked up first.
+ */
+typedef struct {
+    const char *name;
+    int8_t min_args;
+    int8_t max_args;   // -1 = any number
+    uint8_t function;  // ${NAME(...)} function rather than an application
+} app_info;
+
+/*
+ * Generated: add or change entries anywhere, then replace everything down
+ * to app_displace[] with the output of --app-table. Until then the table
+ * doesn't find its own names.
+ */
+#define APP_BUCKETS 111
+
+static const app_info app_table[] = {
+    { "TOLOWER", 0, -1, 1 },
+    { "GROUP_MATCH_COUNT", 1, 1, 1 },
+    { "Festival", 1, 2, 0 },
+    { "PickupChan", 1, 2, 0 },
+    { "ResetCDR", 0, 1, 0 },
+    { "MeetMeAdmin", 2, 3, 0 },
+    { "SendImage", 1, 1, 0 },
+    { "KEYPADHASH", 1, 1, 1 },
+    { "GROUP_COUNT", 0, 1, 1 },
+    { "PJSIP_DIAL_CONTACTS", 0, 3, 1 },
+    { "SpeechDeactivateGrammar", 1, 1, 0 },
+    { "TrySystem", 1, -1, 0 },
+    { "SayAlphaCase", 2, 2, 0 },
+    { "IFTIME", 1, -1, 1 },
+    { "CDR", 1, 2, 1 },
+    { "FILE_COUNT_LINE", 1, 2, 1 },
+    { "WaitForSilence", 0, 3, 0 },
+    { "MIXMONITOR", 2, 2, 1 },
+    { "GotoIf", 1, -1, 0 },
+    { "JITTERBUFFER", 1, 1, 1 },
+    { "ReadExten", 1, 5, 0 },
+    { "SIP_HEADER", 1, 2, 1 },
+    { "BackgroundDetect", 1, 4, 0 },
+    { "VERSION", 0, 1, 1 },
+    { "DumpChan", 0, 1, 0 },
+    { "RetryDial", 3, 5, 0 },
+    { "MATH", 1, 2, 1 },
+    { "FILTER", 2, 2, 1 },
+    { "ChanIsAvail", 1, 2, 0 },
+    { "CSV_QUOTE", 1, -1, 1 },
+    { "VMCOUNT", 1, 2, 1 },
+    { "ODBC_FETCH", 1, 1, 1 },
+    { "STAT", 2, 2, 1 },
+    { "MP3Player", 1, 1, 0 },
+    { "VOLUME", 1, 2, 1 },
+    { "GROUP", 0, 1, 1 },
+    { "UnpauseQueueMember", 0, 4, 0 },
+    { "UNSHIFT", 1, 2, 1 },
+    { "BASE64_ENCODE", 1, 1, 1 },
+    { "ConfBridge", 1, 4, 0 },
+    { "PauseMonitor", 0, 0, 0 },
+    { "STRREPLACE", 2, 4, 1 },
+    { "EVAL", 1, -1, 1 },
+    { "SpeechProcessingSound", 1, 1, 0 },
+    { "System", 1, -1, 0 },
+    { "WaitExten", 0, 2, 0 },
+    { "SIPAddHeader", 1, -1, 0 },
+    { "PASSTHRU", 0, -1, 1 },
+    { "DISA", 1, 6, 0 },
+    { "FIELDNUM", 3, 3, 1 },
+    { "VoiceMail", 1, 2, 0 },
+    { "ENUMRESULT", 2, 2, 1 },
+    { "MAILBOX_EXISTS", 1, 1, 1 },
+    { "DEVICE_STATE", 1, 1, 1 },
+    { "ChangeMonitor", 1, 1, 0 },
+    { "WaitForRing", 1, 1, 0 },
+    { "SayDigits", 1, 2, 0 },
+    { "MeetMeChannelAdmin", 2, 2, 0 },
+    { "CONNECTEDLINE", 1, 2, 1 },
+    { "ISNULL", 0, -1, 1 },
+    { "GotoIfTime", 1, -1, 0 },
+    { "TALK_DETECT", 1, 1, 1 },
+    { "SPRINTF", 1, -1, 1 },
+    { "SORT", 1, -1, 1 },
+    { "ENV", 1, 1, 1 },
+    { "SIPPEER", 1, 2, 1 },
+    { "FIELDQTY", 2, 2, 1 },
+    { "RAND", 0, 2, 1 },
+    { "While", 1, 1, 0 },
+    { "Playback", 1, 2, 0 },
+    { "TRYLOCK", 1, 1, 1 },
+    { "TESTTIME", 1, 3, 1 },
+    { "PITCH_SHIFT", 1, 1, 1 },
+    { "SpeechLoadGrammar", 2, 2, 0 },
+    { "ENUMLOOKUP", 1, 5, 1 },
+    { "URIENCODE", 1, -1, 1 },
+    { "Busy", 0, 1, 0 },
+    { "CURLOPT", 1, 1, 1 },
+    { "PP_EACH_EXTENSION", 2, 2, 1 },
+    { "StopMixMonitor", 0, 1, 0 },
+    { "Queue", 1, 10, 0 },
+    { "Ringing", 0, 0, 0 },
+    { "Authenticate", 1, 4, 0 },
+    { "DUNDILOOKUP", 1, 3, 1 },
+    { "Echo", 0, 0, 0 },
+    { "SIPDtmfMode", 1, 1, 0 },
+    { "VoiceMailMain", 0, 2, 0 },
+    { "DB_DELETE", 1, 1, 1 },
+    { "ARRAY", 1, -1, 1 },
+    { "Verbose", 0, -1, 0 },
+    { "STRPTIME", 3, 3, 1 },
+    { "AGC", 1, 1, 1 },
+    { "ChannelRedirect", 2, 4, 0 },
+    { "ICONV", 3, 3, 1 },
+    { "VALID_EXTEN", 1, 3, 1 },
+    { "SLATrunk", 1, 2, 0 },
+    { "StackPop", 0, 0, 0 },
+    { "Read", 1, 6, 0 },
+    { "MessageSend", 1, 3, 0 },
+    { "RaiseException", 1, 1, 0 },
+    { "FILE_FORMAT", 1, 1, 1 },
+    { "DB_EXISTS", 1, 1, 1 },
+    { "UNLOCK", 1, 1, 1 },
+    { "REDIRECTING", 1, 2, 1 },
+    { "ParkedCall", 0, 2, 0 },
+    { "HangupCauseClear", 0, 0, 0 },
+    { "BackGround", 1, 4, 0 },
+    { "Goto", 1, 3, 0 },
+    { "ODBC_Commit", 0, 1, 0 },
+    { "SpeechUnloadGrammar", 1, 1, 0 },
+    { "ExtenSpy", 1, 2, 0 },
+    { "DENOISE", 1, 1, 1 },
+    { "DIALGROUP", 1, 2, 1 },
+    { "QUEUE_MEMBER_COUNT", 1, 1, 1 },
+    { "Exec", 1, 1, 0 },
+    { "ChanSpy", 0, 2, 0 },
+    { "Proceeding", 0, 0, 0 },
+    { "POP", 1, 1, 1 },
+    { "SendDTMF", 1, 4, 0 },
+    { "UserEvent", 1, -1, 0 },
+    { "PJSIP_PARSE_URI", 2, 2, 1 },
+    { "PJSIP_AOR", 2, 2, 1 },
+    { "Progress", 0, 0, 0 },
+    { "SetAMAFlags", 0, 1, 0 },
+    { "Congestion", 0, 1, 0 },
+    { "CALLCOMPLETION", 1, 1, 1 },
+    { "SHELL", 1, -1, 1 },
+    { "REALTIME_FIELD", 4, 4, 1 },
+    { "FRAME_TRACE", 0, 1, 1 },
+    { "PJSIP_HEADER", 1, 3, 1 },
+    { "Morsecode", 1, 1, 0 },
+    { "SayAlpha", 1, 2, 0 },
+    { "SPEECH", 1, 1, 1 },
+    { "DateTime", 0, 3, 0 },
+    { "DEC", 1, 1, 1 },
+    { "MSet", 1, -1, 0 },
+    { "LOCAL_PEEK", 2, 2, 1 },
+    { "AELSub", 1, -1, 0 },
+    { "Originate", 3, 7, 0 },
+    { "Zapateller", 0, 2, 0 },
+    { "Record", 1, 4, 0 },
+    { "CURL", 1, 2, 1 },
+    { "MD5", 1, -1, 1 },
+    { "ImportVar", 1, -1, 0 },
+    { "Macro", 1, -1, 0 },
+    { "Directory", 0, 3, 0 },
+    { "SendURL", 1, 2, 0 },
+    { "FollowMe", 1, 2, 0 },
+    { "SpeechStart", 0, 0, 0 },
+    { "SQL_ESC", 1, -1, 1 },
+    { "AES_DECRYPT", 2, 2, 1 },
+    { "DIALPLAN_EXISTS", 1, 3, 1 },
+    { "STRFTIME", 0, 3, 1 },
+    { "Answer", 0, 1, 0 },
+    { "PJSIP_CONTACT", 2, 2, 1 },
+    { "ENUMQUERY", 1, 3, 1 },
+    { "WaitDigit", 0, 2, 0 },
+    { "ControlPlayback", 1, 7, 0 },
+    { "GROUP_LIST", 0, 0, 1 },
+    { "AddQueueMember", 1, 6, 0 },
+    { "CUT", 3, 3, 1 },
+    { "VoiceMailPlayMsg", 2, 3, 0 },
+    { "Park", 0, 2, 0 },
+    { "QueueUpdate", 2, 6, 0 },
+    { "SPEECH_RESULTS_TYPE", 0, 0, 1 },
+    { "SLAStation", 1, 1, 0 },
+    { "IF", 1, -1, 1 },
+    { "REALTIME_STORE", 1, -1, 1 },
+    { "UnpauseMonitor", 0, 0, 0 },
+    { "AGENT", 1, 1, 1 },
+    { "MacroIf", 1, -1, 0 },
+    { "MINIVMACCOUNT", 2, 2, 1 },
+    { "SayNumber", 1, 2, 0 },
+    { "HANGUPCAUSE_KEYS", 0, 0, 1 },
+    { "SoftHangup", 1, 2, 0 },
+    { "TIMEOUT", 1, 1, 1 },
+    { "Gosub", 1, 3, 0 },
+    { "CallCompletionRequest", 0, 0, 0 },
+    { "TOUPPER", 0, -1, 1 },
+    { "SpeechCreate", 0, 1, 0 },
+    { "Hangup", 0, 1, 0 },
+    { "MixMonitor", 1, 3, 0 },
+    { "Dial", 1, 4, 0 },
+    { "EndWhile", 0, 0, 0 },
+    { "DeadAGI", 1, -1, 0 },
+    { "StopPlayTones", 0, 0, 0 },
+    { "SHARED", 1, 2, 1 },
+    { "Monitor", 0, 3, 0 },
+    { "SMDI_MSG_RETRIEVE", 2, 4, 1 },
+    { "ParkAndAnnounce", 1, 4, 0 },
+    { "SPEECH_TEXT", 1, 2, 1 },
+    { "RemoveQueueMember", 1, 3, 0 },
+    { "Incomplete", 0, 1, 0 },
+    { "ExitWhile", 0, 0, 0 },
+    { "CHANNEL", 1, 1, 1 },
+    { "ExecIf", 1, -1, 0 },
+    { "MusicOnHold", 0, 2, 0 },
+    { "ExecIfTime", 1, -1, 0 },
+    { "REALTIME_HASH", 3, 3, 1 },
+    { "ForkCDR", 0, 1, 0 },
+    { "SYSINFO", 1, 1, 1 },
+    { "SPEECH_SCORE", 1, 2, 1 },
+    { "AST_CONFIG", 3, 4, 1 },
+    { "MUTEAUDIO", 1, 1, 1 },
+    { "BASE64_DECODE", 1, 1, 1 },
+    { "MINIVMCOUNTER", 2, 3, 1 },
+    { "BLACKLIST", 0, 0, 1 },
+    { "REGEX", 1, -1, 1 },
+    { "Return", 0, 1, 0 },
+    { "SIPCHANINFO", 1, 1, 1 },
+    { "IAXPEER", 1, 2, 1 },
+    { "CALENDAR_BUSY", 1, 1, 1 },
+    { "ODBC", 1, -1, 1 },
+    { "SPEECH_GRAMMAR", 1, 2, 1 },
+    { "CallCompletionCancel", 0, 0, 0 },
+    { "DBdeltree", 1, 1, 0 },
+    { "Transfer", 1, 2, 0 },
+    { "Dictate", 0, 2, 0 },
+    { "INC", 1, 1, 1 },
+    { "ReceiveFAX", 1, 2, 0 },
+    { "REALTIME_DESTROY", 2, 4, 1 },
+    { "SpeechBackground", 1, 3, 0 },
+    { "ExternalIVR", 1, 2, 0 },
+    { "Set", 1, -1, 0 },
+    { "PJSIP_MEDIA_OFFER", 1, 1, 1 },
+    { "WaitForNoise", 0, 3, 0 },
+    { "Wait", 1, 1, 0 },
+    { "AGI", 1, -1, 0 },
+    { "DB_KEYS", 0, 1, 1 },
+    { "GosubIf", 1, -1, 0 },
+    { "SpeechDestroy", 0, 0, 0 },
+    { "MASTER_CHANNEL", 1, 1, 1 },
+    { "DBdel", 1, 1, 0 },
+    { "CALLERPRES", 0, 0, 1 },
+    { "StartMusicOnHold", 0, 1, 0 },
+    { "PRESENCE_STATE", 2, 3, 1 },
+    { "CHANNELS", 0, 1, 1 },
+    { "LEN", 0, -1, 1 },
+    { "SPEECH_ENGINE", 1, 1, 1 },
+    { "SendFAX", 1, 2, 0 },
+    { "PlayTones", 1, 1, 0 },
+    { "VMAuthenticate", 0, 2, 0 },
+    { "STACK_PEEK", 2, 4, 1 },
+    { "QUEUE_MEMBER_LIST", 1, 1, 1 },
+    { "PauseQueueMember", 0, 4, 0 },
+    { "SMS", 1, 4, 0 },
+    { "Milliwatt", 0, 1, 0 },
+    { "SMDI_MSG", 2, 2, 1 },
+    { "ODBC_Rollback", 0, 1, 0 },
+    { "QUEUE_WAITING_COUNT", 0, 1, 1 },
+    { "PrivacyManager", 0, 4, 0 },
+    { "EXISTS", 0, -1, 1 },
+    { "QueueLog", 4, 5, 0 },
+    { "SHIFT", 1, 2, 1 },
+    { "Pickup", 0, 1, 0 },
+    { "Bridge", 1, 2, 0 },
+    { "EAGI", 1, -1, 0 },
+    { "Log", 2, -1, 0 },
+    { "CELGenUserEvent", 1, 2, 0 },
+    { "VM_INFO", 2, 3, 1 },
+    { "StopMonitor", 0, 0, 0 },
+    { "MacroExit", 0, 0, 0 },
+    { "VMSayName", 1, 1, 0 },
+    { "StopMusicOnHold", 0, 0, 0 },
+    { "Stasis", 1, -1, 0 },
+    { "LOCK", 1, 1, 1 },
+    { "NoOp", 0, -1, 0 },
+    { "WaitForCondition", 1, 2, 0 },
+    { "TXTCIDNAME", 1, 2, 1 },
+    { "WaitUntil", 1, 1, 0 },
+    { "TryExec", 1, 1, 0 },
+    { "MailboxExists", 1, 2, 0 },
+    { "NoCDR", 0, 0, 0 },
+    { "SayUnixTime", 0, 4, 0 },
+    { "Page", 1, 3, 0 },
+    { "MeetMe", 0, 3, 0 },
+    { "LISTFILTER", 3, 3, 1 },
+    { "HASHKEYS", 1, 1, 1 },
+    { "CALLERID", 1, 2, 1 },
+    { "IAXVAR", 1, 1, 1 },
+    { "SendText", 0, 1, 0 },
+    { "BridgeWait", 0, 3, 0 },
+    { "FEATURE", 1, 1, 1 },
+    { "IMPORT", 2, 2, 1 },
+    { "QUOTE", 1, -1, 1 },
+    { "REPLACE", 2, 3, 1 },
+    { "MacroExclusive", 1, -1, 0 },
+    { "StreamEcho", 0, 1, 0 },
+    { "SpeechActivateGrammar", 1, 1, 0 },
+    { "REALTIME", 2, 4, 1 },
+    { "FEATUREMAP", 1, 1, 1 },
+    { "GLOBAL", 1, 1, 1 },
+    { "AES_ENCRYPT", 2, 2, 1 },
+    { "SayPhonetic", 1, 1, 0 },
+    { "MeetMeCount", 1, 2, 0 },
+    { "IFMODULE", 1, 1, 1 },
+    { "HINT", 1, 2, 1 },
+    { "LOCAL", 1, 1, 1 },
+    { "HASH", 1, 2, 1 },
+    { "EXTENSION_STATE", 1, 1, 1 },
+    { "HANGUPCAUSE", 2, 2, 1 },
+    { "FILE", 1, 5, 1 },
+    { "EXCEPTION", 1, 1, 1 },
+    { "DB", 1, 1, 1 },
+    { "QUEUE_MEMBER", 2, 3, 1 },
+    { "PJSIP_ENDPOINT", 2, 2, 1 },
+    { "PUSH", 1, 2, 1 },
+    { "SET", 1, -1, 1 },
+    { "SHA1", 1, -1, 1 },
+    { "URIDECODE", 1, -1, 1 },
+    { "QUEUE_VARIABLES", 1, 1, 1 },
+    { "QUEUE_EXISTS", 1, 1, 1 },
+    { "SIPRemoveHeader", 0, 1, 0 },
+    { "ContinueWhile", 0, 0, 0 },
+};
+
+static const uint8_t app_displace[APP_BUCKETS] = {
+    0, 7, 30, 25, 0, 0, 0, 2, 14, 0, 8, 43, 1, 69, 10, 15,
+    1, 4, 9, 0, 6, 43, 13, 3, 7, 6, 6, 32, 61, 41, 25, 17,
+    0, 0, 5, 5, 43, 0, 4, 2, 19, 0, 20, 78, 0, 17, 1, 3,
+    0, 45, 4, 7, 9, 16, 38, 76, 9, 18, 31, 67, 47, 38, 0, 11,
+    0, 5, 34, 0, 13, 14, 33, 122, 19, 41, 97, 7, 158, 18, 0, 66,
+    1, 2, 54, 10, 14, 97, 5, 64, 15, 0, 70, 1, 18, 14, 240, 15,
+    30, 188, 136, 9, 36, 120, 37, 7, 28, 0, 88, 102, 157, 1, 10
+};
+
+#define APP_COUNT (sizeof(app_table) / sizeof(app_table[0]))
+
+struct app_registry {
+    app_info *items;
+    size_t count;
+    uint32_t *slots;        // Item index + 1 by app_hash(), 0 = empty
+    size_t slots_cap;       // Power of two
+    char *text;             // The file; items' names point into it
+    uint64_t fingerprint;   // Of the file, for the cache key
+};
+
+/* Case-insensitive; applications and functions hash apart */
+static uint64_t app_hash(const char *s, size_t len, int function) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ (uint64_t)function;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        h = (h ^ c) * 0x100000001b3ULL;
+    }
+    return mix64(h);
+}
+
+static size_t app_slot(uint64_t h, const uint8_t *displace, size_t buckets, size_t count) {
+    return (size_t)(mix64(h + displace[(h >> 32) % buckets]) % count);
+}
+
+static int app_matches(const app_info *a, str_view name, int function) {
+    return a->function == function && strncasecmp(a->name, name.ptr, name.len) == 0 && a->name[name.len] == '\0';
+}
+
+static const app_info *app_find(const app_registry *reg, str_view name, int function) {
+    uint64_t h = app_hash(name.ptr, name.len, function);
+    
+    if (reg && reg->count) {
+        for (size_t i = h & (reg->slots_cap - 1); reg->slots[i]; i = (i + 1) & (reg->slots_cap - 1)) {
+            const app_info *a = &reg->items[reg->slots[i] - 1];
+            if (app_matches(a, name, function)) return a;
+        }
+    }
+    const app_info *a = &app_table[app_slot(h, app_displace, APP_BUCKETS, APP_COUNT)];
+    return app_matches(a, name, function) ? a : NULL;
+}
+
+/*
+ * Arguments as Asterisk splits them: top-level commas, none inside quotes.
+ * Counting stops at stop, which is all an arity check needs to know.
+ */
+static int count_args(str_view args, int stop) {
+    int n = 1, depth = 0, quoted = 0;
+    
+    args = trim(args);
+    if (args.len == 0) return 0;
+    for (size_t i = 0; i < args.len && n < stop; i++) {
+        char c = args.ptr[i];
+        if (c == '\\' && i + 1 < args.len) i++;
+        else if (c == '"') quoted = !quoted;
+        else if (quoted) continue;
+        else if (c == '(' || c == '[' || c == '{') depth++;
+        else if ((c == ')' || c == ']' || c == '}') && depth > 0) depth--;
+        else if (c == ',' && depth == 0) n++;
+    }
+    return n;
+}
+
+static void check_arity(const app_info *a, str_view name, str_view args, validator_state *state) {
+    if (a->min_args <= 0 && a->max_args < 0) return;
+    
+    int n = count_args(args, a->max_args >= 0 ? a->max_args + 1 : a->min_args);
+    const char *kind = a->function ? "Function" : "Application";
+    if (n < a->min_args) {
+        report(state, DIAG_WARNING, W_APP_ARGS, name.ptr, name.len,
+               "%s '%.*s' needs at least %d argument%s (%d given)", kind, (int)name.len, name.ptr,
+               a->min_args, a->min_args == 1 ? "" : "s", n);
+    } else if (a->max_args >= 0 && n > a->max_args) {
+        report(state, DIAG_WARNING, W_APP_ARGS, name.ptr, name.len,
+               "%s '%.*s' takes at most %d argument%s (%d given)", kind, (int)name.len, name.ptr,
+               a->max_args, a->max_args == 1 ? "" : "s", count_args(args, INT_MAX));
+    }
+}
+
+/*
+ * Calls inside calls whose arguments are counted. Each count reads the whole
+ * call, so without a limit ${CUT(${CUT(...)})} thousands deep would cost the
+ * square of its length; calls nested deeper are only looked up by name.
+ */
+#define CALL_DEPTH 32
+
+/*
+ * NAME(args): a function's name (at name) and, if arity, its arguments up to
+ * the matching ')'. Returns where the arguments end, or NULL if not read.
+ */
+static const char *check_function(str_view name, const char *open, const char *end, int arity,
+                                  validator_state *state) {
+    const app_info *a = app_find(state->opts->apps, name, 1);
+    if (!a) {
+        report(state, DIAG_WARNING, W_FUNC_UNKNOWN, name.ptr, name.len,
+               "Unknown function '%.*s'", (int)name.len, name.ptr);
+        return NULL;
+    }
+    if (!arity || (a->min_args <= 0 && a->max_args < 0)) return NULL;
+    
+    const char *p = open;
+    int depth = 0;
+    for (; p < end; p++) {
+        if (*p == '(') depth++;
+        else if (*p == ')' && --depth == 0) break;
+    }
+    check_arity(a, name, make_view(open + 1, (size_t)(p - open - 1)), state);
+    return p;
+}
+
+/* The application, every ${NAME(...)} in it, and a function Set() assigns to */
+static void check_application(str_view app, validator_state *state) {
+    const char *open = view_chr(app, '(');
+    str_view name = trim(open ? view_until(app, open) : app);
+    const char *end = app.ptr + app.len;
+    
+    if (name.len && !view_chr(name, '$')) {
+        const app_info *a = app_find(state->opts->apps, name, 0);
+        str_view args = open ? view_from(app, open + 1) : NO_VIEW;
+        if (args.len && args.ptr[args.len - 1] == ')') args.len--;
+        
+        if (!a) {
+            report(state, DIAG_WARNING, W_APP_UNKNOWN, name.ptr, name.len,
+                   "Unknown application '%.*s'", (int)name.len, name.ptr);
+        } else {
+            check_arity(a, name, args, state);
+        }
+        
+        const char *eq = view_eq_ci(name, "Set") ? view_chr(args, '=') : NULL;
+        str_view lhs = eq ? trim(view_until(args, eq)) : NO_VIEW;
+        const char *paren = view_chr(lhs, '(');
+        if (paren && !view_chr(lhs, '$')) check_function(trim(view_until(lhs, paren)), paren, eq, 1, state);
+    }
+    
+    const char *outer[CALL_DEPTH];   // Ends of the counted calls p is inside
+    int depth = 0;
+    for (const char *p = app.ptr; (p = view_chr(view_from(app, p), '$')) != NULL; p++) {
+        if (p + 1 >= end || p[1] != '{') continue;
+        const char *s = p + 2, *e = s;
+        while (e < end && (isalnum((unsigned char)*e) || *e == '_')) e++;
+        if (e == s || e >= end || *e != '(') continue;
+        
+        while (depth > 0 && p >= outer[depth - 1]) depth--;
+        const char *close = check_function(make_view(s, (size_t)(e - s)), e, end, depth < CALL_DEPTH, state);
+        if (close) outer[depth++] = close;
+    }
+}
+
+/*
+ * Number a line's priority given the previous line's, the way pbx_config
+ * does: 0 for a hint, -1 if it can't be known ('n' after a hint or an
+ * invalid priority, which also make the next 'n' unknown)
+ */
+static long number_priority(str_view text, long *last) {
+    long priority = -1;
+    
+    if (!text.ptr) {
+        // No priority field
+    } else if (view_eq(text, "hint")) {
+        *last = -1;  // 'n' can't follow a hint
+        return 0;
+    } else if (view_eq(text, "n")) {
+        if (*last > 0 && *last < INT32_MAX) priority = *last + 1;
+    } else if (text.len) {
+        const char *p = text.ptr, *end = text.ptr + text.len;
+        long v = 0;
+        if (*p == '+') p++;
+        while (p < end && isdigit((unsigned char)*p) && v <= INT32_MAX) v = v * 10 + (*p++ - '0');
+        if (p == end && p > text.ptr && isdigit((unsigned char)p[-1]) && v >= 1 && v <= INT32_MAX) {
+            priority = v;
+        }
+    }
+    *last = priority;
+    return priority;
+}
+
+/* Start on a new extension; the next 'n' still follows the last line */
+static void seq_restart(priority_seq *seq, str_view exten) {
+    if (seq->copy && exten.ptr) {
+        if (exten.len > seq->copy_cap) {
+            char *bigger = realloc(seq->copy, exten.len);
+            if (bigger) {
+                seq->copy = bigger;
+                seq->copy_cap = exten.len;
+            } else {
+                exten.len = seq->copy_cap;  // Out of memory: compare on a prefix
+            }
+        }
+        memcpy(seq->copy, exten.ptr, exten.len);
+        exten.ptr = seq->copy;
+    }
+    seq->exten = exten.ptr;
+    seq->exten_len = exten.len;
+    seq->max = -1;
+    memset(seq->seen, 0, sizeof(seq->seen));
+    seq->gen++;
+    seq->labels = 0;
+}
+
+/* A context header: no extension, and 'n' has nothing to follow */
+static void seq_reset(priority_seq *seq) {
+    seq_restart(seq, NO_VIEW);
+    seq->last = -1;
+}
+
+/*
+ * Follow the priorities of consecutive lines of one extension: 'same'
+ * without an extension, a priority given twice and a label given twice are
+ * reported (unless quiet, when replaying lines for a chunk, see
+ * carry_sequence()). With --check-patterns the duplicate priorities are
+ * left to check_patterns(), which finds them across the whole context.
+ */
+static void track_priority(int is_same, const priority_field *pf, const line_scan *scan,
+                           str_view keyword, int quiet, validator_state *state) {
+    priority_seq *seq = &state->seq;
+    int report_duplicates = !quiet && !(state->opts && state->opts->check_patterns);
+    
+    if (!is_same) {
+        if (pf->exten.len != seq->exten_len || !seq->exten ||
+            memcmp(pf->exten.ptr, seq->exten, pf->exten.len) != 0) {
+            seq_restart(seq, pf->exten.len ? pf->exten : NO_VIEW);
+        }
+    } else if (!seq->exten && !quiet) {
+        report(state, DIAG_ERROR, E_SAME_NO_EXTEN, keyword.ptr, 4,
+               "'same' before any 'exten' line in this context");
+    }
+    if (is_same && !pf->priority.ptr) return;
+    
+    long priority = number_priority(pf->priority, &seq->last);
+    if (!seq->exten || priority < 0) return;
+    
+    // A priority past the highest so far is new; below that only the bitset can tell
+    int duplicate = 0;
+    if (priority > seq->max) seq->max = priority;
+    else if (priority < SEQ_PRIORITIES) duplicate = (int)(seq->seen[priority / 64] >> (priority % 64) & 1);
+    if (priority < SEQ_PRIORITIES) {
+        if (duplicate && report_duplicates) {
+            int first = seq->seen_line[priority];
+            if (priority == 0) {
+                report(state, DIAG_ERROR, E_EXTEN_DUPLICATE, pf->at.ptr, pf->at.len,
+                       "Extension '%.*s' already has a hint (line %d)",
+                       (int)seq->exten_len, seq->exten, first);
+            } else {
+                report(state, DIAG_ERROR, E_EXTEN_DUPLICATE, pf->at.ptr, pf->at.len,
+                       "Extension '%.*s' priority %ld is already defined (line %d)",
+                       (int)seq->exten_len, seq->exten, priority, first);
+            }
+        }
+        if (!duplicate) {
+            seq->seen[priority / 64] |= 1ULL << (priority % 64);
+            seq->seen_line[priority] = state->line_num;
+        }
+    }
+    
+    // Labels of complete lines only; Goto finds the first of two
+    int app_field = is_same ? 1 : 2;
+    if (!pf->label.ptr || priority == 0 || scan->nfields <= app_field || state->stopped) return;
+    
+    uint64_t h = hash_bytes(pf->label.ptr, pf->label.len, 0);
+    size_t i = (size_t)h & (SEQ_LABELS - 1);
+    for (; seq->label[i].gen == seq->gen; i = (i + 1) & (SEQ_LABELS - 1)) {
+        if (seq->label[i].hash != h) continue;
+        if (!quiet) {
+            report(state, DIAG_WARNING, W_LABEL_DUPLICATE, pf->label.ptr, pf->label.len,
+                   "Label '%.*s' is already used in extension '%.*s' (line %d)",
+                   (int)pf->label.len, pf->label.ptr, (int)seq->exten_len, seq->exten,
+                   seq->label[i].line);
+        }
+        return;
+    }
+    if (seq->labels == SEQ_LABELS_MAX) return;
+    seq->labels++;
+    seq->label[i].hash = h;
+    seq->label[i].line = state->line_num;
+    seq->label[i].gen = seq->gen;
+}
+
+/*
+ * --check-patterns: record every exten / same line's extension and priority
+ * (without its label), even from a line with errors, so the checks see the
+ * same extension changes Asterisk's 'same' would. For --diff the fact also
+ * carries the line's step: a hash of its label and application, in hex.
+ */
+static void note_priority(int is_same, const priority_field *pf, str_view app, validator_state *state) {
+    char step[17];
+    str_view hash = NO_VIEW;
+    
+    if (is_same && !pf->priority.ptr) return;
+    if (state->opts->steps && app.ptr) {
+        uint64_t h = hash_bytes(app.ptr, app.len, pf->label.ptr ? hash_bytes(pf->label.ptr, pf->label.len, 1) : 0);
+        snprintf(step, sizeof(step), "%016llx", (unsigned long long)h);
+        hash = make_view(step, 16);
+    }
+    note_fact(state, is_same ? FACT_SAME : FACT_PRIORITY, pf->at, pf->exten, hash, pf->priority);
+}
+
+/* classify_line() only tags exten and same lines LINE_EXTEN, so one letter tells them apart */
+static int is_same_line(str_view t) {
+    return (t.ptr[0] | 0x20) == 's';
+}
+
+/* Parse extension line: exten => pattern,priority,app(args) OR same => priority,app(args) */
+static int parse_extension(str_view line, validator_state *state) {
+    const char *arrow = view_find2(line, '=', '>');
+    if (!arrow) {
+        report(state, DIAG_ERROR, E_EXTEN_ARROW, line.ptr, line.len,
+               "Missing '=>' in extension definition");
+        return 0;
+    }
+    
+    int is_same = is_same_line(line);
+    
+    // Parse data after =>
+    str_view data = trim(view_from(line, arrow + 2));
+    
+    // Split by commas (but respect balanced delimiters) and scan the app in one pass
+    line_scan scan;
+    int app_field = is_same ? 1 : 2;
+    scan_fields(data, app_field, &scan);
+    
+    // Any exten line moves 'same' on, even one with errors (see prescan_chunk)
+    if (!is_same && state->opts && state->opts->index) set_exten(state, exten_pattern(scan.field[0]));
+    priority_field pf;
+    split_priority(is_same, &scan, &pf);
+    track_priority(is_same, &pf, &scan, line, 0, state);
+    if (state->opts && (state->opts->check_patterns || state->opts->steps)) {
+        note_priority(is_same, &pf, scan.nfields > app_field ? trim(scan.field[app_field]) : NO_VIEW, state);
+    }
+    if (state->stopped) return 0;  // --max-errors reached on this line
+    
+    // Validation based on type
+    if (scan.nfields <= app_field) {
+        if (is_same) {
+            // same => priority,app(args)  (only 1 comma required)
+            report(state, DIAG_ERROR, E_SAME_FORMAT, data.ptr, data.len,
+                   "'same' must have format: same => priority,app(args)");
+        } else {
+            // exten => pattern,priority,app(args)  (2 commas required)
+            report(state, DIAG_ERROR, E_EXTEN_FORMAT, data.ptr, data.len,
+                   "'exten' must have format: exten => pattern,priority,app(args)");
+        }
+        return 0;
+    }
+    
+    // Validate priority (may contain label); for exten the pattern is field 0 (not validated yet)
+    if (!validate_priority_with_label(&pf, state)) {
+        return 0;
+    }
+    
+    if (state->opts && state->opts->index) {
+        index_extension(is_same ? NO_VIEW : exten_pattern(scan.field[0]), trim(scan.field[app_field - 1]),
+                        trim(scan.field[app_field]), state);
+    }
+    
+    if (state->stats && scan.depth > state->stats->deepest) {
+        state->stats->deepest = scan.depth;
+        state->stats->deepest_at = state->line_num;
+    }
+    
+    // Check if app has parentheses for arguments
+    if (scan.has_paren) {
+        uint64_t start = stat_start(state);
+        int balanced = check_balanced(&scan, state);
+        stat_stop(state, STAGE_BALANCED, start, 1);
+        if (!balanced) {
+            return 0;
+        }
+    }
+    
+    // Check variable syntax
+    uint64_t start = stat_start(state);
+    check_variable_syntax(&scan, state);
+    if (!scan.open_var && state->opts && state->opts->check_globals) {
+        note_variables(trim(scan.field[app_field]), state);
+    }
+    if (!scan.open_var && state->opts && state->opts->check_apps && !view_eq(pf.priority, "hint")) {
+        check_application(trim(scan.field[app_field]), state);  // A hint's is a device
+    }
+    stat_stop(state, STAGE_VARIABLES, start, 1);
+    
+    return 1;
+}
+
+/* Parse include line */
+static int parse_include(str_view line, validator_state *state) {
+    const char *arrow = view_find2(line, '=', '>');
+    if (!arrow) {
+        report(state, DIAG_ERROR, E_INCLUDE_ARROW, line.ptr, line.len,
+               "Missing '=>' in include statement");
+        return 0;
+    }
+    
+    str_view context = trim(view_from(line, arrow + 2));
+    if (context.len == 0) {
+        report(state, DIAG_ERROR, E_INCLUDE_EMPTY, arrow, 2,
+               "Empty context in include statement");
+        return 0;
+    }
+    
+    if (state->opts && state->opts->index) {
+        // include => context[,timing] (or the older '|' separator)
+        str_view name = context;
+        for (size_t i = 0; i < name.len; i++) {
+            if (name.ptr[i] == ',' || name.ptr[i] == '|') {
+                name = trim(make_view(name.ptr, i));
+                break;
+            }
+        }
+        if (name.len) note_fact(state, FACT_INCLUDE_CONTEXT, name, name, NO_VIEW, NO_VIEW);
+    }
+    
+    return 1;
+}
+
+/* ignorepat => pattern: digits after which dial tone stays on */
+static void parse_ignorepat(str_view line, validator_state *state) {
+    const char *arrow = view_find2(line, '=', '>');
+    if (!arrow) {
+        report(state, DIAG_ERROR, E_IGNOREPAT_ARROW, line.ptr, line.len,
+               "Missing '=>' in ignorepat statement");
+        return;
+    }
+    
+    if (trim(view_from(line, arrow + 2)).len == 0) {
+        report(state, DIAG_ERROR, E_IGNOREPAT_EMPTY, arrow, 2,
+               "Empty pattern in ignorepat statement");
+    }
+}
+
+/*
+ * Preprocessor-style lines (--includes only; otherwise '#' starts a comment,
+ * as before). The argument of #include / #tryinclude may be quoted or in
+ * angle brackets and is resolved once the file is done; #exec would run a
+ * command, which a validator must not do.
+ */
+static void parse_hash_directive(str_view line, validator_state *state) {
+    str_view word = make_view(line.ptr + 1, 0);
+    while (word.ptr + word.len < line.ptr + line.len && isalpha((unsigned char)word.ptr[word.len])) {
+        word.len++;
+    }
+    
+    int include = view_eq_ci(word, "include");
+    int tryinclude = view_eq_ci(word, "tryinclude");
+    if (view_eq_ci(word, "exec")) {
+        report(state, DIAG_WARNING, W_HASH_EXEC, line.ptr, line.len,
+               "#exec is not run; its output is not validated");
+        return;
+    }
+    if (!include && !tryinclude) {
+        return;  // Plain comment
+    }
+    
+    str_view arg = view_from(line, word.ptr + word.len);
+    const char *comment = view_chr(arg, ';');
+    arg = trim(comment ? view_until(arg, comment) : arg);
+    if (arg.len >= 2 && ((arg.ptr[0] == '"' && arg.ptr[arg.len - 1] == '"') ||
+                         (arg.ptr[0] == '<' && arg.ptr[arg.len - 1] == '>'))) {
+        arg = trim(make_view(arg.ptr + 1, arg.len - 2));
+    }
+    if (arg.len == 0) {
+        report(state, DIAG_ERROR, E_HASH_INCLUDE_EMPTY, line.ptr, line.len,
+               "Missing file name in #%s", tryinclude ? "tryinclude" : "include");
+        return;
+    }
+    note_fact(state, tryinclude ? FACT_TRYINCLUDE : FACT_INCLUDE, arg, arg, NO_VIEW, NO_VIEW);
+}
+
+/*
+ * Line classification
+ *
+ * Each line is tagged once with its trimmed span and the kind of its leading
+ * token; the directive dispatch then switches on the tag instead of running
+ * a chain of prefix compares. The token is the run of letters a line starts
+ * with, and must end the word: at the end of the line, a blank or '='. No two
+ * keywords share both length and first letter, so a switch on those two is a
+ * perfect hash and each line costs one strncasecmp() at most; a keyword is
+ * one more case below.
+ */
+typedef enum {
+    LINE_BLANK,     // Empty, whitespace-only, or a ';' comment
+    LINE_HASH,      // '#' line: #include / #tryinclude / #exec, or a comment
+    LINE_CONTEXT,   // [context]
+    LINE_EXTEN,     // exten / same
+    LINE_INCLUDE,
+    LINE_SWITCH,    // switch / eswitch / lswitch
+    LINE_IGNOREPAT,
+    LINE_OTHER
+} line_kind;
+
+/* Compact per-line record; offsets are relative to the start of the block */
+typedef struct {
+    uint32_t off;     // First non-space character
+    uint32_t len;     // Trimmed length
+    uint32_t indent;  // Leading whitespace skipped (off - indent is the raw line start)
+    uint8_t kind;     // line_kind
+} line_tag;
+
+#define TAG_BLOCK 256
+
+/* Kind of the directive keyword [s, s + len) */
+static line_kind keyword_kind(const char *s, size_t len) {
+    const char *word;
+    line_kind kind;
+    
+    switch (len) {
+        case 4: word = "same"; kind = LINE_EXTEN; break;
+        case 5: word = "exten"; kind = LINE_EXTEN; break;
+        case 6: word = "switch"; kind = LINE_SWITCH; break;
+        case 7:
+            switch (s[0] | 0x20) {
+                case 'e': word = "eswitch"; kind = LINE_SWITCH; break;
+                case 'i': word = "include"; kind = LINE_INCLUDE; break;
+                case 'l': word = "lswitch"; kind = LINE_SWITCH; break;
+                default: return LINE_OTHER;
+            }
+            break;
+        case 9: word = "ignorepat"; kind = LINE_IGNOREPAT; break;
+        default: return LINE_OTHER;
+    }
+    return strncasecmp(s, word, len) == 0 ? kind : LINE_OTHER;
+}
+
+#define KEYWORD_MAX 9   // Longest keyword above
+
+/* Kind of an already-trimmed line */
+static line_kind classify_line(str_view t) {
+    if (t.len == 0) return LINE_BLANK;
+    
+    switch (t.ptr[0]) {
+        case ';': return LINE_BLANK;
+        case '#': return LINE_HASH;
+        case '[': return LINE_CONTEXT;
+    }
+    
+    size_t n = 0;
+    while (n < t.len && n <= KEYWORD_MAX && (unsigned)((t.ptr[n] | 0x20) - 'a') < 26) n++;
+    if (n < t.len && t.ptr[n] != '=' && t.ptr[n] != ' ' && t.ptr[n] != '\t') return LINE_OTHER;
+    return keyword_kind(t.ptr, n);
+}
+
+/* Fill in the tag for the line [line, eol) */
+static void tag_line(line_tag *tag, const char *base, const char *line, const char *eol) {
+    str_view t = trim(make_view(line, (size_t)(eol - line)));
+    tag->off = (uint32_t)(t.ptr - base);
+    tag->len = (uint32_t)t.len;
+    tag->indent = (uint32_t)(t.ptr - line);
+    tag->kind = (uint8_t)classify_line(t);
+}
+
+/*
+ * Tag up to max consecutive lines starting at base. Newlines are located a
+ * vector at a time (AVX2, SSE2 or NEON, scalar otherwise) and the bit mask is
+ * walked to emit one tag per line. *next is set to the first untagged byte.
+ * A line whose offsets don't fit a tag stops the block; if it is the first
+ * line, 0 is returned and the caller handles that line the slow way.
+ */
+static size_t classify_block(const char *base, const char *end, line_tag *tags, size_t max,
+                             const char **next) {
+    const char *line = base, *s = base;
+    size_t n = 0;
+    
+    // The next line starts after eol; a last line without '\n' leaves it at end, not past it
+#define EMIT_LINE(eol) do { \
+        if ((size_t)((eol) - base) > UINT32_MAX) goto done; \
+        tag_line(&tags[n++], base, line, (eol)); \
+        line = (eol) < end ? (eol) + 1 : end; \
+        if (n == max) goto done; \
+    } while (0)
+    
+    while (s < end) {
+#if defined(__AVX2__)
+        if (end - s >= 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)s);
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+            while (mask) {
+                EMIT_LINE(s + __builtin_ctz(mask));
+                mask &= mask - 1;
+            }
+            s += 32;
+            continue;
+        }
+#elif defined(__SSE2__)
+        if (end - s >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)s);
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+            while (mask) {
+                EMIT_LINE(s + __builtin_ctz(mask));
+                mask &= mask - 1;
+            }
+            s += 16;
+            continue;
+        }
+#elif defined(__ARM_NEON)
+        if (end - s >= 16) {
+            uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)s), vdupq_n_u8('\n'));
+            // Narrow to 4 bits per byte so the mask fits a 64-bit lane
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+            while (mask) {
+                int bit = __builtin_ctzll(mask);
+                EMIT_LINE(s + (bit >> 2));
+                mask &= ~(0xFULL << (bit & ~3));
+            }
+            s += 16;
+            continue;
+        }
+#endif
+        if (*s == '\n') EMIT_LINE(s);
+        s++;
+    }
+    
+    // Last line without a trailing newline
+    if (line < end) EMIT_LINE(end);
+    
+done:
+#undef EMIT_LINE
+    *next = line;
+    return n;
+}
+
+/* Act on one classified line; t is the trimmed line, line_start its raw start */
+static void dispatch_line(str_view t, line_kind kind, const char *line_start,
+                          validator_state *state) {
+    state->line_num++;
+    state->line_start = line_start;
+    if (state->stats && t.ptr + t.len - line_start > state->stats->longest_line) {
+        state->stats->longest_line = (int)(t.ptr + t.len - line_start);
+        state->stats->longest_at = state->line_num;
+    }
+    
+    // Skip comments and blank lines
+    if (kind == LINE_BLANK) {
+        return;
+    }
+    
+    if (kind == LINE_HASH) {
+        if (state->opts && state->opts->follow_includes) parse_hash_directive(t, state);
+        return;
+    }
+    
+    // Check for context
+    if (kind == LINE_CONTEXT) {
+        if (state->profile) profile_span(state, line_start, state->line_num - 1);
+        parse_context(t, state);
+        state->in_context = 1;
+        state->exten = 0;
+        seq_reset(&state->seq);
+        state->vars.gen++;
+        state->vars.count = 0;
+        return;
+    }
+    
+    if (!state->in_context) {
+        // Must be in [general] or [globals] or similar
+        if (view_chr(t, '=') && !view_find2(t, '=', '>')) {
+            // Variable assignment in [general] or [globals]
+            return;
+        }
+    }
+    
+    const char *eq = state->section != SECTION_DIALPLAN && kind == LINE_OTHER ? view_chr(t, '=') : NULL;
+    if (eq) {
+        // A setting in [general], a variable in [globals]
+        str_view name = trim(view_until(t, eq));
+        if (state->section == SECTION_GLOBALS && name.len && state->opts && state->opts->check_globals) {
+            note_var(state, FACT_VAR_SET, name);
+        }
+        return;
+    }
+    
+    uint64_t start = stat_start(state);
+    switch (kind) {
+        case LINE_EXTEN:
+            parse_extension(t, state);
+            stat_stop(state, STAGE_EXTENSION, start, 1);
+            break;
+        
+        case LINE_INCLUDE:
+            parse_include(t, state);
+            stat_stop(state, STAGE_INCLUDE, start, 1);
+            break;
+        
+        case LINE_SWITCH:
+            // Switch statement, basic validation
+            if (!view_find2(t, '=', '>')) {
+                report(state, DIAG_ERROR, E_SWITCH_ARROW, t.ptr, t.len,
+                       "Missing '=>' in switch statement");
+            }
+            break;
+        
+        case LINE_IGNOREPAT:
+            parse_ignorepat(t, state);
+            break;
+        
+        default:
+            // Unknown line type
+            if (!state->in_context) break;
+            if (view_find2(t, '=', '>') && (view_prefix_ci(t, "exten") || view_prefix_ci(t, "same"))) {
+                // 'extension =>', 'samex =>': Asterisk would drop the line
+                size_t n = 0;
+                while (n < t.len && !isspace((unsigned char)t.ptr[n]) && t.ptr[n] != '=') n++;
+                report(state, DIAG_ERROR, E_EXTEN_KEYWORD, t.ptr, n,
+                       "Unknown keyword '%.*s' (expected 'exten' or 'same')", (int)n, t.ptr);
+            } else {
+                report(state, DIAG_WARNING, W_UNKNOWN_DIRECTIVE, t.ptr, t.len,
+                       "Unknown directive '%.*s'", (int)t.len, t.ptr);
+            }
+            break;
+    }
+}
+
+/* Validate one line (without its trailing newline) */
+static void validate_line(str_view line, validator_state *state) {
+    str_view t = trim(line);
+    dispatch_line(t, classify_line(t), line.ptr, state);
+}
+
+/* Walk an in-memory buffer a block of tagged lines at a time, in place */
+static void validate_buffer(const char *buf, size_t len, validator_state *state) {
+    line_tag tags[TAG_BLOCK];
+    const char *p = buf, *end = buf + len;
+    
+    if (state->profile) profile_begin(state->profile, buf, state->line_num);
+    while (p < end && !state->stopped) {
+        const char *next;
+        uint64_t start = stat_start(state);
+        size_t n = classify_block(p, end, tags, TAG_BLOCK, &next);
+        stat_stop(state, STAGE_CLASSIFY, start, n);
+        
+        if (n == 0) {
+            // A single line too long for a tag
+            const char *newline = memchr(p, '\n', (size_t)(end - p));
+            const char *eol = newline ? newline : end;
+            validate_line(make_view(p, (size_t)(eol - p)), state);
+            p = newline ? newline + 1 : end;
+            continue;
+        }
+        
+        for (size_t i = 0; i < n && !state->stopped; i++) {
+            const char *t = p + tags[i].off;
+            dispatch_line(make_view(t, tags[i].len), (line_kind)tags[i].kind, t - tags[i].indent, state);
+        }
+        p = next;
+    }
+    if (state->profile) profile_span(state, p, state->line_num);
+}
+
+/*
+ * Work-stealing pool
+ *
+ * Every worker owns a deque of job indexes. It pops from the head of its own
+ * deque and, once that is empty, steals from the tail of the others. All jobs
+ * are known up front, so a worker exits when every deque is empty. The
+ * calling thread runs as worker 0.
+ */
+typedef void (*job_fn)(void *ctx, int worker, int job);
+
+typedef struct {
+    pthread_mutex_t lock;
+    int *jobs;
+    int head;
+    int tail;
+} work_deque;
+
+typedef struct {
+    job_fn fn;
+    void *ctx;
+    int nworkers;
+    work_deque *deques;
+} work_pool;
+
+typedef struct {
+    work_pool *pool;
+    int id;
+} pool_worker;
+
+static int deque_take(work_deque *d, int from_tail) {
+    int job = -1;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        job = from_tail ? d->jobs[--d->tail] : d->jobs[d->head++];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+static void *pool_worker_main(void *arg) {
+    pool_worker *w = arg;
+    work_pool *pool = w->pool;
+    
+    for (;;) {
+        int job = deque_take(&pool->deques[w->id], 0);
+        for (int i = 1; job < 0 && i < pool->nworkers; i++) {
+            job = deque_take(&pool->deques[(w->id + i) % pool->nworkers], 1);
+        }
+        if (job < 0) break;
+        pool->fn(pool->ctx, w->id, job);
+    }
+    return NULL;
+}
+
+/* Run fn for jobs 0..njobs-1 on up to nworkers threads */
+static void run_pool(int njobs, int nworkers, job_fn fn, void *ctx) {
+    if (nworkers > njobs) nworkers = njobs;
+    if (nworkers <= 1) {
+        for (int i = 0; i < njobs; i++) fn(ctx, 0, i);
+        return;
+    }
+    
+    work_pool pool = { fn, ctx, nworkers, calloc((size_t)nworkers, sizeof(work_deque)) };
+    pool_worker *workers = calloc((size_t)nworkers, sizeof(pool_worker));
+    pthread_t *threads = calloc((size_t)nworkers, sizeof(pthread_t));
+    int *slots = malloc((size_t)njobs * sizeof(int));
+    if (!pool.deques || !workers || !threads || !slots) {
+        free(pool.deques); free(workers); free(threads); free(slots);
+        for (int i = 0; i < njobs; i++) fn(ctx, 0, i);
+        return;
+    }
+    
+    // Deal jobs round-robin; deque w gets a contiguous slice of slots
+    int next = 0;
+    for (int w = 0; w < nworkers; w++) {
+        work_deque *d = &pool.deques[w];
+        pthread_mutex_init(&d->lock, NULL);
+        d->jobs = slots + next;
+        for (int i = w; i < njobs; i += nworkers) slots[next++] = i;
+        d->tail = (int)(slots + next - d->jobs);
+    }
+    
+    // A worker that fails to start just leaves its deque to be stolen from
+    int started[nworkers];
+    for (int w = 0; w < nworkers; w++) {
+        workers[w].pool = &pool;
+        workers[w].id = w;
+        started[w] = (w > 0 && pthread_create(&threads[w], NULL, pool_worker_main, &workers[w]) == 0);
+    }
+    pool_worker_main(&workers[0]);
+    for (int w = 1; w < nworkers; w++) {
+        if (started[w]) pthread_join(threads[w], NULL);
+    }
+    
+    for (int w = 0; w < nworkers; w++) pthread_mutex_destroy(&pool.deques[w].lock);
+    free(pool.deques); free(workers); free(threads); free(slots);
+}
+
+/*
+ * Intra-file parallelism for very large files
+ *
+ * The mapping is cut into chunks at line boundaries, preferring a boundary
+ * just before a [context] header so most chunks start a fresh context.
+ * A parallel prescan counts each chunk's lines and finds the last context
+ * header in it; a serial join turns that into the starting line number and
+ * context of every chunk. The chunks are then validated in parallel, each
+ * with its own state and diagnostic buffer, and the buffers are emitted in
+ * file order, so the output matches a single-threaded run.
+ */
+typedef struct {
+    const char *start;
+    size_t len;
+    
+    // Prescan results
+    int lines;
+    int has_header;           // A [...] line was seen (sets in_context)
+    str_view last_context;    // Name from the last well-formed header, if any
+    int exten_set;            // --xref, --emit-snapshot: the chunk ends with its own current extension...
+    str_view last_exten;      // ...this one (empty after a header)
+    
+    // Validation results
+    validator_state state;
+    validator_stats stats;    // --stats
+    context_profile profile;  // --profile-contexts
+} file_chunk;
+
+typedef struct {
+    file_chunk *chunks;
+    validator_options opts;   // Per-chunk options (no nested parallelism)
+} chunk_batch;
+
+static void prescan_chunk(void *ctx, int worker, int index) {
+    file_chunk *chunk = &((chunk_batch *)ctx)->chunks[index];
+    int index_facts = ((chunk_batch *)ctx)->opts.index;
+    const char *p = chunk->start, *end = chunk->start + chunk->len;
+    line_tag tags[TAG_BLOCK];
+    (void)worker;
+    
+    while (p < end) {
+        const char *next;
+        size_t n = classify_block(p, end, tags, TAG_BLOCK, &next);
+        
+        if (n == 0) {
+            // Oversized line: count it, it can't be a header worth carrying
+            const char *newline = memchr(p, '\n', (size_t)(end - p));
+            chunk->lines++;
+            p = newline ? newline + 1 : end;
+            continue;
+        }
+        
+        chunk->lines += (int)n;
+        for (size_t i = 0; i < n; i++) {
+            if (index_facts && tags[i].kind == LINE_EXTEN) {
+                // Same pattern parse_extension() would give 'same' lines
+                str_view line = make_view(p + tags[i].off, tags[i].len);
+                const char *arrow = view_find2(line, '=', '>');
+                if (arrow && !is_same_line(line)) {
+                    line_scan scan;
+                    scan_fields(trim(view_from(line, arrow + 2)), 2, &scan);
+                    chunk->last_exten = exten_pattern(scan.field[0]);
+                    chunk->exten_set = 1;
+                }
+            }
+            if (tags[i].kind != LINE_CONTEXT) continue;
+            
+            str_view name;
+            chunk->has_header = 1;
+            chunk->exten_set = 1;
+            chunk->last_exten = make_view(p, 0);
+            if (header_name(make_view(p + tags[i].off, tags[i].len), &name)) {
+                chunk->last_context = name;
+            }
+        }
+        p = next;
+    }
+}
+
+static void validate_chunk(void *ctx, int worker, int index) {
+    chunk_batch *batch = ctx;
+    file_chunk *chunk = &batch->chunks[index];
+    (void)worker;
+    
+    chunk->state.opts = &batch->opts;
+    validate_buffer(chunk->start, chunk->len, &chunk->state);
+}
+
+/* Split an exten / same line the way parse_extension() does; 0 if it has no '=>' */
+static int chunk_priority(str_view t, int *is_same, line_scan *scan, priority_field *pf) {
+    const char *arrow = view_find2(t, '=', '>');
+    if (!arrow) return 0;
+    
+    *is_same = is_same_line(t);
+    scan_fields(trim(view_from(t, arrow + 2)), *is_same ? 1 : 2, scan);
+    split_priority(*is_same, scan, pf);
+    return 1;
+}
+
+/*
+ * Priority sequence at the start of a chunk, which depends on the lines of
+ * the extension it opens in and, through 'n', on the line before those.
+ * Walk back to the first line that fixes it, a context header or a line
+ * with a priority other than 'n' before the extension's first line, and
+ * replay from there without reporting. Chunks mostly start at a header, and
+ * otherwise this is rarely more than a few lines.
+ */
+static void carry_sequence(const char *buf, const validator_state *start_state,
+                           const file_chunk *chunk, validator_state *cs) {
+    const char *p = chunk->start, *from = buf;
+    const char *newline = memchr(p, '\n', chunk->len);
+    str_view first = trim(make_view(p, newline ? (size_t)(newline - p) : chunk->len));
+    str_view exten = NO_VIEW;
+    int phase = 0;  // 0: before the current extension's exten line, 1: in it, 2: before it
+    int back = 0;
+    
+    if (classify_line(first) == LINE_CONTEXT) return;  // Its header resets the sequence
+    
+    while (p > buf) {
+        const char *eol = p - 1, *sol = eol;
+        while (sol > buf && sol[-1] != '\n') sol--;
+        str_view t = trim(make_view(sol, (size_t)(eol - sol)));
+        line_kind kind = classify_line(t);
+        line_scan scan;
+        priority_field pf;
+        int is_same;
+        
+        p = sol;
+        back++;
+        if (kind == LINE_CONTEXT) break;
+        if (kind != LINE_EXTEN || !chunk_priority(t, &is_same, &scan, &pf)) continue;
+        
+        if (!is_same && phase == 0) {
+            exten = pf.exten;
+            phase = 1;
+        } else if (!is_same && phase == 1 && (pf.exten.len != exten.len ||
+                                              memcmp(pf.exten.ptr, exten.ptr, exten.len) != 0)) {
+            phase = 2;
+        }
+        if (phase == 2 && (!is_same || pf.priority.ptr) && !view_eq(pf.priority, "n")) break;
+    }
+    
+    // Replay [p, chunk start) with cs's line number moved back to p
+    int line_num = cs->line_num;
+    if (p == buf) cs->seq = start_state->seq;
+    else from = p;
+    cs->line_num -= back;
+    
+    while (from < chunk->start) {
+        const char *eol = memchr(from, '\n', (size_t)(chunk->start - from));
+        str_view t = trim(make_view(from, (size_t)(eol - from)));
+        line_kind kind = classify_line(t);
+        line_scan scan;
+        priority_field pf;
+        int is_same;
+        
+        cs->line_num++;
+        if (kind == LINE_CONTEXT) seq_reset(&cs->seq);
+        else if (kind == LINE_EXTEN && chunk_priority(t, &is_same, &scan, &pf)) {
+            track_priority(is_same, &pf, &scan, t, 1, cs);
+        }
+        from = eol + 1;
+    }
+    cs->line_num = line_num;
+}
+
+/* Pick the end of the chunk that should end near target */
+static const char *chunk_boundary(const char *target, const char *end) {
+    const char *newline = memchr(target, '\n', (size_t)(end - target));
+    if (!newline) return end;
+    
+    // Prefer starting the next chunk at a context header close by
+    const char *limit = newline + CHUNK_HEADER_WINDOW < end ? newline + CHUNK_HEADER_WINDOW : end;
+    for (const char *p = newline; p && p + 1 < limit; p = memchr(p + 1, '\n', (size_t)(limit - p - 1))) {
+        if (p[1] == '[') return p + 1;
+    }
+    return newline + 1;
+}
+
+/* Returns 0 if the buffer isn't worth splitting; the caller validates it serially */
+static int validate_chunked(const char *buf, size_t len, validator_state *state) {
+    int workers = state->opts ? state->opts->jobs : 1;
+    if (workers <= 1 || len < (size_t)PARALLEL_MIN_BYTES) {
+        return 0;
+    }
+    
+    size_t nchunks = (size_t)workers * CHUNKS_PER_WORKER;
+    if (nchunks > len / CHUNK_MIN_BYTES) nchunks = len / CHUNK_MIN_BYTES;
+    if (nchunks < 2) {
+        return 0;
+    }
+    
+    chunk_batch batch;
+    batch.chunks = calloc(nchunks, sizeof(file_chunk));
+    batch.opts = *state->opts;
+    batch.opts.jobs = 1;
+    if (!batch.chunks) {
+        return 0;
+    }
+    
+    // Cut at line boundaries; a boundary that overshoots the next target merges the two
+    const char *end = buf + len, *p = buf;
+    size_t n = 0;
+    for (size_t i = 1; i <= nchunks && p < end; i++) {
+        const char *stop = (i == nchunks) ? end : buf + len / nchunks * i;
+        if (stop < p) continue;
+        if (i < nchunks) stop = chunk_boundary(stop, end);
+        batch.chunks[n].start = p;
+        batch.chunks[n].len = (size_t)(stop - p);
+        n++;
+        p = stop;
+    }
+    
+    run_pool((int)n, workers, prescan_chunk, &batch);
+    
+    // Join: carry line numbers and the open context across chunk boundaries
+    int line_num = state->line_num;
+    int in_context = state->in_context;
+    str_view context = state_name(state, state->context);
+    str_view exten = state_name(state, state->exten);
+    for (size_t i = 0; i < n; i++) {
+        validator_state *cs = &batch.chunks[i].state;
+        cs->line_num = line_num;
+        cs->in_context = in_context;
+        set_context(cs, context);
+        set_exten(cs, exten);
+        carry_sequence(buf, state, &batch.chunks[i], cs);
+        cs->stats = state->stats ? &batch.chunks[i].stats : NULL;
+        cs->profile = state->profile ? &batch.chunks[i].profile : NULL;
+        
+        line_num += batch.chunks[i].lines;
+        if (batch.chunks[i].has_header) in_context = 1;
+        if (batch.chunks[i].last_context.len) context = batch.chunks[i].last_context;
+        if (batch.chunks[i].exten_set) exten = batch.chunks[i].last_exten;
+    }
+    
+    run_pool((int)n, workers, validate_chunk, &batch);
+    
+    for (size_t i = 0; i < n; i++) {
+        state_absorb(state, &batch.chunks[i].state.diags, 0);
+        if (state->stats) stats_add(state->stats, &batch.chunks[i].stats, -1);
+        if (state->profile) profile_add(state->profile, &batch.chunks[i].profile);
+        profile_free(&batch.chunks[i].profile);
+    }
+    
+    file_chunk *last = &batch.chunks[n - 1];
+    state->line_num = last->state.line_num;
+    state->in_context = last->state.in_context;
+    set_context(state, state_name(&last->state, last->state.context));
+    set_exten(state, state_name(&last->state, last->state.exten));
+    state->seq = last->state.seq;
+    
+    for (size_t i = 0; i < n; i++) diag_free(&batch.chunks[i].state.diags);
+    free(batch.chunks);
+    return 1;
+}
+
+/*
+ * Per-context result cache
+ *
+ * A file is split into blocks where parse_context() fires: an optional
+ * preamble, then one block per [context] header running to the next one.
+ * A block's diagnostics depend only on its own text, plus the inherited
+ * context when its header is malformed, so they are stored per block under
+ * a hash of exactly that, with line numbers relative to the block. On the
+ * next run a block whose key is found is replayed from the cache instead of
+ * being parsed. With --cache DIR the cache is kept on disk, one file per
+ * input file.
+ */
+typedef struct {
+    size_t off;
+    size_t len;
+    int lines;
+    int has_header;   // Starts with a [...] line (only the preamble doesn't)
+} text_block;
+
+/* Split buf at context headers; the caller frees the array */
+static text_block *split_blocks(const char *buf, size_t len, size_t *count) {
+    size_t n = 0, cap = 16;
+    text_block *blocks = malloc(cap * sizeof(text_block));
+    line_tag tags[TAG_BLOCK];
+    const char *p = buf, *end = buf + len;
+    
+    if (!blocks) return NULL;
+    blocks[0].off = 0;
+    blocks[0].len = 0;
+    blocks[0].lines = 0;
+    blocks[0].has_header = 0;
+    
+    while (p < end) {
+        const char *next;
+        size_t nt = classify_block(p, end, tags, TAG_BLOCK, &next);
+        
+        if (nt == 0) {
+            const char *newline = memchr(p, '\n', (size_t)(end - p));
+            blocks[n].lines++;
+            p = newline ? newline + 1 : end;
+            continue;
+        }
+        
+        for (size_t i = 0; i < nt; i++) {
+            if (tags[i].kind == LINE_CONTEXT && (blocks[n].lines > 0 || blocks[n].has_header)) {
+                const char *start = p + tags[i].off - tags[i].indent;
+                if (n + 1 == cap) {
+                    text_block *grown = realloc(blocks, cap * 2 * sizeof(text_block));
+                    if (!grown) {
+                        free(blocks);
+                        return NULL;
+                    }
+                    blocks = grown;
+                    cap *= 2;
+                }
+                blocks[n].len = (size_t)(start - buf) - blocks[n].off;
+                n++;
+                blocks[n].off = (size_t)(start - buf);
+                blocks[n].lines = 0;
+                blocks[n].has_header = 0;
+            }
+            if (tags[i].kind == LINE_CONTEXT && blocks[n].lines == 0) blocks[n].has_header = 1;
+            blocks[n].lines++;
+        }
+        p = next;
+    }
+    
+    blocks[n].len = len - blocks[n].off;
+    *count = n + 1;
+    return blocks;
+}
+
+typedef struct {
+    uint64_t key;
+    int lines;
+    diag_buffer diags;   // Line numbers relative to the block (1 = its first line)
+} cache_entry;
+
+struct block_cache {
+    cache_entry *entries;
+    size_t count;
+    size_t cap;
+    uint32_t *slots;     // Open-addressing index: entry number + 1, 0 = empty
+    size_t nslots;       // Power of two
+};
+
+static void cache_free(block_cache *cache) {
+    for (size_t i = 0; i < cache->count; i++) diag_free(&cache->entries[i].diags);
+    free(cache->entries);
+    free(cache->slots);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static cache_entry *cache_find(const block_cache *cache, uint64_t key) {
+    if (!cache->nslots) return NULL;
+    for (size_t i = (size_t)key & (cache->nslots - 1);; i = (i + 1) & (cache->nslots - 1)) {
+        uint32_t slot = cache->slots[i];
+        if (slot == 0) return NULL;
+        if (cache->entries[slot - 1].key == key) return &cache->entries[slot - 1];
+    }
+}
+
+/* Add an entry (keeping the first one for a duplicate key); returns NULL on OOM */
+static cache_entry *cache_add(block_cache *cache, uint64_t key, int lines) {
+    cache_entry *found = cache_find(cache, key);
+    if (found) return found;
+    
+    if ((cache->count + 1) * 2 > cache->nslots) {
+        size_t nslots = cache->nslots ? cache->nslots * 2 : 64;
+        uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+        if (!slots) return NULL;
+        for (size_t e = 0; e < cache->count; e++) {
+            size_t i = (size_t)cache->entries[e].key & (nslots - 1);
+            while (slots[i]) i = (i + 1) & (nslots - 1);
+            slots[i] = (uint32_t)e + 1;
+        }
+        free(cache->slots);
+        cache->slots = slots;
+        cache->nslots = nslots;
+    }
+    if (cache->count == cache->cap) {
+        size_t cap = cache->cap ? cache->cap * 2 : 32;
+        cache_entry *entries = realloc(cache->entries, cap * sizeof(cache_entry));
+        if (!entries) return NULL;
+        cache->entries = entries;
+        cache->cap = cap;
+    }
+    
+    cache_entry *entry = &cache->entries[cache->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->key = key;
+    entry->lines = lines;
+    
+    size_t i = (size_t)key & (cache->nslots - 1);
+    while (cache->slots[i]) i = (i + 1) & (cache->nslots - 1);
+    cache->slots[i] = (uint32_t)++cache->count;
+    return entry;
+}
+
+/* Inputs other than the block text that change its diagnostics */
+static uint64_t options_fingerprint(const validator_options *opts) {
+    uint64_t h = hash_bytes(VERSION, strlen(VERSION), CACHE_FORMAT);
+    h = mix64(h ^ (uint64_t)opts->follow_includes ^ ((uint64_t)opts->xref << 1) ^
+              ((uint64_t)opts->check_patterns << 2) ^ ((uint64_t)opts->check_globals << 3) ^
+              ((uint64_t)opts->check_apps << 4) ^ ((uint64_t)opts->index << 5) ^ ((uint64_t)opts->steps << 6) ^ (opts->apps ? opts->apps->fingerprint : 0));
+    return mix64(h ^ (sizeof(diagnostic) << 8) ^ DIAG_CODE_COUNT);
+}
+
+/* Context name set by a block's header line, if it is well-formed */
+static int block_header(const char *text, const text_block *b, str_view *name) {
+    str_view block = make_view(text, b->len);
+    const char *newline = view_chr(block, '\n');
+    
+    if (!b->has_header) return 0;
+    return header_name(trim(newline ? view_until(block, newline) : block), name);
+}
+
+/* Cache key for a block, given the state it starts in */
+static uint64_t block_key(const char *text, const text_block *b, const validator_state *state) {
+    uint64_t key = hash_bytes(text, b->len, 0);
+    str_view name;
+    
+    // Without a good header of its own, the block sees the inherited context
+    if (!block_header(text, b, &name)) {
+        str_view context = state_name(state, state->context);
+        key ^= hash_bytes(context.ptr, context.len, (uint64_t)state->in_context + 1);
+        key = mix64(key);
+    }
+    return key;
+}
+
+/*
+ * Validate buf block by block, replaying blocks found in old and recording
+ * every block's diagnostics in fresh (either may be NULL). Entries reused
+ * from old are moved, not copied, into fresh. Returns the number of blocks
+ * that had to be parsed.
+ */
+static size_t validate_blocks(const char *buf, size_t len, validator_state *state,
+                              block_cache *old, block_cache *fresh) {
+    size_t nblocks = 0, parsed = 0;
+    text_block *blocks = split_blocks(buf, len, &nblocks);
+    
+    if (!blocks) {
+        validate_buffer(buf, len, state);
+        return 1;
+    }
+    
+    for (size_t b = 0; b < nblocks && !state->stopped; b++) {
+        const char *text = buf + blocks[b].off;
+        uint64_t key = block_key(text, &blocks[b], state);
+        cache_entry *hit = fresh ? cache_find(fresh, key) : NULL;  // Repeated block
+        int base_line = state->line_num;
+        size_t first = state->diags.count, first_fact = state->diags.fact_count;
+        
+        if (!hit && old) hit = cache_find(old, key);
+        if (hit && hit->lines != blocks[b].lines) hit = NULL;
+        
+        if (hit) {
+            // Replay, then leave the state as validating the block would have
+            state_absorb(state, &hit->diags, base_line);
+            state->line_num += blocks[b].lines;
+            if (blocks[b].has_header) {
+                str_view name;
+                state->in_context = 1;
+                if (block_header(text, &blocks[b], &name)) set_context(state, name);
+            }
+        } else {
+            validate_buffer(text, blocks[b].len, state);
+            parsed++;
+        }
+        
+        // A block cut short by --max-errors isn't a complete result
+        cache_entry *entry = (fresh && !state->stopped) ? cache_add(fresh, key, blocks[b].lines) : NULL;
+        if (!entry || entry == hit || entry->diags.count || entry->diags.fact_count) continue;
+        
+        if (hit) {
+            entry->diags = hit->diags;
+            memset(&hit->diags, 0, sizeof(hit->diags));
+        } else {
+            for (size_t i = first; i < state->diags.count; i++) {
+                diag_copy(&entry->diags, &state->diags, &state->diags.items[i], -base_line);
+            }
+            for (size_t i = first_fact; i < state->diags.fact_count; i++) {
+                fact_copy(&entry->diags, &state->diags, &state->diags.facts[i], -base_line);
+            }
+        }
+    }
+    
+    free(blocks);
+    return parsed;
+}
+
+/* On-disk cache: one file per input, named after a hash of its real path */
+#define CACHE_MAGIC 0x43565044u   // "DPVC"
+
+static char *cache_path(const char *dir, const char *filename) {
+    char real[PATH_MAX];
+    const char *name = realpath(filename, real) ? real : filename;
+    size_t n = strlen(dir) + 32;
+    char *path = malloc(n);
+    if (path) {
+        snprintf(path, n, "%s/%016llx.dpvc", dir,
+                 (unsigned long long)hash_bytes(name, strlen(name), 0));
+    }
+    return path;
+}
+
+static int read_u32(FILE *fp, uint32_t *v) { return fread(v, sizeof(*v), 1, fp) == 1; }
+static int read_u64(FILE *fp, uint64_t *v) { return fread(v, sizeof(*v), 1, fp) == 1; }
+
+/* Running checksum of the cache payload, chained over each piece in file order */
+static void payload_hash(uint64_t *h, const void *data, size_t len) {
+    if (len) *h = hash_bytes(data, len, *h);
+}
+
+/* Read n items of size bytes into a new array (NULL for n == 0) */
+static int read_array(FILE *fp, void **array, size_t n, size_t size) {
+    *array = NULL;
+    if (n == 0) return 1;
+    if (n > (1u << 24) || !(*array = malloc(n * size))) return 0;
+    return fread(*array, size, n, fp) == n;
+}
+
+static int text_ok(const diag_buffer *d, uint32_t off) {
+    return off == NO_TEXT || off < d->text_len;
+}
+
+/* Bounds-check a loaded entry so that replaying it can't read outside its arena */
+static int entry_ok(const diag_buffer *d) {
+    if (d->text_len && d->text[d->text_len - 1] != '\0') return 0;
+    for (size_t i = 0; i < d->count; i++) {
+        const diagnostic *item = &d->items[i];
+        if (item->code >= DIAG_CODE_COUNT || !text_ok(d, item->context) || !text_ok(d, item->message)) {
+            return 0;
+        }
+    }
+    for (size_t i = 0; i < d->fact_count; i++) {
+        const fact *item = &d->facts[i];
+        if (!text_ok(d, item->context) || !text_ok(d, item->text) ||
+            !text_ok(d, item->exten) || !text_ok(d, item->label)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Load a cache file; a missing, stale or damaged file just gives an empty
+ * cache. Damage the bounds checks can't see (a flipped line number or code)
+ * is caught by the payload checksum and is a miss too.
+ */
+static void cache_load(block_cache *cache, const char *path, uint64_t fingerprint) {
+    FILE *fp = fopen(path, "rb");
+    uint32_t magic, count;
+    uint64_t fp_stored, hash_stored, hash = 0;
+    uint32_t e;
+    
+    if (!fp) return;
+    if (!read_u32(fp, &magic) || magic != CACHE_MAGIC ||
+        !read_u64(fp, &fp_stored) || fp_stored != fingerprint || !read_u32(fp, &count) ||
+        !read_u64(fp, &hash_stored)) {
+        fclose(fp);
+        return;
+    }
+    
+    for (e = 0; e < count; e++) {
+        uint64_t key;
+        uint32_t lines, ndiags, nfacts, text_len;
+        if (!read_u64(fp, &key) || !read_u32(fp, &lines) || !read_u32(fp, &ndiags) ||
+            !read_u32(fp, &nfacts) || !read_u32(fp, &text_len)) {
+            break;
+        }
+        
+        uint32_t header[4] = { lines, ndiags, nfacts, text_len };
+        payload_hash(&hash, &key, sizeof(key));
+        payload_hash(&hash, header, sizeof(header));
+        
+        // cache_save() writes each key once, so a repeated one is damage (and
+        // cache_add() would hand back the entry whose arrays are already read)
+        if (cache_find(cache, key)) {
+            cache_free(cache);
+            break;
+        }
+        cache_entry *entry = cache_add(cache, key, (int)lines);
+        if (!entry) break;
+        
+        diag_buffer *d = &entry->diags;
+        int ok = read_array(fp, (void **)&d->items, ndiags, sizeof(diagnostic)) &&
+                 read_array(fp, (void **)&d->facts, nfacts, sizeof(fact)) &&
+                 read_array(fp, (void **)&d->text, text_len, 1);
+        d->count = d->cap = d->items ? ndiags : 0;
+        d->fact_count = d->fact_cap = d->facts ? nfacts : 0;
+        d->text_len = d->text_cap = d->text ? text_len : 0;
+        if (!ok || !entry_ok(d)) {
+            // Half-read entry: drop everything rather than replay garbage
+            cache_free(cache);
+            break;
+        }
+        payload_hash(&hash, d->items, d->count * sizeof(diagnostic));
+        payload_hash(&hash, d->facts, d->fact_count * sizeof(fact));
+        payload_hash(&hash, d->text, d->text_len);
+    }
+    if (e < count || hash != hash_stored) cache_free(cache);   // Truncated or corrupted: a miss
+    fclose(fp);
+}
+
+/*
+ * Write n diagnostics or facts through zeroed copies, so the padding in
+ * them is the same (and checksummed the same) on every run instead of
+ * whatever the heap held.
+ */
+static void write_diags(FILE *fp, const diagnostic *items, size_t n, uint64_t *hash) {
+    for (size_t i = 0; i < n; i++) {
+        diagnostic out;
+        memset(&out, 0, sizeof(out));
+        out.code = items[i].code;
+        out.level = items[i].level;
+        out.line = items[i].line;
+        out.column = items[i].column;
+        out.span = items[i].span;
+        out.context = items[i].context;
+        out.message = items[i].message;
+        fwrite(&out, sizeof(out), 1, fp);
+        payload_hash(hash, &out, sizeof(out));
+    }
+}
+
+static void write_facts(FILE *fp, const fact *items, size_t n, uint64_t *hash) {
+    for (size_t i = 0; i < n; i++) {
+        fact out;
+        memset(&out, 0, sizeof(out));
+        out.kind = items[i].kind;
+        out.line = items[i].line;
+        out.column = items[i].column;
+        out.span = items[i].span;
+        out.context = items[i].context;
+        out.text = items[i].text;
+        out.exten = items[i].exten;
+        out.label = items[i].label;
+        fwrite(&out, sizeof(out), 1, fp);
+        payload_hash(hash, &out, sizeof(out));
+    }
+}
+
+/* Write the cache atomically (temp file + rename) so readers never see a partial file */
+static int cache_save(const block_cache *cache, const char *path, uint64_t fingerprint) {
+    size_t n = strlen(path) + 16;
+    char *tmp = malloc(n);
+    if (!tmp) return 0;
+    snprintf(tmp, n, "%s.%ld", path, (long)getpid());
+    
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        free(tmp);
+        return 0;
+    }
+    
+    uint32_t magic = CACHE_MAGIC, count = (uint32_t)cache->count;
+    uint64_t hash = 0;
+    fwrite(&magic, sizeof(magic), 1, fp);
+    fwrite(&fingerprint, sizeof(fingerprint), 1, fp);
+    fwrite(&count, sizeof(count), 1, fp);
+    long hash_at = ftell(fp);
+    fwrite(&hash, sizeof(hash), 1, fp);   // Filled in once the payload is written
+    
+    // Each entry's arrays and arena are written as they are, offsets and all
+    for (size_t e = 0; e < cache->count; e++) {
+        const cache_entry *entry = &cache->entries[e];
+        const diag_buffer *d = &entry->diags;
+        uint32_t header[4] = { (uint32_t)entry->lines, (uint32_t)d->count,
+                               (uint32_t)d->fact_count, (uint32_t)d->text_len };
+        fwrite(&entry->key, sizeof(entry->key), 1, fp);
+        fwrite(header, sizeof(header), 1, fp);
+        payload_hash(&hash, &entry->key, sizeof(entry->key));
+        payload_hash(&hash, header, sizeof(header));
+        write_diags(fp, d->items, d->count, &hash);
+        write_facts(fp, d->facts, d->fact_count, &hash);
+        if (d->text_len) fwrite(d->text, 1, d->text_len, fp);
+        payload_hash(&hash, d->text, d->text_len);
+    }
+    
+    int ok = hash_at >= 0 && fseek(fp, hash_at, SEEK_SET) == 0 && fwrite(&hash, sizeof(hash), 1, fp) == 1;
+    ok = (fclose(fp) == 0) && ok && rename(tmp, path) == 0;
+    if (!ok) unlink(tmp);
+    free(tmp);
+    return ok;
+}
+
+/* --cache path for a mapped file */
+static void validate_cached(const char *buf, size_t len, const char *filename,
+                            validator_state *state) {
+    const char *dir = state->opts->cache_dir;
+    uint64_t fingerprint = options_fingerprint(state->opts);
+    block_cache old = {0}, fresh = {0};
+    char *path = cache_path(dir, filename);
+    
+    if (!path) {
+        validate_buffer(buf, len, state);
+        return;
+    }
+    
+    cache_load(&old, path, fingerprint);
+    size_t parsed = validate_blocks(buf, len, state, &old, &fresh);
+    
+    // Rewrite the file only if it would change
+    if (!state->stopped && (parsed || fresh.count != old.count)) {
+        // Create the directory on first use; other failures show up in cache_save()
+        (void)mkdir(dir, 0777);
+        if (!cache_save(&fresh, path, fingerprint)) {
+            fprintf(stderr, "Warning: Cannot write cache file '%s'\n", path);
+        }
+    }
+    
+    cache_free(&old);
+    cache_free(&fresh);
+    free(path);
+}
+
+/* --watch path: replay from the resident cache, then replace it with this run's blocks */
+static void validate_resident(const char *buf, size_t len, validator_state *state) {
+    block_cache fresh = {0};
+    
+    validate_blocks(buf, len, state, state->resident, &fresh);
+    if (state->stopped) {
+        cache_free(&fresh);  // Incomplete; keep the previous results
+        return;
+    }
+    cache_free(state->resident);
+    *state->resident = fresh;
+}
+
+/*
+ * Encoding, settled once per file rather than per line. A UTF-8 byte order
+ * mark is skipped so it can't hide the first [context]. The first line's
+ * ending decides the file's style: an LF file only needs one memchr() for
+ * '\r' to know it is clean, a CRLF file has its newlines walked once, and
+ * the first line ending the other way becomes a single W_EOL_MIXED.
+ */
+static size_t bom_length(const char *buf, size_t len) {
+    return (len >= 3 && memcmp(buf, "\xEF\xBB\xBF", 3) == 0) ? 3 : 0;
+}
+
+static int count_newlines(const char *p, const char *end) {
+    int n = 0;
+    while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        n++;
+        p++;
+    }
+    return n;
+}
+
+/* Check the line endings of the complete lines in buf, which follow state->line_num lines */
+static void note_line_endings(const char *buf, size_t len, validator_state *state) {
+    const char *end = buf + len;
+    
+    if (state->eol_mixed || len == 0) return;
+    if (state->eol == EOL_UNKNOWN) {
+        const char *newline = memchr(buf, '\n', len);
+        if (!newline) return;
+        state->eol = (newline > buf && newline[-1] == '\r') ? EOL_CRLF : EOL_LF;
+    }
+    
+    if (state->eol == EOL_LF) {
+        const char *cr = buf;
+        while ((cr = memchr(cr, '\r', (size_t)(end - cr))) != NULL) {
+            if (cr + 1 < end && cr[1] == '\n') {
+                state->eol_mixed = state->line_num + count_newlines(buf, cr) + 1;
+                return;
+            }
+            cr++;
+        }
+        return;
+    }
+    
+    const char *p = buf;
+    int line = state->line_num;
+    for (const char *newline; (newline = memchr(p, '\n', (size_t)(end - p))) != NULL; p = newline + 1) {
+        line++;
+        if (newline == buf || newline[-1] != '\r') {
+            state->eol_mixed = line;
+            return;
+        }
+    }
+}
+
+/* Once the whole file is validated, put the W_EOL_MIXED warning in line order */
+static void report_line_endings(validator_state *state) {
+    if (!state->eol_mixed) return;
+    if (state->stopped) {
+        // Nothing after the error that hit --max-errors counts (a cache replay may run past it)
+        size_t n = state->diags.count;
+        if (n == 0 || state->eol_mixed > state->diags.items[n - 1].line) return;
+    }
+    
+    size_t first = state->diags.count;
+    int line_num = state->line_num;
+    uint32_t context = state->context;
+    state->line_num = state->eol_mixed;
+    state->context = 0;
+    state->line_start = NULL;
+    report(state, DIAG_WARNING, W_EOL_MIXED, NULL, 0, "Line ends with %s, but earlier lines end with %s",
+           state->eol == EOL_CRLF ? "LF" : "CRLF", state->eol == EOL_CRLF ? "CRLF" : "LF");
+    state->line_num = line_num;
+    state->context = context;
+    merge_late_diags(&state->diags, first);
+}
+
+/*
+ * Zero-copy path: map a regular file read-only and validate it in place.
+ * Returns 0 if the descriptor can't be mapped (pipe, device, odd filesystem)
+ * so the caller can fall back to reading it as a stream.
+ */
+static int validate_mapped(int fd, const char *filename, validator_state *state) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    
+    if (st.st_size == 0) {
+        return 1;  // Empty file: nothing to map, nothing to check
+    }
+    
+    size_t len = (size_t)st.st_size;
+    uint64_t start = stat_start(state);
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    
+#ifdef MADV_SEQUENTIAL
+    madvise(map, len, MADV_SEQUENTIAL);
+#endif
+    stat_stop(state, STAGE_READ, start, len);  // Pages are read in as they are first touched
+    
+    size_t skip = bom_length(map, len);
+    const char *text = (const char *)map + skip;
+    note_line_endings(text, len - skip, state);
+    if (state->resident) {
+        validate_resident(text, len - skip, state);
+    } else if (state->opts && state->opts->cache_dir) {
+        validate_cached(text, len - skip, filename, state);
+    } else if (!validate_chunked(text, len - skip, state)) {
+        validate_buffer(text, len - skip, state);
+    }
+    munmap(map, len);
+    return 1;
+}
+
+/* Complete lines read from a stream; the first ones may start with a byte order mark */
+static void validate_piece(const char *buf, size_t len, validator_state *state) {
+    size_t skip = state->line_num == 0 ? bom_length(buf, len) : 0;
+    note_line_endings(buf + skip, len - skip, state);
+    validate_buffer(buf + skip, len - skip, state);
+}
+
+/*
+ * Stream path for inputs that can't be mapped (pipes, standard input). The
+ * complete lines in a fixed buffer are validated as soon as each read()
+ * returns, so checking keeps pace with the producer, and the partial line
+ * left over moves to the front for the next read. The buffer only grows while
+ * one line fills it, so memory stays at the longest line however long the
+ * stream runs.
+ */
+static void validate_stream(int fd, validator_state *state) {
+    size_t cap = STREAM_BUFFER, used = 0;
+    char *buf = malloc(cap);
+    
+    state->seq.copy = malloc(64);
+    state->seq.copy_cap = 64;
+    if (!buf || !state->seq.copy) {
+        report(state, DIAG_ERROR, E_FILE_OPEN, NULL, 0, "Out of memory reading input");
+        free(buf);
+        free(state->seq.copy);
+        memset(&state->seq, 0, sizeof(state->seq));
+        return;
+    }
+    
+    while (!state->stopped) {
+        if (used == cap) {
+            char *bigger = realloc(buf, cap * 2);
+            if (!bigger) {
+                // Splitting the line would report errors it doesn't have
+                state->line_num++;
+                state->line_start = NULL;
+                report(state, DIAG_ERROR, E_FILE_OPEN, NULL, 0,
+                       "Out of memory buffering a line of over %zu bytes; rest of input not checked", used);
+                used = 0;
+                break;
+            }
+            buf = bigger;
+            cap *= 2;
+        }
+        
+        uint64_t start = stat_start(state);
+        ssize_t n = read(fd, buf + used, cap - used);
+        stat_stop(state, STAGE_READ, start, n > 0 ? (uint64_t)n : 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        
+        // Everything up to the last newline read so far is complete
+        size_t end = used + (size_t)n, done = end;
+        while (done > used && buf[done - 1] != '\n') done--;
+        used = end;
+        if (done == 0 || buf[done - 1] != '\n') continue;
+        
+        validate_piece(buf, done, state);
+        memmove(buf, buf + done, used - done);
+        used -= done;
+    }
+    if (used && !state->stopped) validate_piece(buf, used, state);  // Last line, no newline
+    
+    free(buf);
+    free(state->seq.copy);
+    memset(&state->seq, 0, sizeof(state->seq));
+}
+
+/* Main validator: fills state with the counts and diagnostics for one file */
+static void validate_dialplan(const char *filename, validator_state *state) {
+    int is_stdin = strcmp(filename, "-") == 0;
+    int fd = is_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd < 0) {
+        report(state, DIAG_ERROR, E_FILE_OPEN, NULL, 0, "Cannot open file '%s'", filename);
+        return;
+    }
+    
+    // Standard input redirected from a file is mapped like any other
+    if (!validate_mapped(fd, filename, state)) validate_stream(fd, state);
+    if (!is_stdin) close(fd);
+    report_line_endings(state);
+}
+
+/* Outcome of one input file, kept until everything is emitted */
+typedef struct {
+    const char *filename;
+    int errors;
+    int warnings;
+    int stopped;
+    int max_errors;      // --max-errors it was validated with, for late diagnostics (0 = no limit)
+    diag_buffer diags;
+    int included_by;     // --includes: index + 1 of the including file's result (0 = none)
+    int included_line;
+    int lines;
+    validator_stats stats;   // --stats
+    context_profile profile; // --profile-contexts
+} file_result;
+
+static void take_result(file_result *result, validator_state *state) {
+    result->errors = state->errors;
+    result->warnings = state->warnings;
+    result->stopped = state->stopped;
+    result->max_errors = state->opts ? state->opts->max_errors : 0;
+    result->lines = state->line_num;
+    result->diags = state->diags;
+    memset(&state->diags, 0, sizeof(state->diags));
+}
+
+static int result_status(const file_result *result) {
+    return result->errors > 0 ? 1 : 0;
+}
+
+/* One diagnostic in the original text format, after "file: " if file isn't NULL */
+static void print_diag(FILE *out, const diag_buffer *d, const diagnostic *item, const char *file) {
+    const char *message = diag_text(d, item->message);
+    if (!message) message = diag_info[item->code].description;
+    
+    if (file) fprintf(out, "%s: ", file);
+    if (item->line == 0) {
+        fprintf(out, "Error: %s\n", message);
+    } else if (item->level == DIAG_WARNING) {
+        fprintf(out, "Line %d: Warning: %s\n", item->line, message);
+    } else {
+        fprintf(out, "Line %d: %s\n", item->line, message);
+    }
+}
+
+static int open_failed(const file_result *result) {
+    for (size_t i = 0; i < result->diags.count; i++) {
+        if (result->diags.items[i].code == E_FILE_OPEN) return 1;
+    }
+    return 0;
+}
+
+/* "In file included from" lines for a file reached through #include */
+static void print_include_chain(FILE *out, const file_result *results, const file_result *result) {
+    for (const file_result *r = result; r->included_by; r = &results[r->included_by - 1]) {
+        fprintf(out, "%s %s:%d:\n", r == result ? "In file included from" : "                 from",
+                results[r->included_by - 1].filename, r->included_line);
+    }
+}
+
+/*
+ * Text output: diagnostics to stderr, summary to stdout (the original
+ * format). With named, as when more than one file is printed, every line
+ * says which file it is about.
+ */
+static void emit_text(const file_result *results, int index, int max_errors, int named) {
+    const file_result *result = &results[index];
+    const diag_buffer *d = &result->diags;
+    const char *file = named ? result->filename : NULL;
+    
+    if (d->count && result->included_by) print_include_chain(stderr, results, result);
+    for (size_t i = 0; i < d->count; i++) print_diag(stderr, d, &d->items[i], file);
+    fflush(stderr);
+    
+    if (open_failed(result)) {
+        return;  // No summary for a file that couldn't be read
+    }
+    
+    // Summary
+    printf("\n");
+    if (result->errors == 0 && result->warnings == 0) {
+        printf("✓ Syntax valid: %s\n", result->filename);
+    } else if (named) {
+        printf("Validation complete: %s: %d error(s), %d warning(s)\n",
+               result->filename, result->errors, result->warnings);
+    } else {
+        printf("Validation complete: %d error(s), %d warning(s)\n", 
+               result->errors, result->warnings);
+    }
+    if (result->stopped) {
+        printf("Stopped after %d error(s) (--max-errors %d)\n", result->errors, max_errors);
+    }
+    fflush(stdout);
+}
+
+/* Write s as a JSON string; invalid UTF-8 becomes U+FFFD */
+static void json_string(FILE *out, const char *s) {
+    const unsigned char *p = (const unsigned char *)s;
+    
+    fputc('"', out);
+    while (*p) {
+        unsigned char c = *p;
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+            p++;
+        } else if (c == '\n') {
+            fputs("\\n", out);
+            p++;
+        } else if (c == '\r') {
+            fputs("\\r", out);
+            p++;
+        } else if (c == '\t') {
+            fputs("\\t", out);
+            p++;
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+            p++;
+        } else if (c < 0x80) {
+            fputc(c, out);
+            p++;
+        } else {
+            int n = (c >= 0xF0 && c <= 0xF4) ? 3 : (c >= 0xE0) ? 2 : (c >= 0xC2 && c <= 0xDF) ? 1 : -1;
+            int ok = n > 0;
+            for (int i = 1; ok && i <= n; i++) ok = (p[i] & 0xC0) == 0x80;
+            if (ok) {
+                fwrite(p, 1, (size_t)n + 1, out);
+                p += n + 1;
+            } else {
+                fputs("\\ufffd", out);
+                p++;
+            }
+        }
+    }
+    fputc('"', out);
+}
+
+static const char *level_name(int level) {
+    return level == DIAG_WARNING ? "warning" : "error";
+}
+
+/* JSON output: one document on stdout covering every file */
+static void emit_json(const file_result *results, int n) {
+    printf("{\n  \"version\": \"%s\",\n  \"files\": [", VERSION);
+    for (int f = 0; f < n; f++) {
+        const file_result *r = &results[f];
+        const diag_buffer *d = &r->diags;
+        
+        printf("%s\n    {\n      \"file\": ", f ? "," : "");
+        json_string(stdout, r->filename);
+        printf(",\n      \"errors\": %d,\n      \"warnings\": %d,\n      \"stopped\": %s,\n",
+               r->errors, r->warnings, r->stopped ? "true" : "false");
+        if (r->included_by) {
+            // Nearest first, ending at a file named on the command line
+            printf("      \"included_from\": [");
+            for (const file_result *s = r; s->included_by; s = &results[s->included_by - 1]) {
+                printf("%s{\"file\": ", s == r ? "" : ", ");
+                json_string(stdout, results[s->included_by - 1].filename);
+                printf(", \"line\": %d}", s->included_line);
+            }
+            printf("],\n");
+        }
+        printf("      \"diagnostics\": [");
+        for (size_t i = 0; i < d->count; i++) {
+            const diagnostic *item = &d->items[i];
+            const char *context = diag_text(d, item->context);
+            const char *message = diag_text(d, item->message);
+            
+            printf("%s\n        {\"code\": \"%s\", \"level\": \"%s\", \"line\": %d, \"column\": %d, \"span\": %d, \"context\": ",
+                   i ? "," : "", diag_info[item->code].id, level_name(item->level),
+                   item->line, item->column, item->span);
+            if (context) json_string(stdout, context);
+            else printf("null");
+            printf(", \"message\": ");
+            json_string(stdout, message ? message : diag_info[item->code].description);
+            printf("}");
+        }
+        printf("%s]\n    }", d->count ? "\n      " : "");
+    }
+    printf("%s]\n}\n", n ? "\n  " : "");
+}
+
+/* SARIF 2.1.0 output for code-scanning tools */
+static void emit_sarif(const file_result *results, int n) {
+    printf("{\n");
+    printf("  \"$schema\": \"https://json.schemastore.org/sarif-2.1.0.json\",\n");
+    printf("  \"version\": \"2.1.0\",\n");
+    printf("  \"runs\": [\n    {\n");
+    printf("      \"tool\": {\n        \"driver\": {\n");
+    printf("          \"name\": \"dialplan_validator\",\n");
+    printf("          \"version\": \"%s\",\n", VERSION);
+    printf("          \"informationUri\": \"https://github.com/calvintwells/dialplan_validator\",\n");
+    printf("          \"rules\": [");
+    for (int c = 0; c < DIAG_CODE_COUNT; c++) {
+        printf("%s\n            {\"id\": \"%s\", \"shortDescription\": {\"text\": ", c ? "," : "", diag_info[c].id);
+        json_string(stdout, diag_info[c].description);
+        printf("}}");
+    }
+    printf("\n          ]\n        }\n      },\n");
+    printf("      \"results\": [");
+    
+    int first = 1;
+    for (int f = 0; f < n; f++) {
+        const file_result *r = &results[f];
+        const diag_buffer *d = &r->diags;
+        
+        for (size_t i = 0; i < d->count; i++) {
+            const diagnostic *item = &d->items[i];
+            const char *context = diag_text(d, item->context);
+            const char *message = diag_text(d, item->message);
+            
+            printf("%s\n        {\n          \"ruleId\": \"%s\",\n          \"ruleIndex\": %d,\n          \"level\": \"%s\",\n",
+                   first ? "" : ",", diag_info[item->code].id, item->code, level_name(item->level));
+            printf("          \"message\": {\"text\": ");
+            json_string(stdout, message ? message : diag_info[item->code].description);
+            printf("},\n          \"locations\": [{\n            \"physicalLocation\": {\n");
+            printf("              \"artifactLocation\": {\"uri\": ");
+            json_string(stdout, r->filename);
+            printf("}");
+            if (item->line > 0) {
+                printf(",\n              \"region\": {\"startLine\": %d", item->line);
+                if (item->column > 0) {
+                    printf(", \"startColumn\": %d, \"endColumn\": %d", item->column, item->column + item->span);
+                }
+                printf("}");
+            }
+            printf("\n            }");
+            if (context) {
+                printf(",\n            \"logicalLocations\": [{\"name\": ");
+                json_string(stdout, context);
+                printf(", \"kind\": \"namespace\"}]");
+            }
+            printf("\n          }]");
+            if (r->included_by) {
+                printf(",\n          \"relatedLocations\": [");
+                for (const file_result *s = r; s->included_by; s = &results[s->included_by - 1]) {
+                    printf("%s\n            {\"message\": {\"text\": \"included from here\"}, \"physicalLocation\": {\"artifactLocation\": {\"uri\": ",
+                           s == r ? "" : ",");
+                    json_string(stdout, results[s->included_by - 1].filename);
+                    printf("}, \"region\": {\"startLine\": %d}}}", s->included_line);
+                }
+                printf("\n          ]");
+            }
+            printf("\n        }");
+            first = 0;
+        }
+    }
+    printf("%s]\n    }\n  ]\n}\n", first ? "" : "\n      ");
+}
+
+static void emit_results(const file_result *results, int n, const validator_options *opts) {
+    switch (opts->format) {
+        case FORMAT_JSON:
+            emit_json(results, n);
+            break;
+        case FORMAT_SARIF:
+            emit_sarif(results, n);
+            break;
+        default:
+            for (int i = 0; i < n; i++) emit_text(results, i, opts->max_errors, n > 1 || opts->name_files);
+            break;
+    }
+    fflush(stdout);
+}
+
+/*
+ * --stats report, on stderr after the results. output holds the time spent
+ * emitting; the files' own counters are added to it here.
+ */
+static void print_stats(const file_result *results, int n, validator_stats *output) {
+    static const char *const names[STAGE_COUNT] = {
+        "read", "classify", "parse_extension", "check_balanced",
+        "check_variable_syntax", "parse_include", "output"
+    };
+    static const char *const units[STAGE_COUNT] = {
+        "bytes", "lines", "lines", "lines", "lines", "lines", "diagnostics"
+    };
+    
+    for (int i = 0; i < n; i++) stats_add(output, &results[i].stats, i);
+    
+    fflush(stdout);
+    fprintf(stderr, "\nStats (thread time; parse_extension includes the two checks):\n");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        fprintf(stderr, "  %-22s %12llu %-11s %10.2f ms\n", names[i],
+                (unsigned long long)output->count[i], units[i], (double)output->ns[i] / 1e6);
+    }
+    if (output->longest_line) {
+        fprintf(stderr, "  Longest line: %d bytes (%s:%d)\n", output->longest_line,
+                results[output->longest_file].filename, output->longest_at);
+    }
+    if (output->deepest) {
+        fprintf(stderr, "  Deepest nesting: %d (%s:%d)\n", output->deepest,
+                results[output->deepest_file].filename, output->deepest_at);
+    }
+    fflush(stderr);
+}
+
+/* Most time first; ties by size */
+static int compare_cost(const void *a, const void *b) {
+    const context_cost *x = a, *y = b;
+    if (x->ns != y->ns) return x->ns > y->ns ? -1 : 1;
+    if (x->bytes != y->bytes) return x->bytes > y->bytes ? -1 : 1;
+    return 0;
+}
+
+/*
+ * --profile-contexts report, on stderr after the results: the top contexts
+ * by CPU time, with every file's costs and diagnostics added by name
+ */
+static void print_profile(const file_result *results, int n, int top) {
+    context_profile total = {0};
+    uint64_t ns = 0;
+    
+    for (int i = 0; i < n; i++) {
+        const diag_buffer *d = &results[i].diags;
+        profile_add(&total, &results[i].profile);
+        for (size_t j = 0; j < d->count; j++) {
+            const char *name = diag_text(d, d->items[j].context);
+            context_cost *c = profile_entry(&total, name ? name : "", name ? strlen(name) : 0);
+            if (c) c->diagnostics++;
+        }
+    }
+    for (size_t i = 0; i < total.count; i++) ns += total.items[i].ns;
+    if (total.count) qsort(total.items, total.count, sizeof(context_cost), compare_cost);
+    
+    fflush(stdout);
+    fprintf(stderr, "\nContexts by time (%zu of %zu; CPU time):\n",
+            total.count < (size_t)top ? total.count : (size_t)top, total.count);
+    fprintf(stderr, "  %-30s %12s %10s %8s %10s %6s\n", "context", "bytes", "lines", "diags", "ms", "share");
+    for (size_t i = 0; i < total.count && i < (size_t)top; i++) {
+        const context_cost *c = &total.items[i];
+        const char *name = total.names.text + c->name;
+        fprintf(stderr, "  %-30s %12llu %10llu %8llu %10.3f %5.1f%%\n", name[0] ? name : "(before any context)",
+                (unsigned long long)c->bytes, (unsigned long long)c->lines,
+                (unsigned long long)c->diagnostics, (double)c->ns / 1e6, ns ? 100.0 * (double)c->ns / (double)ns : 0.0);
+    }
+    fflush(stderr);
+    profile_free(&total);
+}
+
+/* emit_results(), timed and counted as the output stage for --stats */
+static void emit_counted(const file_result *results, int n, const validator_options *opts,
+                         validator_stats *output) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < n; i++) output->count[STAGE_OUTPUT] += results[i].diags.count;
+    emit_results(results, n, opts);
+    output->ns[STAGE_OUTPUT] += now_ns() - start;
+}
+
+/*
+ * Diagnostics found after a file is done (from its facts) are collected in
+ * a separate buffer, in fact order (so by line), while the file's own
+ * strings are still being read, then merged into place by absorb_late(),
+ * which holds the file to --max-errors as though they had been found in line
+ */
+static void add_fact_diag(diag_buffer *late, const diag_buffer *src, const fact *f,
+                          diag_level level, diag_code code, const char *fmt, ...) {
+    const char *context = diag_text(src, f->context);
+    diagnostic item;
+    va_list ap;
+    
+    item.code = (uint16_t)code;
+    item.level = (uint8_t)level;
+    item.line = f->line;
+    item.column = f->column;
+    item.span = f->span;
+    item.context = diag_name(late, context);
+    va_start(ap, fmt);
+    item.message = diag_vformat(late, fmt, ap);
+    va_end(ap);
+    diag_push(late, &item);
+}
+
+static void absorb_late(file_result *r, diag_buffer *late) {
+    size_t first_late = r->diags.count;
+    
+    for (size_t i = 0; i < late->count; i++) {
+        if (!diag_copy(&r->diags, late, &late->items[i], 0)) continue;
+        if (late->items[i].level == DIAG_WARNING) r->warnings++;
+        else r->errors++;
+    }
+    merge_late_diags(&r->diags, first_late);
+    diag_free(late);
+    if (r->max_errors <= 0 || r->errors < r->max_errors) return;
+    
+    // Stop at the error that reaches the limit, the way a file is stopped while parsed
+    int errors = 0, warnings = 0;
+    for (size_t i = 0; i < r->diags.count; i++) {
+        if (r->diags.items[i].level == DIAG_WARNING) {
+            warnings++;
+        } else if (++errors == r->max_errors) {
+            r->diags.count = i + 1;
+            break;
+        }
+    }
+    r->errors = errors;
+    r->warnings = warnings;
+    r->stopped = 1;
+}
+
+/*
+ * Facts stop where --max-errors stopped a file, so whatever it would have
+ * defined after that line is unknown: checks that a definition exists
+ * anywhere are skipped for the whole set rather than reporting it missing
+ */
+static int any_stopped(const file_result *results, int n) {
+    for (int r = 0; r < n; r++) {
+        if (results[r].stopped) return 1;
+    }
+    return 0;
+}
+
+/*
+ * --check-patterns: each context's exten / same lines are checked the way
+ * Asterisk would register them. A literal extension is identified by its
+ * interned text with '-' removed; a pattern is compiled into a per-context
+ * trie whose steps are character classes ('-' is ignored and '.' / '!' end
+ * it, as in Asterisk). Spellings that match the same strings, such as _NXX
+ * and _[2-9]XX, end at the same node, so they are one extension just as
+ * Asterisk's ext_cmp() sees them. Extensions are nodes either way, each
+ * with a bitset of its priorities, so a priority defined twice is found
+ * with one bit test per line, however many extensions the context has.
+ *
+ * Asterisk prefers the more specific of two overlapping patterns rather
+ * than the first one, so a pattern is only ever dead when literal
+ * extensions defined before it cover everything it matches. Only a bounded
+ * pattern matching no more than the context's literals can be; its matches
+ * are then enumerated until one isn't a literal.
+ */
+#define STEP_ONE_OR_MORE 256   // '.'
+#define STEP_ANY 257           // '!'
+#define STEP_CALLERID 258      // Separates an extension from its /callerid match
+#define STEP_CLASS 259         // STEP_CLASS + class ID; literal steps are bytes
+
+typedef struct {
+    uint64_t bits[4];
+} char_class;
+
+typedef struct {
+    uint64_t priorities;   // Bit p: priority p is defined (0 = hint), for p < 64
+    uint32_t last;         // Latest line defining it (fact index + 1)
+    uint8_t defined;       // An extension ends here
+} exten_node;
+
+/* One line's (extension, priority), chained per extension to find the earlier one of a duplicate */
+typedef struct {
+    uint32_t prev;         // Fact index + 1 of the extension's previous line
+    uint32_t priority;
+    uint32_t exten_fact;   // Index of the exten line that named the extension
+} definition;
+
+typedef struct {
+    diag_buffer names;     // Literal extensions, '-' removed (only the intern index is used)
+    id_map literals;       // context << 32 | name -> node + 1
+    id_map counts;         // context -> literal extensions defined + 1
+    id_map roots;          // context -> pattern trie root + 1
+    id_map edges;          // node << 32 | step -> child + 1
+    id_map spellings;      // context << 32 | text -> node + 1, to compile each spelling once
+    id_map classes;        // Class hash -> class ID + 1 (see class_id())
+    id_map priorities;     // node << 32 | priority -> 1, for priorities of 64 and up
+    exten_node *nodes;
+    size_t node_count;
+    size_t node_cap;
+    char_class *class_bits;
+    size_t class_count;
+    size_t class_cap;
+    uint32_t *steps;       // The pattern being compiled
+    size_t step_cap;
+    char *text;            // A literal being looked up
+    size_t text_cap;
+} pattern_index;
+
+/* Value for key, set to a new node if it had none; the node + 1, 0 on OOM */
+static uint32_t node_for(pattern_index *px, id_map *map, uint64_t key) {
+    id_slot *slot = id_map_slot(map, key);
+    if (!slot) return 0;
+    if (slot->value) return (uint32_t)slot->value;
+    
+    if (px->node_count == px->node_cap) {
+        size_t cap = px->node_cap ? px->node_cap * 2 : 1024;
+        exten_node *nodes = realloc(px->nodes, cap * sizeof(exten_node));
+        if (!nodes) return 0;
+        px->nodes = nodes;
+        px->node_cap = cap;
+    }
+    memset(&px->nodes[px->node_count], 0, sizeof(exten_node));
+    slot->value = ++px->node_count;
+    return (uint32_t)slot->value;
+}
+
+/* ID of a class, added if new; -1 on OOM */
+static long class_id(pattern_index *px, const char_class *c) {
+    // Keyed by hash; a colliding different class moves on to a rehashed key
+    for (uint64_t key = hash_bytes(c->bits, sizeof(c->bits), 0);; key = mix64(key + 1)) {
+        id_slot *slot = id_map_slot(&px->classes, key);
+        if (!slot) return -1;
+        if (slot->value) {
+            if (memcmp(&px->class_bits[slot->value - 1], c, sizeof(*c)) == 0) return (long)slot->value - 1;
+            continue;
+        }
+        if (px->class_count == px->class_cap) {
+            size_t cap = px->class_cap ? px->class_cap * 2 : 32;
+            char_class *bits = realloc(px->class_bits, cap * sizeof(char_class));
+            if (!bits) return -1;
+            px->class_bits = bits;
+            px->class_cap = cap;
+        }
+        px->class_bits[px->class_count] = *c;
+        slot->value = ++px->class_count;
+        return (long)px->class_count - 1;
+    }
+}
+
+static void class_range(char_class *c, unsigned char from, unsigned char to) {
+    for (unsigned b = from; b <= to; b++) c->bits[b >> 6] |= 1ULL << (b & 63);
+}
+
+/* First byte of c at or after from, or -1 */
+static int class_next(const char_class *c, int from) {
+    for (int w = from >> 6; w < 4; w++) {
+        uint64_t bits = c->bits[w] & (from > w * 64 ? ~0ULL << (from & 63) : ~0ULL);
+        if (bits) return w * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+/*
+ * Compile a pattern (with its /callerid, if any) into px->steps. Returns
+ * the step count, -1 if Asterisk couldn't use it as written, or -2 on OOM.
+ * *matches is how many extensions it matches; UINT64_MAX for an unbounded
+ * one or one limited by caller ID.
+ */
+static long compile_pattern(pattern_index *px, const char *text, uint64_t *matches) {
+    const char *slash = strchr(text, '/');
+    const char *p, *end = slash ? slash : text + strlen(text);
+    size_t need = strlen(text) + 2;
+    long n = 0;
+    
+    if (need > px->step_cap) {
+        uint32_t *steps = realloc(px->steps, need * sizeof(uint32_t));
+        if (!steps) return -2;
+        px->steps = steps;
+        px->step_cap = need;
+    }
+    
+    *matches = 1;
+    for (p = text + 1; p < end; p++) {
+        char_class c;
+        memset(&c, 0, sizeof(c));
+        
+        switch (toupper((unsigned char)*p)) {
+            case '-':
+                continue;
+            case '.':
+            case '!':
+                px->steps[n++] = *p == '.' ? STEP_ONE_OR_MORE : STEP_ANY;
+                *matches = UINT64_MAX;
+                p = end - 1;  // Anything after them is never looked at
+                continue;
+            case 'X':
+                class_range(&c, '0', '9');
+                break;
+            case 'Z':
+                class_range(&c, '1', '9');
+                break;
+            case 'N':
+                class_range(&c, '2', '9');
+                break;
+            case '[':
+                for (p++; p < end && *p != ']'; p++) {
+                    if (p + 2 < end && p[1] == '-' && p[2] != ']') {
+                        if ((unsigned char)p[0] <= (unsigned char)p[2]) {
+                            class_range(&c, (unsigned char)p[0], (unsigned char)p[2]);
+                        }
+                        p += 2;
+                    } else {
+                        class_range(&c, (unsigned char)*p, (unsigned char)*p);
+                    }
+                }
+                if (p == end) return -1;  // No closing ']'
+                break;
+            default:
+                class_range(&c, (unsigned char)*p, (unsigned char)*p);
+                break;
+        }
+        
+        uint64_t size = 0;
+        for (int w = 0; w < 4; w++) size += (uint64_t)__builtin_popcountll(c.bits[w]);
+        if (size == 0) return -1;  // [] matches nothing
+        
+        long id = class_id(px, &c);
+        if (id < 0) return -2;
+        px->steps[n++] = STEP_CLASS + (uint32_t)id;
+        *matches = *matches > UINT64_MAX / size ? UINT64_MAX : *matches * size;
+    }
+    if (n == 0) return -1;
+    
+    if (slash) {
+        px->steps[n++] = STEP_CALLERID;
+        for (p = slash + 1; *p; p++) px->steps[n++] = (unsigned char)*p;
+        *matches = UINT64_MAX;
+    }
+    return n;
+}
+
+static char *reserve_text(pattern_index *px, size_t need) {
+    if (need > px->text_cap) {
+        char *text = realloc(px->text, need);
+        if (!text) return NULL;
+        px->text = text;
+        px->text_cap = need;
+    }
+    return px->text;
+}
+
+/* Literal extension node + 1 for text, which has its '-' removed (not in a /callerid); 0 on OOM */
+static uint32_t literal_node(pattern_index *px, uint32_t context, const char *text, int *is_new) {
+    const char *slash = strchr(text, '/');
+    size_t len = 0;
+    char *buf = reserve_text(px, strlen(text) + 1);
+    
+    if (!buf) return 0;
+    for (const char *p = text; *p; p++) {
+        if (*p != '-' || (slash && p > slash)) buf[len++] = *p;
+    }
+    
+    uint32_t name = diag_intern(&px->names, buf, len);
+    if (name == NO_TEXT) return 0;
+    
+    size_t before = px->node_count;
+    uint32_t node = node_for(px, &px->literals, (uint64_t)context << 32 | name);
+    *is_new = px->node_count != before;
+    if (node && *is_new && !slash) {
+        id_slot *count = id_map_slot(&px->counts, context);
+        if (!count) return 0;
+        count->value = count->value ? count->value + 1 : 2;
+    }
+    return node;
+}
+
+/* Whether every match of the compiled pattern steps[0..n) is a literal extension in context */
+static int all_literals(pattern_index *px, uint32_t context, long n) {
+    char *buf = reserve_text(px, (size_t)n);
+    
+    if (!buf) return 0;
+    for (long i = 0; i < n; i++) buf[i] = (char)class_next(&px->class_bits[px->steps[i] - STEP_CLASS], 0);
+    
+    // Odometer over the classes, stopping at the first match that isn't a literal
+    for (;;) {
+        uint32_t name = diag_find(&px->names, buf, (size_t)n);
+        if (name == NO_TEXT || !id_map_get(&px->literals, (uint64_t)context << 32 | name)) return 0;
+        
+        long i = n - 1;
+        for (; i >= 0; i--) {
+            const char_class *c = &px->class_bits[px->steps[i] - STEP_CLASS];
+            int next = class_next(c, (unsigned char)buf[i] + 1);
+            if (next >= 0) {
+                buf[i] = (char)next;
+                break;
+            }
+            buf[i] = (char)class_next(c, 0);
+        }
+        if (i < 0) return 1;
+    }
+}
+
+/*
+ * Enter an exten line's extension; *node is set to its node + 1, or 0 if it
+ * can't be compiled. Returns 0 on OOM.
+ */
+static int define_exten(pattern_index *px, const diag_buffer *d, const fact *f,
+                        diag_buffer *late, uint32_t *node) {
+    const char *text = diag_text(d, f->text);
+    uint64_t spelling = (uint64_t)f->context << 32 | f->text;
+    uint64_t matches;
+    long n;
+    int is_new = 0;
+    
+    *node = (uint32_t)id_map_get(&px->spellings, spelling);
+    if (*node || !text || !text[0]) return 1;
+    
+    if (text[0] != '_') {
+        *node = literal_node(px, f->context, text, &is_new);
+    } else if ((n = compile_pattern(px, text, &matches)) < 0) {
+        return n == -1;
+    } else {
+        *node = node_for(px, &px->roots, f->context);
+        for (long i = 0; i < n && *node; i++) {
+            *node = node_for(px, &px->edges, (uint64_t)(*node - 1) << 32 | px->steps[i]);
+        }
+        
+        // A bounded pattern no bigger than the literals so far may be all literals
+        is_new = *node && !px->nodes[*node - 1].defined;
+        if (is_new && matches < id_map_get(&px->counts, f->context) && all_literals(px, f->context, n)) {
+            add_fact_diag(late, d, f, DIAG_WARNING, W_PATTERN_UNUSED,
+                          "Pattern '%s' is never used: extensions defined before it match everything it does",
+                          text);
+        }
+    }
+    
+    id_slot *slot = *node ? id_map_slot(&px->spellings, spelling) : NULL;
+    if (!slot) return 0;
+    slot->value = *node;
+    px->nodes[*node - 1].defined = 1;
+    return 1;
+}
+
+static void pattern_free(pattern_index *px) {
+    diag_free(&px->names);
+    free(px->literals.slots);
+    free(px->counts.slots);
+    free(px->roots.slots);
+    free(px->edges.slots);
+    free(px->spellings.slots);
+    free(px->classes.slots);
+    free(px->priorities.slots);
+    free(px->nodes);
+    free(px->class_bits);
+    free(px->steps);
+    free(px->text);
+}
+
+/* Check one file's exten / same lines, context by context */
+static void check_patterns(file_result *r) {
+    const diag_buffer *d = &r->diags;
+    pattern_index px;
+    diag_buffer late;
+    definition *defs = malloc((d->fact_count + 1) * sizeof(definition));
+    uint32_t exten = 0;          // Node + 1 of the current extension, 0 = none
+    size_t exten_fact = 0;       // Its exten line
+    long last = -1;
+    int ok = defs != NULL;
+    int errors = 0;              // Found so far; absorb_late() keeps no more than --max-errors
+    
+    memset(&px, 0, sizeof(px));
+    memset(&late, 0, sizeof(late));
+    for (size_t i = 0; i < d->fact_count && ok && (r->max_errors <= 0 || errors < r->max_errors); i++) {
+        const fact *f = &d->facts[i];
+        
+        if (f->kind == FACT_CONTEXT) {
+            exten = 0;  // A header ends the extension, even one reopening the context
+            last = -1;
+            continue;
+        }
+        if (f->kind != FACT_PRIORITY && f->kind != FACT_SAME) continue;
+        if (f->kind == FACT_PRIORITY) {
+            exten_fact = i;
+            if (!(ok = define_exten(&px, d, f, &late, &exten))) break;
+        }
+        
+        const char *text = diag_text(d, f->label);
+        long priority = number_priority(text ? make_view(text, strlen(text)) : NO_VIEW, &last);
+        if (!exten || priority < 0) continue;
+        
+        exten_node *node = &px.nodes[exten - 1];
+        int duplicate;
+        if (priority < 64) {
+            duplicate = (int)(node->priorities >> priority & 1);
+            node->priorities |= 1ULL << priority;
+        } else {
+            id_slot *slot = id_map_slot(&px.priorities, (uint64_t)(exten - 1) << 32 | (uint64_t)priority);
+            if (!slot) {
+                ok = 0;
+                break;
+            }
+            duplicate = slot->value != 0;
+            slot->value = 1;
+        }
+        defs[i].prev = node->last;
+        defs[i].priority = (uint32_t)priority;
+        defs[i].exten_fact = (uint32_t)exten_fact;
+        node->last = (uint32_t)i + 1;
+        if (!duplicate) continue;
+        errors++;
+        
+        // The previous line with this priority; name its spelling if it differs (_NXX vs _[2-9]XX)
+        uint32_t j = defs[i].prev;
+        while (defs[j - 1].priority != (uint32_t)priority) j = defs[j - 1].prev;
+        int first_line = d->facts[j - 1].line;
+        const fact *first = &d->facts[defs[j - 1].exten_fact];
+        const char *name = diag_text(d, d->facts[exten_fact].text);
+        int same = first->text == d->facts[exten_fact].text;
+        const char *as = same ? "" : " as '", *spelled = same ? "" : diag_text(d, first->text);
+        if (priority == 0) {
+            add_fact_diag(&late, d, f, DIAG_ERROR, E_EXTEN_DUPLICATE,
+                          "Extension '%s' already has a hint (line %d%s%s%s)",
+                          name, first_line, as, spelled, same ? "" : "'");
+        } else {
+            add_fact_diag(&late, d, f, DIAG_ERROR, E_EXTEN_DUPLICATE,
+                          "Extension '%s' priority %ld is already defined (line %d%s%s%s)",
+                          name, priority, first_line, as, spelled, same ? "" : "'");
+        }
+    }
+    pattern_free(&px);
+    free(defs);
+    
+    if (!ok) {
+        fprintf(stderr, "Warning: Out of memory; extension patterns not checked in '%s'\n", r->filename);
+        diag_free(&late);
+        return;
+    }
+    absorb_late(r, &late);
+}
+
+typedef struct {
+    file_result *results;
+    validator_options opts;   // Per-file options (files run one per worker)
+    int *order;               // Job -> result index, largest file first (NULL = in order)
+} file_batch;
+
+/*
+ * One file of a batch. spare, if not NULL, is an emptied arena to reuse;
+ * it is taken over and zeroed. Only the serial loop in validate_files()
+ * has one: pool jobs must not share anything but their own result.
+ */
+static void run_file(file_batch *batch, int index, diag_buffer *spare) {
+    file_result *result = &batch->results[batch->order ? batch->order[index] : index];
+    validator_state state = {0};
+    
+    state.opts = &batch->opts;
+    if (spare) {
+        state.diags = *spare;
+        memset(spare, 0, sizeof(*spare));
+    }
+    state.stats = batch->opts.stats ? &result->stats : NULL;
+    state.profile = batch->opts.profile_contexts ? &result->profile : NULL;
+    validate_dialplan(result->filename, &state);
+    take_result(result, &state);
+    if (batch->opts.check_patterns) check_patterns(result);
+}
+
+static void run_file_job(void *ctx, int worker, int index) {
+    (void)worker;
+    run_file(ctx, index, NULL);
+}
+
+/*
+ * Pool order for a batch: biggest files first, so they start at once and
+ * the small ones fill in around them instead of one large file starting
+ * last and running on alone. The caller frees the array; NULL (out of
+ * memory) just means argument order.
+ */
+typedef struct {
+    off_t size;
+    int index;
+} sized_file;
+
+static int compare_sized(const void *a, const void *b) {
+    const sized_file *x = a, *y = b;
+    if (x->size != y->size) return x->size > y->size ? -1 : 1;
+    return x->index - y->index;
+}
+
+static int *largest_first(const file_result *results, int n) {
+    sized_file *sizes = malloc((size_t)n * sizeof(sized_file));
+    int *order = malloc((size_t)n * sizeof(int));
+    
+    if (!sizes || !order) {
+        free(sizes);
+        free(order);
+        return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+        struct stat st;
+        sizes[i].size = stat(results[i].filename, &st) == 0 ? st.st_size : 0;
+        sizes[i].index = i;
+    }
+    qsort(sizes, (size_t)n, sizeof(sized_file), compare_sized);
+    for (int i = 0; i < n; i++) order[i] = sizes[i].index;
+    free(sizes);
+    return order;
+}
+
+/*
+ * --xref: every file's definitions go into one symbol table. Names are
+ * interned once more, across all files, so a symbol is a triple of 32-bit
+ * name IDs: (context), (context, extension) or (context, extension, label),
+ * and each reference costs a hash lookup with integer compares. Contexts
+ * also list the contexts they include and their pattern extensions: an
+ * extension is looked for in the context, then matched against its
+ * patterns, then searched for through its includes, the order Asterisk
+ * uses at run time.
+ */
+typedef struct {
+    uint64_t hash;
+    uint32_t context;
+    uint32_t exten;        // NO_TEXT for a context
+    uint32_t label;        // NO_TEXT unless a label
+    uint32_t links;        // Contexts: head of their include/pattern list (index + 1)
+    uint32_t seen;         // Generation of the last search that reached this context
+} symbol;
+
+typedef struct {
+    uint32_t name;
+    uint32_t next;         // Index + 1, 0 = end
+    uint8_t is_include;    // Included context, else a pattern extension
+} symbol_link;
+
+typedef struct {
+    diag_buffer names;     // Only its interned arena is used
+    symbol *items;
+    size_t count;
+    size_t cap;
+    uint32_t *slots;       // Index + 1, 0 = empty
+    size_t nslots;         // Power of two
+    symbol_link *links;
+    size_t nlinks;
+    size_t links_cap;
+    uint32_t generation;
+} symbol_table;
+
+static uint64_t symbol_hash(uint32_t context, uint32_t exten, uint32_t label) {
+    return mix64(((uint64_t)context << 32 | exten) ^ mix64(label));
+}
+
+static const char *symbol_name(const symbol_table *t, uint32_t id) {
+    return t->names.text + id;
+}
+
+/* ID of a name if any file defines or references it, else NO_TEXT */
+static uint32_t symbol_lookup_name(const symbol_table *t, const char *s) {
+    return diag_find(&t->names, s, strlen(s));
+}
+
+static symbol *symbol_find(const symbol_table *t, uint32_t context, uint32_t exten, uint32_t label) {
+    if (!t->nslots || context == NO_TEXT) return NULL;
+    
+    uint64_t h = symbol_hash(context, exten, label);
+    for (size_t i = (size_t)h & (t->nslots - 1);; i = (i + 1) & (t->nslots - 1)) {
+        uint32_t slot = t->slots[i];
+        if (slot == 0) return NULL;
+        
+        symbol *s = &t->items[slot - 1];
+        if (s->context == context && s->exten == exten && s->label == label) return s;
+    }
+}
+
+/* Find or add a symbol; NULL on OOM */
+static symbol *symbol_add(symbol_table *t, uint32_t context, uint32_t exten, uint32_t label) {
+    symbol *found = symbol_find(t, context, exten, label);
+    if (found || context == NO_TEXT) return found;
+    
+    if ((t->count + 1) * 2 > t->nslots) {
+        size_t nslots = t->nslots ? t->nslots * 2 : 1024;
+        uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+        if (!slots) return NULL;
+        for (size_t e = 0; e < t->count; e++) {
+            size_t i = (size_t)t->items[e].hash & (nslots - 1);
+            while (slots[i]) i = (i + 1) & (nslots - 1);
+            slots[i] = (uint32_t)e + 1;
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->nslots = nslots;
+    }
+    if (t->count == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 512;
+        symbol *items = realloc(t->items, cap * sizeof(symbol));
+        if (!items) return NULL;
+        t->items = items;
+        t->cap = cap;
+    }
+    
+    symbol *s = &t->items[t->count];
+    s->hash = symbol_hash(context, exten, label);
+    s->context = context;
+    s->exten = exten;
+    s->label = label;
+    s->links = 0;
+    s->seen = 0;
+    
+    size_t i = (size_t)s->hash & (t->nslots - 1);
+    while (t->slots[i]) i = (i + 1) & (t->nslots - 1);
+    t->slots[i] = (uint32_t)++t->count;
+    return s;
+}
+
+static int symbol_link_to(symbol_table *t, symbol *context, uint32_t name, int is_include) {
+    if (t->nlinks == t->links_cap) {
+        size_t cap = t->links_cap ? t->links_cap * 2 : 256;
+        symbol_link *links = realloc(t->links, cap * sizeof(symbol_link));
+        if (!links) return 0;
+        t->links = links;
+        t->links_cap = cap;
+    }
+    t->links[t->nlinks].name = name;
+    t->links[t->nlinks].next = context->links;
+    t->links[t->nlinks].is_include = (uint8_t)is_include;
+    context->links = (uint32_t)++t->nlinks;
+    return 1;
+}
+
+static void symbol_free(symbol_table *t) {
+    diag_free(&t->names);
+    free(t->items);
+    free(t->slots);
+    free(t->links);
+    memset(t, 0, sizeof(*t));
+}
+
+/* Asterisk pattern match: _ then X, Z, N, [class], '.' (one or more), '!' (zero or more) */
+static int exten_matches(const char *pattern, const char *exten) {
+    const char *p = pattern + 1, *e = exten;
+    
+    while (*p) {
+        unsigned char c = (unsigned char)*p, x = (unsigned char)*e;
+        
+        if (c == '-') {
+            p++;  // Readability separator, as in _1-800-NXXXXXX
+            continue;
+        }
+        if (c == '.') return x != '\0';
+        if (c == '!') return 1;
+        if (x == '\0') return 0;
+        
+        switch (toupper(c)) {
+            case 'X':
+                if (x < '0' || x > '9') return 0;
+                break;
+            case 'Z':
+                if (x < '1' || x > '9') return 0;
+                break;
+            case 'N':
+                if (x < '2' || x > '9') return 0;
+                break;
+            case '[': {
+                int hit = 0;
+                p++;
+                while (*p && *p != ']') {
+                    if (p[1] == '-' && p[2] && p[2] != ']') {
+                        hit |= (x >= (unsigned char)p[0] && x <= (unsigned char)p[2]);
+                        p += 3;
+                    } else {
+                        hit |= (x == (unsigned char)*p++);
+                    }
+                }
+                if (!hit || !*p) return 0;
+                break;
+            }
+            default:
+                if (c != x) return 0;
+                break;
+        }
+        p++;
+        e++;
+    }
+    return *e == '\0';
+}
+
+/*
+ * The extension symbol that a call to exten in context would reach,
+ * following includes breadth-first; NULL if there is none. exten_id is
+ * NO_TEXT when no file mentions the name, so only patterns can match it.
+ */
+static symbol *find_exten(symbol_table *t, symbol *context, const char *exten, uint32_t exten_id) {
+    symbol **queue;
+    size_t head = 0, tail = 0, cap = 64;
+    symbol *found = NULL;
+    
+    if (!(queue = malloc(cap * sizeof(symbol *)))) return NULL;
+    t->generation++;
+    context->seen = t->generation;
+    queue[tail++] = context;
+    
+    while (head < tail && !found) {
+        symbol *ctx = queue[head++];
+        
+        if (exten_id != NO_TEXT) found = symbol_find(t, ctx->context, exten_id, NO_TEXT);
+        for (uint32_t l = ctx->links; l && !found; l = t->links[l - 1].next) {
+            const symbol_link *link = &t->links[l - 1];
+            if (!link->is_include && exten_matches(symbol_name(t, link->name), exten)) {
+                found = symbol_find(t, ctx->context, link->name, NO_TEXT);
+            }
+        }
+        for (uint32_t l = ctx->links; l && !found; l = t->links[l - 1].next) {
+            symbol *inc;
+            if (!t->links[l - 1].is_include) continue;
+            inc = symbol_find(t, t->links[l - 1].name, NO_TEXT, NO_TEXT);
+            if (!inc || inc->seen == t->generation) continue;
+            if (tail == cap) {
+                symbol **grown = realloc(queue, cap * 2 * sizeof(symbol *));
+                if (!grown) break;
+                queue = grown;
+                cap *= 2;
+            }
+            inc->seen = t->generation;
+            queue[tail++] = inc;
+        }
+    }
+    
+    free(queue);
+    return found;
+}
+
+static int is_number(const char *s) {
+    if (*s == '+' || *s == '-') s++;
+    if (!*s) return 0;
+    while (isdigit((unsigned char)*s)) s++;
+    return *s == '\0';
+}
+
+/* Check one Goto/Gosub destination of the file whose diagnostics are d */
+static void check_destination(symbol_table *t, const diag_buffer *d, const fact *f, diag_buffer *late) {
+    const char *app = f->kind == FACT_GOSUB ? "Gosub" : "Goto";
+    const char *context = diag_text(d, f->text);
+    const char *exten = diag_text(d, f->exten);
+    const char *priority = diag_text(d, f->label);
+    
+    if (!context || !exten || !priority) return;
+    
+    symbol *ctx = symbol_find(t, symbol_lookup_name(t, context), NO_TEXT, NO_TEXT);
+    if (!ctx) {
+        add_fact_diag(late, d, f, DIAG_ERROR, E_XREF_CONTEXT, "%s target context '%s' doesn't exist",
+                      app, context);
+        return;
+    }
+    
+    symbol *ext = find_exten(t, ctx, exten, symbol_lookup_name(t, exten));
+    if (!ext) {
+        add_fact_diag(late, d, f, DIAG_ERROR, E_XREF_EXTEN,
+                      "%s target extension '%s' doesn't exist in context '%s'", app, exten, context);
+        return;
+    }
+    
+    // Numbered priorities aren't indexed; a label must be on the extension reached
+    if (is_number(priority)) return;
+    uint32_t label = symbol_lookup_name(t, priority);
+    if (label == NO_TEXT || !symbol_find(t, ext->context, ext->exten, label)) {
+        add_fact_diag(late, d, f, DIAG_ERROR, E_XREF_LABEL, "%s target label '%s' doesn't exist in %s,%s",
+                      app, priority, context, exten);
+    }
+}
+
+/* Global ID of one of d's names */
+static uint32_t symbol_intern(symbol_table *t, const diag_buffer *d, uint32_t off) {
+    const char *s = diag_text(d, off);
+    return s ? diag_name(&t->names, s) : NO_TEXT;
+}
+
+/* Resolve every include => and Goto/Gosub fact against all files' definitions */
+static void xref_check(file_result *results, int n) {
+    if (any_stopped(results, n)) return;
+    
+    symbol_table t;
+    diag_buffer *late = calloc((size_t)n + 1, sizeof(diag_buffer));
+    int ok = late != NULL;
+    
+    memset(&t, 0, sizeof(t));
+    for (int r = 0; r < n && ok; r++) {
+        const diag_buffer *d = &results[r].diags;
+        
+        for (size_t i = 0; i < d->fact_count && ok; i++) {
+            const fact *f = &d->facts[i];
+            uint32_t context, text;
+            symbol *ctx;
+            
+            if (f->kind < FACT_CONTEXT || f->kind > FACT_INCLUDE_CONTEXT) continue;
+            context = symbol_intern(&t, d, f->context);
+            text = symbol_intern(&t, d, f->text);
+            if (context == NO_TEXT || text == NO_TEXT) continue;
+            
+            switch (f->kind) {
+                case FACT_CONTEXT:
+                    ok = symbol_add(&t, text, NO_TEXT, NO_TEXT) != NULL;
+                    break;
+                case FACT_EXTEN:
+                    // The context last: adding a symbol can move the others
+                    ok = symbol_add(&t, context, text, NO_TEXT) != NULL &&
+                         (ctx = symbol_add(&t, context, NO_TEXT, NO_TEXT)) != NULL &&
+                         (symbol_name(&t, text)[0] != '_' || symbol_link_to(&t, ctx, text, 0));
+                    break;
+                case FACT_LABEL: {
+                    uint32_t exten = symbol_intern(&t, d, f->exten);
+                    ok = exten == NO_TEXT || symbol_add(&t, context, exten, text) != NULL;
+                    break;
+                }
+                case FACT_INCLUDE_CONTEXT:
+                    ok = (ctx = symbol_add(&t, context, NO_TEXT, NO_TEXT)) != NULL &&
+                         symbol_link_to(&t, ctx, text, 1);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Warning: Out of memory; cross-references not checked\n");
+        symbol_free(&t);
+        free(late);
+        return;
+    }
+    
+    for (int r = 0; r < n; r++) {
+        const diag_buffer *d = &results[r].diags;
+        
+        for (size_t i = 0; i < d->fact_count; i++) {
+            const fact *f = &d->facts[i];
+            const char *text = diag_text(d, f->text);
+            
+            if (f->kind == FACT_INCLUDE_CONTEXT && text &&
+                !symbol_find(&t, symbol_lookup_name(&t, text), NO_TEXT, NO_TEXT)) {
+                add_fact_diag(&late[r], d, f, DIAG_ERROR, E_XREF_INCLUDE,
+                              "Included context '%s' doesn't exist", text);
+            } else if (f->kind == FACT_GOTO || f->kind == FACT_GOSUB) {
+                check_destination(&t, d, f, &late[r]);
+            }
+        }
+    }
+    symbol_free(&t);
+    
+    for (int r = 0; r < n; r++) absorb_late(&results[r], &late[r]);
+    free(late);
+}
+
+/*
+ * --check-globals: a ${VAR} that no file sets, in [globals] or with Set(),
+ * MSet(), Read() or ReadExten(), is reported once per file where it is
+ * first read. Every definition goes into one intern table first, whose
+ * slots keep their hashes, so each reference costs one hash and a probe.
+ */
+static void globals_check(file_result *results, int n) {
+    diag_buffer defined = {0}, reported = {0};
+    int ok = 1;
+    
+    if (any_stopped(results, n)) return;
+    
+    for (int r = 0; r < n && ok; r++) {
+        const diag_buffer *d = &results[r].diags;
+        for (size_t i = 0; i < d->fact_count && ok; i++) {
+            const char *name = diag_text(d, d->facts[i].text);
+            // A name read as "" began with a NUL byte in the input
+            if (d->facts[i].kind == FACT_VAR_SET && name && *name) ok = diag_name(&defined, name) != NO_TEXT;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Warning: Out of memory; variable references not checked\n");
+        diag_free(&defined);
+        return;
+    }
+    
+    for (int r = 0; r < n; r++) {
+        const diag_buffer *d = &results[r].diags;
+        diag_buffer late = {0};
+        
+        diag_clear(&reported);
+        for (size_t i = 0; i < d->fact_count; i++) {
+            const fact *f = &d->facts[i];
+            const char *name = diag_text(d, f->text);
+            if (f->kind != FACT_VAR_REF || !name) continue;
+            
+            size_t len = strlen(name);
+            if (diag_find(&defined, name, len) != NO_TEXT || diag_find(&reported, name, len) != NO_TEXT) continue;
+            diag_intern(&reported, name, len);
+            add_fact_diag(&late, d, f, DIAG_WARNING, W_VAR_UNDEFINED,
+                          "Variable '%s' is never set ([globals], Set(), MSet(), Read())", name);
+        }
+        absorb_late(&results[r], &late);
+    }
+    diag_free(&defined);
+    diag_free(&reported);
+}
+
+/*
+ * Snapshots (--emit-snapshot / --read-snapshot)
+ *
+ * A snapshot is every file's results laid out flat: a header, one
+ * snapshot_file record per input, then each file's name, diagnostics,
+ * facts and string arena, all 8-byte aligned. Records refer to their data
+ * by offset from the start of the snapshot and strings inside it are arena
+ * offsets already, so a reader mmaps the file and uses it in place. The
+ * facts are the --xref index (contexts, extensions, labels, includes and
+ * jumps) whether or not --xref itself was on, and every line's step for
+ * --diff. Integers are in host order, as in the cache; a snapshot is for
+ * the machine that wrote it.
+ */
+#define SNAPSHOT_MAGIC 0x53565044u   // "DPVS"
+#define SNAPSHOT_FORMAT 2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t format;
+    uint64_t fingerprint;  // options_fingerprint() of the run that wrote it
+    uint32_t files;
+    int32_t max_errors;
+    uint32_t layout;       // sizeof(diagnostic) << 16 | sizeof(fact)
+    uint32_t reserved;
+} snapshot_header;
+
+typedef struct {
+    uint64_t name;         // Offsets from the start of the snapshot
+    uint64_t items;
+    uint64_t facts;
+    uint64_t text;
+    uint32_t count;
+    uint32_t fact_count;
+    uint32_t text_len;
+    int32_t errors;
+    int32_t warnings;
+    int32_t stopped;
+    int32_t lines;
+    int32_t included_by;   // Index + 1 of the including file's record (0 = none)
+    int32_t included_line;
+    uint32_t reserved;
+} snapshot_file;
+
+#define SNAPSHOT_LAYOUT ((uint32_t)(sizeof(diagnostic) << 16 | sizeof(fact)))
+
+static uint64_t snapshot_align(uint64_t off) {
+    return (off + 7) & ~(uint64_t)7;
+}
+
+/* Write len bytes and pad them out to the next 8-byte boundary */
+static int snapshot_put(FILE *fp, const void *data, size_t len) {
+    static const char zeros[8] = {0};
+    size_t pad = (size_t)(snapshot_align(len) - len);
+    return (len == 0 || fwrite(data, len, 1, fp) == 1) && (pad == 0 || fwrite(zeros, pad, 1, fp) == 1);
+}
+
+/* Write results to path atomically, like cache_save() */
+static int snapshot_save(const file_result *results, int n, const validator_options *opts) {
+    const char *path = opts->snapshot;
+    snapshot_header header = { SNAPSHOT_MAGIC, SNAPSHOT_FORMAT, options_fingerprint(opts),
+                               (uint32_t)n, opts->max_errors, SNAPSHOT_LAYOUT, 0 };
+    snapshot_file *records = calloc((size_t)n + 1, sizeof(snapshot_file));
+    size_t len = strlen(path) + 16;
+    char *tmp = malloc(len);
+    
+    if (!records || !tmp) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(records);
+        free(tmp);
+        return 0;
+    }
+    
+    // Lay every file's data out after the header and the records
+    uint64_t off = sizeof(header) + (uint64_t)n * sizeof(snapshot_file);
+    for (int i = 0; i < n; i++) {
+        const file_result *r = &results[i];
+        snapshot_file *f = &records[i];
+        f->name = off;
+        off += snapshot_align(strlen(r->filename) + 1);
+        f->items = off;
+        off += snapshot_align(r->diags.count * sizeof(diagnostic));
+        f->facts = off;
+        off += snapshot_align(r->diags.fact_count * sizeof(fact));
+        f->text = off;
+        off += snapshot_align(r->diags.text_len);
+        f->count = (uint32_t)r->diags.count;
+        f->fact_count = (uint32_t)r->diags.fact_count;
+        f->text_len = (uint32_t)r->diags.text_len;
+        f->errors = r->errors;
+        f->warnings = r->warnings;
+        f->stopped = r->stopped;
+        f->lines = r->lines;
+        f->included_by = r->included_by;
+        f->included_line = r->included_line;
+    }
+    
+    snprintf(tmp, len, "%s.%ld", path, (long)getpid());
+    FILE *fp = fopen(tmp, "wb");
+    int ok = fp && snapshot_put(fp, &header, sizeof(header)) &&
+         snapshot_put(fp, records, (size_t)n * sizeof(snapshot_file));
+    for (int i = 0; i < n && ok; i++) {
+        const file_result *r = &results[i];
+        ok = snapshot_put(fp, r->filename, strlen(r->filename) + 1) &&
+             snapshot_put(fp, r->diags.items, r->diags.count * sizeof(diagnostic)) &&
+             snapshot_put(fp, r->diags.facts, r->diags.fact_count * sizeof(fact)) &&
+             snapshot_put(fp, r->diags.text, r->diags.text_len);
+    }
+    
+    if (fp && fclose(fp) != 0) ok = 0;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok) {
+        fprintf(stderr, "Error: Cannot write snapshot '%s': %s\n", path, strerror(errno));
+        unlink(tmp);
+    }
+    free(records);
+    free(tmp);
+    return ok;
+}
+
+/* A [off, off + len) range inside a snapshot of size bytes, 8-byte aligned */
+static int snapshot_range(uint64_t off, uint64_t count, size_t item, size_t size) {
+    return off % 8 == 0 && off <= size && count <= (size - off) / item;
+}
+
+/*
+ * Point results at the files in a mapped snapshot, checking every offset
+ * first; returns the number of files, or -1 if the snapshot is damaged or
+ * from another version. An include chain may only point back at earlier
+ * records (graph_add() writes them in that order), so it can't loop.
+ */
+static int snapshot_files(const char *map, size_t size, file_result **out, int *max_errors) {
+    snapshot_header header;
+    
+    *out = NULL;
+    if (size < sizeof(header)) return -1;
+    memcpy(&header, map, sizeof(header));
+    if (header.magic != SNAPSHOT_MAGIC || header.format != SNAPSHOT_FORMAT ||
+        header.layout != SNAPSHOT_LAYOUT || header.files > INT_MAX ||
+        !snapshot_range(sizeof(header), header.files, sizeof(snapshot_file), size)) {
+        return -1;
+    }
+    
+    int n = (int)header.files;
+    file_result *results = calloc((size_t)n + 1, sizeof(file_result));
+    if (!results) return -1;
+    
+    const snapshot_file *records = (const snapshot_file *)(map + sizeof(header));
+    for (int i = 0; i < n; i++) {
+        const snapshot_file *f = &records[i];
+        file_result *r = &results[i];
+        diag_buffer *d = &r->diags;
+        
+        if (!snapshot_range(f->name, 1, 1, size) || !memchr(map + f->name, '\0', size - f->name) ||
+            !snapshot_range(f->items, f->count, sizeof(diagnostic), size) ||
+            !snapshot_range(f->facts, f->fact_count, sizeof(fact), size) ||
+            !snapshot_range(f->text, f->text_len, 1, size) ||
+            f->included_by < 0 || f->included_by > i) {
+            free(results);
+            return -1;
+        }
+        
+        // The buffers stay in the mapping: read, never grown or freed
+        r->filename = map + f->name;
+        d->items = (diagnostic *)(map + f->items);
+        d->facts = (fact *)(map + f->facts);
+        d->text = (char *)(map + f->text);
+        d->count = d->cap = f->count;
+        d->fact_count = d->fact_cap = f->fact_count;
+        d->text_len = d->text_cap = f->text_len;
+        r->errors = f->errors;
+        r->warnings = f->warnings;
+        r->stopped = f->stopped;
+        r->lines = f->lines;
+        r->included_by = f->included_by;
+        r->included_line = f->included_line;
+        if (!entry_ok(d)) {
+            free(results);
+            return -1;
+        }
+    }
+    *out = results;
+    *max_errors = header.max_errors;
+    return n;
+}
+
+/* A mapped snapshot and the results pointing into it */
+typedef struct {
+    void *map;
+    size_t size;
+    file_result *results;
+    int count;
+    int max_errors;
+} snapshot;
+
+static void snapshot_close(snapshot *snap) {
+    free(snap->results);
+    if (snap->map) munmap(snap->map, snap->size);
+    memset(snap, 0, sizeof(*snap));
+}
+
+static int snapshot_open(snapshot *snap, const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    
+    memset(snap, 0, sizeof(*snap));
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: Cannot open snapshot '%s': %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    
+    snap->size = (size_t)st.st_size;
+    void *map = snap->size ? mmap(NULL, snap->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    snap->map = map == MAP_FAILED ? NULL : map;
+    snap->count = snap->map ? snapshot_files(snap->map, snap->size, &snap->results, &snap->max_errors) : -1;
+    if (snap->count < 0) {
+        fprintf(stderr, "Error: '%s' is not a snapshot written by this version\n", path);
+        snapshot_close(snap);
+        return 0;
+    }
+    return 1;
+}
+
+/* Whether path starts like a snapshot (it may still be damaged) */
+static int is_snapshot(const char *path) {
+    uint32_t magic = 0;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    int ok = fread(&magic, sizeof(magic), 1, fp) == 1 && magic == SNAPSHOT_MAGIC;
+    fclose(fp);
+    return ok;
+}
+
+/* --read-snapshot: emit a snapshot's results as if its files had just been validated */
+static int read_snapshot(const char *path, const validator_options *opts) {
+    snapshot snap;
+    validator_options shown = *opts;
+    validator_stats output = {0};
+    int status = 0;
+    
+    if (!snapshot_open(&snap, path)) return 1;
+    shown.max_errors = snap.max_errors;
+    emit_counted(snap.results, snap.count, &shown, &output);
+    for (int i = 0; i < snap.count; i++) {
+        if (result_status(&snap.results[i]) != 0) status = 1;
+    }
+    snapshot_close(&snap);
+    return status;
+}
+
+/*
+ * --diff OLD NEW: which contexts, extensions and includes differ between two
+ * dialplans. Each side is validated as usual (both at once on the pool), or
+ * mapped if it is a snapshot, and rebuilt from its facts: contexts merged
+ * across files by name as Asterisk does, each extension a list of numbered
+ * priorities with the step hash note_priority() gave the line (the first
+ * definition of a priority wins, as in Asterisk). Names are interned in one
+ * table shared by both sides, so an entry of one side finds its counterpart
+ * with a single id_map probe: the join is linear in the size of both.
+ */
+typedef struct {
+    uint32_t name;         // In the shared names table, as are all names below
+    const char *file;      // Where it is first defined
+    int line;
+    uint32_t extens;       // First extension, diff_exten index + 1
+    uint32_t last_exten;
+    uint32_t includes;     // First include, diff_include index + 1
+    uint32_t last_include;
+} diff_context;
+
+typedef struct {
+    uint32_t name;
+    uint32_t next;         // Next in its context, index + 1
+    uint32_t steps;        // First step, diff_step index + 1
+    uint32_t last_step;
+    const char *file;
+    int line;
+} diff_exten;
+
+typedef struct {
+    uint32_t name;
+    uint32_t next;
+    const char *file;
+    int line;
+} diff_include;
+
+typedef struct {
+    uint32_t priority;     // 0 = hint
+    uint32_t step;
+    uint32_t next;
+} diff_step;
+
+typedef struct {
+    diff_context *contexts;
+    size_t context_count, context_cap;
+    diff_exten *extens;
+    size_t exten_count, exten_cap;
+    diff_include *includes;
+    size_t include_count, include_cap;
+    diff_step *steps;
+    size_t step_count, step_cap;
+    id_map context_ids;    // name -> context + 1
+    id_map exten_ids;      // context << 32 | name -> extension + 1
+    id_map include_ids;    // context << 32 | name -> include + 1
+    id_map step_ids;       // extension << 32 | priority -> step + 1
+} diff_side;
+
+/* Room for one more item in a growing array; 0 on OOM */
+static int diff_reserve(void **array, size_t *cap, size_t count, size_t size) {
+    if (count < *cap) return 1;
+    size_t n = *cap ? *cap * 2 : 256;
+    void *bigger = realloc(*array, n * size);
+    if (!bigger) return 0;
+    *array = bigger;
+    *cap = n;
+    return 1;
+}
+
+static void diff_side_free(diff_side *side) {
+    free(side->contexts);
+    free(side->extens);
+    free(side->includes);
+    free(side->steps);
+    free(side->context_ids.slots);
+    free(side->exten_ids.slots);
+    free(side->include_ids.slots);
+    free(side->step_ids.slots);
+    memset(side, 0, sizeof(*side));
+}
+
+/* Context + 1 for name, added if new; 0 on OOM */
+static uint32_t diff_context_for(diff_side *side, uint32_t name, const char *file, int line) {
+    id_slot *slot = id_map_slot(&side->context_ids, name);
+    if (!slot) return 0;
+    if (slot->value) return (uint32_t)slot->value;
+    if (!diff_reserve((void **)&side->contexts, &side->context_cap, side->context_count, sizeof(diff_context))) {
+        return 0;
+    }
+    diff_context *c = &side->contexts[side->context_count];
+    memset(c, 0, sizeof(*c));
+    c->name = name;
+    c->file = file;
+    c->line = line;
+    slot->value = ++side->context_count;
+    return (uint32_t)slot->value;
+}
+
+static uint32_t diff_exten_for(diff_side *side, uint32_t context, uint32_t name, const char *file, int line) {
+    id_slot *slot = id_map_slot(&side->exten_ids, (uint64_t)context << 32 | name);
+    if (!slot) return 0;
+    if (slot->value) return (uint32_t)slot->value;
+    if (!diff_reserve((void **)&side->extens, &side->exten_cap, side->exten_count, sizeof(diff_exten))) return 0;
+    
+    diff_exten *e = &side->extens[side->exten_count];
+    diff_context *c = &side->contexts[context - 1];
+    memset(e, 0, sizeof(*e));
+    e->name = name;
+    e->file = file;
+    e->line = line;
+    slot->value = ++side->exten_count;
+    if (c->last_exten) side->extens[c->last_exten - 1].next = (uint32_t)slot->value;
+    else c->extens = (uint32_t)slot->value;
+    c->last_exten = (uint32_t)slot->value;
+    return (uint32_t)slot->value;
+}
+
+static int diff_add_include(diff_side *side, uint32_t context, uint32_t name, const char *file, int line) {
+    id_slot *slot = id_map_slot(&side->include_ids, (uint64_t)context << 32 | name);
+    if (!slot) return 0;
+    if (slot->value) return 1;
+    if (!diff_reserve((void **)&side->includes, &side->include_cap, side->include_count, sizeof(diff_include))) {
+        return 0;
+    }
+    
+    diff_include *inc = &side->includes[side->include_count];
+    diff_context *c = &side->contexts[context - 1];
+    inc->name = name;
+    inc->next = 0;
+    inc->file = file;
+    inc->line = line;
+    slot->value = ++side->include_count;
+    if (c->last_include) side->includes[c->last_include - 1].next = (uint32_t)slot->value;
+    else c->includes = (uint32_t)slot->value;
+    c->last_include = (uint32_t)slot->value;
+    return 1;
+}
+
+static int diff_add_step(diff_side *side, uint32_t exten, long priority, uint32_t step) {
+    id_slot *slot = id_map_slot(&side->step_ids, (uint64_t)exten << 32 | (uint64_t)priority);
+    if (!slot) return 0;
+    if (slot->value) return 1;  // Priority already in use: Asterisk keeps the first
+    if (!diff_reserve((void **)&side->steps, &side->step_cap, side->step_count, sizeof(diff_step))) return 0;
+    
+    diff_step *s = &side->steps[side->step_count];
+    diff_exten *e = &side->extens[exten - 1];
+    s->priority = (uint32_t)priority;
+    s->step = step;
+    s->next = 0;
+    slot->value = ++side->step_count;
+    if (e->last_step) side->steps[e->last_step - 1].next = (uint32_t)slot->value;
+    else e->steps = (uint32_t)slot->value;
+    e->last_step = (uint32_t)slot->value;
+    return 1;
+}
+
+/* Rebuild one side from its files' facts; 0 on OOM */
+static int diff_build(diff_side *side, diag_buffer *names, const file_result *results, int n) {
+    for (int r = 0; r < n; r++) {
+        const diag_buffer *d = &results[r].diags;
+        const char *file = results[r].filename;
+        uint32_t context_ref = NO_TEXT, context = 0;   // Current context: the file's name and ours
+        uint32_t exten_name = NO_TEXT, exten = 0;      // Current extension (created by its first step)
+        int exten_line = 0;
+        long last = -1;
+        
+        for (size_t i = 0; i < d->fact_count; i++) {
+            const fact *f = &d->facts[i];
+            if (f->kind != FACT_CONTEXT && f->kind != FACT_INCLUDE_CONTEXT &&
+                f->kind != FACT_PRIORITY && f->kind != FACT_SAME) {
+                continue;
+            }
+            if (f->context == NO_TEXT) continue;
+            
+            if (f->context != context_ref || f->kind == FACT_CONTEXT) {
+                const char *name = diag_text(d, f->context);
+                uint32_t id = diag_name(names, name);
+                if (id == NO_TEXT || !(context = diff_context_for(side, id, file, f->line))) return 0;
+                context_ref = f->context;
+            }
+            if (f->kind == FACT_CONTEXT) {
+                exten_name = NO_TEXT;  // A header ends the extension, even one reopening the context
+                last = -1;
+                continue;
+            }
+            if (f->kind == FACT_INCLUDE_CONTEXT) {
+                uint32_t id = diag_name(names, diag_text(d, f->text));
+                if (id == NO_TEXT || !diff_add_include(side, context, id, file, f->line)) return 0;
+                continue;
+            }
+            
+            if (f->kind == FACT_PRIORITY) {
+                const char *pattern = diag_text(d, f->text);
+                exten_name = diag_name(names, pattern);
+                if (exten_name == NO_TEXT && pattern && pattern[0]) return 0;  // "" names no extension
+                exten = 0;
+                exten_line = f->line;
+            }
+            const char *text = diag_text(d, f->label);
+            long priority = number_priority(text ? make_view(text, strlen(text)) : NO_VIEW, &last);
+            if (priority < 0 || exten_name == NO_TEXT || f->exten == NO_TEXT) continue;
+            
+            if (!exten && !(exten = diff_exten_for(side, context, exten_name, file, exten_line))) return 0;
+            uint32_t step = diag_name(names, diag_text(d, f->exten));
+            if (step == NO_TEXT || !diff_add_step(side, exten, priority, step)) return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Walk the steps of extension a (on side sa) that extension b (on sb) lacks
+ * (want = 0) or has with another step (want = 1). With a label they are
+ * printed after it as one more clause of a '~' line, which already has
+ * listed clauses; returns how many there were.
+ */
+static int diff_steps(const diff_side *sa, uint32_t a, const diff_side *sb, uint32_t b,
+                      int want, const char *label, int listed) {
+    int n = 0;
+    
+    for (uint32_t s = sa->extens[a - 1].steps; s; s = sa->steps[s - 1].next) {
+        const diff_step *step = &sa->steps[s - 1];
+        uint64_t other = id_map_get(&sb->step_ids, (uint64_t)b << 32 | step->priority);
+        int differs = other ? sb->steps[other - 1].step != step->step : 0;
+        if ((other != 0) != want || (want && !differs)) continue;
+        
+        if (label) {
+            if (n == 0) printf("%s%s", listed ? ";" : ":", label);
+            else printf(",");
+            if (step->priority == 0) printf(" hint");
+            else printf(" %u", step->priority);
+        }
+        n++;
+    }
+    return n;
+}
+
+typedef struct {
+    int contexts_added, contexts_removed;
+    int extens_added, extens_removed, extens_changed;
+    int includes_added, includes_removed;
+} diff_counts;
+
+/* Print what tells new from old, context by context in new's order, then contexts only old has */
+static void diff_report(const diff_side *old, const diff_side *new, const diag_buffer *names, diff_counts *n) {
+    const char *text = names->text;
+    
+    for (size_t c = 0; c < new->context_count; c++) {
+        const diff_context *nc = &new->contexts[c];
+        uint64_t nid = c + 1, oid = id_map_get(&old->context_ids, nc->name);
+        const char *context = text + nc->name;
+        
+        if (!oid) {
+            printf("+ [%s] (%s:%d)\n", context, nc->file, nc->line);
+            n->contexts_added++;
+            continue;
+        }
+        const diff_context *oc = &old->contexts[oid - 1];
+        
+        for (uint32_t i = nc->includes; i; i = new->includes[i - 1].next) {
+            const diff_include *inc = &new->includes[i - 1];
+            if (id_map_get(&old->include_ids, oid << 32 | inc->name)) continue;
+            printf("+ [%s] include => %s (%s:%d)\n", context, text + inc->name, inc->file, inc->line);
+            n->includes_added++;
+        }
+        for (uint32_t i = oc->includes; i; i = old->includes[i - 1].next) {
+            const diff_include *inc = &old->includes[i - 1];
+            if (id_map_get(&new->include_ids, nid << 32 | inc->name)) continue;
+            printf("- [%s] include => %s (%s:%d)\n", context, text + inc->name, inc->file, inc->line);
+            n->includes_removed++;
+        }
+        
+        for (uint32_t e = nc->extens; e; e = new->extens[e - 1].next) {
+            const diff_exten *ne = &new->extens[e - 1];
+            uint32_t oe = (uint32_t)id_map_get(&old->exten_ids, oid << 32 | ne->name);
+            if (!oe) {
+                printf("+ %s@%s (%s:%d)\n", text + ne->name, context, ne->file, ne->line);
+                n->extens_added++;
+                continue;
+            }
+            if (!diff_steps(new, e, old, oe, 1, NULL, 0) && !diff_steps(new, e, old, oe, 0, NULL, 0) &&
+                !diff_steps(old, oe, new, e, 0, NULL, 0)) {
+                continue;
+            }
+            printf("~ %s@%s (%s:%d)", text + ne->name, context, ne->file, ne->line);
+            int listed = diff_steps(new, e, old, oe, 1, " changed", 0);
+            listed += diff_steps(new, e, old, oe, 0, " added", listed);
+            diff_steps(old, oe, new, e, 0, " removed", listed);
+            printf("\n");
+            n->extens_changed++;
+        }
+        for (uint32_t e = oc->extens; e; e = old->extens[e - 1].next) {
+            const diff_exten *oe = &old->extens[e - 1];
+            if (id_map_get(&new->exten_ids, nid << 32 | oe->name)) continue;
+            printf("- %s@%s (%s:%d)\n", text + oe->name, context, oe->file, oe->line);
+            n->extens_removed++;
+        }
+    }
+    
+    for (size_t c = 0; c < old->context_count; c++) {
+        const diff_context *oc = &old->contexts[c];
+        if (id_map_get(&new->context_ids, oc->name)) continue;
+        printf("- [%s] (%s:%d)\n", text + oc->name, oc->file, oc->line);
+        n->contexts_removed++;
+    }
+}
+
+/*
+ * Exit status for --diff, as diff(1): 0 = the same, 1 = they differ,
+ * 2 = a side can't be read
+ */
+static int diff_files(const char *old_path, const char *new_path, const validator_options *opts) {
+    const char *paths[2] = { old_path, new_path };
+    file_result results[2];
+    snapshot snaps[2];
+    file_batch batch;
+    diff_side sides[2];
+    diag_buffer names = {0};
+    int status = 2, validate = 0;
+    
+    memset(results, 0, sizeof(results));
+    memset(snaps, 0, sizeof(snaps));
+    memset(&batch, 0, sizeof(batch));
+    memset(sides, 0, sizeof(sides));
+    
+    // Snapshots are mapped; the other sides are validated, both at once if there are two
+    for (int i = 0; i < 2; i++) {
+        results[i].filename = paths[i];
+        if (is_snapshot(paths[i])) {
+            if (!snapshot_open(&snaps[i], paths[i])) goto done;
+        } else {
+            validate++;
+        }
+    }
+    batch.results = results;
+    batch.opts = *opts;
+    if (validate == 2 && opts->jobs > 1) {
+        batch.opts.jobs = 1;
+        run_pool(2, opts->jobs, run_file_job, &batch);
+    } else {
+        for (int i = 0; i < 2; i++) {
+            if (!snaps[i].map) run_file_job(&batch, 0, i);
+        }
+    }
+    
+    int ok = 1;
+    for (int i = 0; i < 2; i++) {
+        const file_result *side = snaps[i].map ? snaps[i].results : &results[i];
+        int count = snaps[i].map ? snaps[i].count : 1, errors = 0;
+        
+        for (int f = 0; f < count; f++) {
+            if (open_failed(&side[f])) {
+                print_diag(stderr, &side[f].diags, &side[f].diags.items[0], NULL);
+                ok = 0;
+            }
+            errors += side[f].errors;
+        }
+        if (ok && errors) {
+            fprintf(stderr, "Warning: '%s' has %d error(s); lines with errors may be missing from the diff\n",
+                    paths[i], errors);
+        }
+        if (ok && !diff_build(&sides[i], &names, side, count)) {
+            fprintf(stderr, "Error: Out of memory\n");
+            ok = 0;
+        }
+    }
+    fflush(stderr);
+    if (!ok) goto done;
+    
+    diff_counts n = {0};
+    printf("--- %s\n+++ %s\n", old_path, new_path);
+    diff_report(&sides[0], &sides[1], &names, &n);
+    int changes = n.contexts_added + n.contexts_removed + n.extens_added + n.extens_removed +
+                  n.extens_changed + n.includes_added + n.includes_removed;
+    if (changes == 0) {
+        printf("No differences in contexts, extensions or includes\n");
+    } else {
+        printf("\n%d context(s) added, %d removed; %d extension(s) added, %d removed, %d changed; "
+               "%d include(s) added, %d removed\n", n.contexts_added, n.contexts_removed,
+               n.extens_added, n.extens_removed, n.extens_changed, n.includes_added, n.includes_removed);
+    }
+    fflush(stdout);
+    status = changes ? 1 : 0;
+    
+done:
+    for (int i = 0; i < 2; i++) {
+        diag_free(&results[i].diags);
+        snapshot_close(&snaps[i]);
+        diff_side_free(&sides[i]);
+    }
+    diag_free(&names);
+    return status;
+}
+
+/*
+ * --includes: #include / #tryinclude targets are validated as well, each
+ * unique file (by real path) once however many times it is included. The
+ * graph is walked breadth-first one wave at a time: a wave is validated on
+ * the pool, then its include facts are resolved in order, which yields the
+ * next wave. Every included file remembers where it was first included
+ * from, and its diagnostics are reported with that chain.
+ *
+ * As in Asterisk, relative names are resolved against the configuration
+ * directory, taken to be the directory of the top-level file, and may be
+ * glob patterns. Each file is validated on its own, starting outside any
+ * context.
+ */
+typedef struct {
+    file_result *results;
+    char **owned;          // Resolved names of included files (results[i].filename)
+    char **reals;          // Real path of each file, or NULL
+    int count;
+    int cap;
+    uint32_t *slots;       // Real-path index: result index + 1, 0 = empty
+    size_t nslots;         // Power of two
+} file_graph;
+
+static int graph_find(const file_graph *g, const char *real, uint64_t h) {
+    for (size_t i = (size_t)h & (g->nslots - 1);; i = (i + 1) & (g->nslots - 1)) {
+        uint32_t slot = g->slots[i];
+        if (slot == 0) return -1;
+        if (g->reals[slot - 1] && strcmp(g->reals[slot - 1], real) == 0) return (int)slot - 1;
+    }
+}
+
+static void graph_index(file_graph *g, int index) {
+    const char *real = g->reals[index];
+    size_t i = (size_t)hash_bytes(real, strlen(real), 0) & (g->nslots - 1);
+    while (g->slots[i]) i = (i + 1) & (g->nslots - 1);
+    g->slots[i] = (uint32_t)index + 1;
+}
+
+/*
+ * Add a file unless one with the same real path is already in the graph;
+ * name is adopted (owned) when the file is added and freed otherwise.
+ * Returns 0 on OOM.
+ */
+static int graph_add(file_graph *g, const char *root_name, char *owned, int included_by, int line) {
+    const char *name = owned ? owned : root_name;
+    char *real = realpath(name, NULL);
+    
+    if (real && g->nslots) {
+        if (graph_find(g, real, hash_bytes(real, strlen(real), 0)) >= 0 && owned) {
+            free(owned);
+            free(real);
+            return 1;
+        }
+    }
+    
+    if (g->count == g->cap) {
+        int cap = g->cap ? g->cap * 2 : 64;
+        file_result *results = realloc(g->results, (size_t)cap * sizeof(file_result));
+        char **owned_names = results ? realloc(g->owned, (size_t)cap * sizeof(char *)) : NULL;
+        char **reals = owned_names ? realloc(g->reals, (size_t)cap * sizeof(char *)) : NULL;
+        if (results) g->results = results;
+        if (owned_names) g->owned = owned_names;
+        if (!reals) {
+            free(owned);
+            free(real);
+            return 0;
+        }
+        g->reals = reals;
+        g->cap = cap;
+    }
+    if ((size_t)(g->count + 1) * 2 > g->nslots) {
+        size_t nslots = g->nslots ? g->nslots * 2 : 128;
+        uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+        if (!slots) {
+            free(owned);
+            free(real);
+            return 0;
+        }
+        free(g->slots);
+        g->slots = slots;
+        g->nslots = nslots;
+        for (int i = 0; i < g->count; i++) {
+            if (g->reals[i]) graph_index(g, i);
+        }
+    }
+    
+    file_result *r = &g->results[g->count];
+    memset(r, 0, sizeof(*r));
+    r->filename = name;
+    r->included_by = included_by;
+    r->included_line = line;
+    g->owned[g->count] = owned;
+    g->reals[g->count] = real;
+    
+    // A file named twice on the command line is still validated twice, as before,
+    // but only the first one is indexed for includes to find
+    if (real && graph_find(g, real, hash_bytes(real, strlen(real), 0)) < 0) graph_index(g, g->count);
+    g->count++;
+    return 1;
+}
+
+/* Add the targets of file index's include facts; returns 0 on OOM */
+static int resolve_includes(file_graph *g, int index) {
+    int root = index;
+    while (g->results[root].included_by) root = g->results[root].included_by - 1;
+    
+    const char *root_name = g->results[root].filename;
+    const char *slash = strrchr(root_name, '/');
+    int dir_len = slash ? (int)(slash - root_name) : 0;
+    
+    diag_buffer late = {0};
+    
+    for (size_t i = 0; i < g->results[index].diags.fact_count; i++) {
+        diag_buffer *d = &g->results[index].diags;
+        const fact f = d->facts[i];
+        const char *arg = diag_text(d, f.text);
+        char pattern[PATH_MAX];
+        glob_t matches;
+        
+        if (!arg || (f.kind != FACT_INCLUDE && f.kind != FACT_TRYINCLUDE)) continue;
+        if (arg[0] == '/' || !slash) {
+            snprintf(pattern, sizeof(pattern), "%s", arg);
+        } else {
+            snprintf(pattern, sizeof(pattern), "%.*s/%s", dir_len, root_name, arg);
+        }
+        
+        if (glob(pattern, 0, NULL, &matches) != 0 || matches.gl_pathc == 0) {
+            if (f.kind == FACT_INCLUDE) {
+                add_fact_diag(&late, d, &f, DIAG_ERROR, E_HASH_INCLUDE_MISSING,
+                              "Cannot open included file '%s'", arg);
+            }
+            continue;
+        }
+        for (size_t m = 0; m < matches.gl_pathc; m++) {
+            char *name = strdup(matches.gl_pathv[m]);
+            if (!name || !graph_add(g, NULL, name, index + 1, f.line)) {
+                globfree(&matches);
+                diag_free(&late);
+                return 0;
+            }
+        }
+        globfree(&matches);
+    }
+    absorb_late(&g->results[index], &late);
+    return 1;
+}
+
+static int validate_graph(const char **files, int nfiles, const validator_options *opts) {
+    file_graph g;
+    file_batch batch;
+    int status = 0, ok = 1;
+    
+    memset(&g, 0, sizeof(g));
+    memset(&batch, 0, sizeof(batch));
+    for (int i = 0; i < nfiles && ok; i++) ok = graph_add(&g, files[i], NULL, 0, 0);
+    
+    for (int start = 0; ok && start < g.count;) {
+        int end = g.count;
+        
+        batch.results = g.results + start;
+        batch.opts = *opts;
+        if (opts->jobs <= 1 || end - start == 1) {
+            for (int i = 0; i < end - start; i++) run_file_job(&batch, 0, i);
+        } else {
+            batch.opts.jobs = 1;
+            batch.order = largest_first(batch.results, end - start);
+            run_pool(end - start, opts->jobs, run_file_job, &batch);
+            free(batch.order);
+            batch.order = NULL;
+        }
+        for (int i = start; i < end && ok; i++) ok = resolve_includes(&g, i);
+        start = end;
+    }
+    if (ok && opts->xref) xref_check(g.results, g.count);
+    if (ok && opts->check_globals) globals_check(g.results, g.count);
+    
+    if (!ok) {
+        fprintf(stderr, "Error: Out of memory\n");
+        status = 1;
+    } else {
+        validator_stats output = {0};
+        emit_counted(g.results, g.count, opts, &output);
+        if (opts->stats) print_stats(g.results, g.count, &output);
+        if (opts->profile_contexts) print_profile(g.results, g.count, opts->profile_contexts);
+        if (opts->snapshot && !snapshot_save(g.results, g.count, opts)) status = 1;
+    }
+    
+    for (int i = 0; i < g.count; i++) {
+        if (result_status(&g.results[i]) != 0) status = 1;
+        diag_free(&g.results[i].diags);
+        profile_free(&g.results[i].profile);
+        free(g.owned[i]);
+        free(g.reals[i]);
+    }
+    free(g.results);
+    free(g.owned);
+    free(g.reals);
+    free(g.slots);
+    return status;
+}
+
+/* Validate every file; output is printed in argument order either way */
+static int validate_files(const char **files, int nfiles, const validator_options *opts) {
+    file_batch batch;
+    int status = 0;
+    
+    if (opts->follow_includes) return validate_graph(files, nfiles, opts);
+    
+    memset(&batch, 0, sizeof(batch));
+    batch.results = calloc((size_t)nfiles, sizeof(file_result));
+    batch.opts = *opts;
+    if (!batch.results) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < nfiles; i++) batch.results[i].filename = files[i];
+    
+    // Text output can stream; structured formats, --xref, --check-globals, snapshots and profiles need every file first
+    int streaming = opts->format == FORMAT_TEXT && !opts->xref && !opts->check_globals && !opts->snapshot &&
+                    !opts->profile_contexts;
+    validator_stats output = {0};
+    validator_options shown = *opts;   // Streamed one at a time, files are still named if there are several
+    shown.name_files = nfiles > 1;
+    
+    if (opts->jobs <= 1 || nfiles == 1) {
+        // A single file keeps all workers for itself (see validate_chunked)
+        diag_buffer spare = {0};   // The last streamed file's emptied arena, for the next
+        
+        for (int i = 0; i < nfiles; i++) {
+            run_file(&batch, i, &spare);
+            
+            if (streaming) {
+                emit_counted(batch.results + i, 1, &shown, &output);
+                diag_clear(&batch.results[i].diags);
+                spare = batch.results[i].diags;
+                memset(&batch.results[i].diags, 0, sizeof(batch.results[i].diags));
+            }
+        }
+        diag_free(&spare);
+    } else {
+        batch.opts.jobs = 1;
+        batch.order = largest_first(batch.results, nfiles);
+        run_pool(nfiles, opts->jobs, run_file_job, &batch);
+        free(batch.order);
+        if (streaming) emit_counted(batch.results, nfiles, opts, &output);
+    }
+    
+    if (!streaming) {
+        if (opts->xref) xref_check(batch.results, nfiles);
+        if (opts->check_globals) globals_check(batch.results, nfiles);
+        emit_counted(batch.results, nfiles, opts, &output);
+    }
+    if (opts->stats) print_stats(batch.results, nfiles, &output);
+    if (opts->profile_contexts) print_profile(batch.results, nfiles, opts->profile_contexts);
+    if (opts->snapshot && !snapshot_save(batch.results, nfiles, opts)) status = 1;
+    
+    for (int i = 0; i < nfiles; i++) {
+        if (result_status(&batch.results[i]) != 0) status = 1;
+        diag_free(&batch.results[i].diags);
+        profile_free(&batch.results[i].profile);
+    }
+    free(batch.results);
+    return status;
+}
+
+/*
+ * Benchmarking (--generate / --bench)
+ *
+ * --generate writes a synthetic dialplan of N lines to stdout, the same
+ * text every time for the same arguments. --mix sets the percentage of
+ * lines of each kind that loads one part of the validator: long Set()
+ * lines, deeply nested ${...} / $[...], labelled priorities, and context
+ * headers; the rest are short application lines. Stress lines, none by
+ * default, are the inputs most likely to make scanning slow: thousands of
+ * arguments, calls and expressions hundreds deep, and 16 KB values. The
+ * output validates clean with every check, so a benchmark measures the
+ * common path.
+ *
+ * --bench validates its files BENCH_RUNS times with the given options,
+ * output discarded, and reports the best time of each phase, throughput
+ * and peak RSS. With --min-rate it fails below a given lines/s, so a
+ * generated file makes a fixed corpus for catching slowdowns.
+ */
+#ifndef BENCH_RUNS
+#define BENCH_RUNS 5
+#endif
+
+typedef struct {
+    int set;       // Long Set() lines
+    int nest;      // Nested ${...} / $[...]
+    int label;     // n(label) priorities
+    int context;   // [context] headers
+    int stress;    // Very wide, deep or long lines
+} generate_mix;
+
+/* Parse "set=10,nest=5,label=10,context=1,stress=0"; kinds left out keep their value */
+static int parse_mix(const char *spec, generate_mix *mix) {
+    int total;
+    
+    while (*spec) {
+        const char *eq = strchr(spec, '=');
+        const char *comma = strchr(spec, ',');
+        if (!eq || (comma && comma < eq)) return 0;
+        
+        size_t n = (size_t)(eq - spec);
+        char *end;
+        long v = strtol(eq + 1, &end, 10);
+        if (end == eq + 1 || (*end && *end != ',') || v < 0 || v > 100) return 0;
+        
+        if (n == 3 && strncmp(spec, "set", 3) == 0) mix->set = (int)v;
+        else if (n == 4 && strncmp(spec, "nest", 4) == 0) mix->nest = (int)v;
+        else if (n == 5 && strncmp(spec, "label", 5) == 0) mix->label = (int)v;
+        else if (n == 7 && strncmp(spec, "context", 7) == 0) mix->context = (int)v;
+        else if (n == 6 && strncmp(spec, "stress", 6) == 0) mix->stress = (int)v;
+        else return 0;
+        spec = *end ? end + 1 : end;
+    }
+    total = mix->set + mix->nest + mix->label + mix->context + mix->stress;
+    return total <= 100;
+}
+
+static uint64_t generate_next(uint64_t *rng) {
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return *rng;
+}
+
+static void generate_dialplan(long lines, const generate_mix *mix) {
+    static const char *const apps[] = {
+        "NoOp(Call from ${CALLERID(num)} to ${EXTEN})",
+        "Dial(PJSIP/${EXTEN}@trunk,30,tT)",
+        "Playback(custom/welcome)",
+        "Set(CHANNEL(language)=en)",
+        "Wait(1)",
+        "Hangup()"
+    };
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+    long contexts = 0, extens = 0;
+    int left = 0;  // Lines still to come in the current extension
+    
+    setvbuf(stdout, NULL, _IOFBF, 64 * 1024);
+    for (long n = 0; n < lines; n++) {
+        int roll = (int)(generate_next(&rng) % 100);
+        
+        if (n == 0 || roll < mix->context) {
+            printf("[context-%ld]\n", contexts++);
+            left = 0;
+            continue;
+        }
+        if (left == 0) {
+            printf("exten => %ld,1,Answer()\n", 1000 + extens++);
+            left = 4 + (int)(generate_next(&rng) % 12);
+            continue;
+        }
+        left--;
+        
+        roll -= mix->context;
+        if (roll < mix->set) {
+            printf("same => n,Set(CDR_%ld=${CALLERID(num)}|${CALLERID(name)}|${EXTEN}|${CONTEXT}|"
+                   "${STRFTIME(${EPOCH},,%%Y-%%m-%%d %%H:%%M:%%S)}|${CHANNEL}|${UNIQUEID}|"
+                   "${DIALSTATUS}|${ANSWEREDTIME}|${HANGUPCAUSE}|${SIPCALLID}|${ACCOUNTCODE}|"
+                   "${MIXMONITOR_FILENAME}|${QUEUESTATUS}|${MACRO_EXTEN}|${BLINDTRANSFER})\n", n);
+        } else if ((roll -= mix->set) < mix->nest) {
+            int depth = 4 + (int)(generate_next(&rng) % 9);
+            printf("same => n,Set(DEPTH=");
+            for (int i = 0; i < depth; i++) printf(i % 2 ? "$[" : "${CUT(");
+            printf("${EXTEN}");
+            for (int i = depth - 1; i >= 0; i--) printf(i % 2 ? " + 1]" : ",-,1)}");
+            printf(")\n");
+        } else if ((roll -= mix->nest) < mix->label) {
+            printf("same => n(step%ld),Verbose(2,Step %ld of ${EXTEN})\n", n, n);
+        } else if ((roll -= mix->label) < mix->stress) {
+            int kind = (int)(generate_next(&rng) % 3);
+            if (kind == 0) {
+                printf("same => n,NoOp(%ld", n);
+                for (int i = 0; i < 2000; i++) printf(",${EXTEN}");
+            } else if (kind == 1) {
+                printf("same => n,Set(DEEP=");
+                for (int i = 0; i < 300; i++) printf(i % 2 ? "$[" : "${CUT(");
+                printf("${EXTEN}");
+                for (int i = 299; i >= 0; i--) printf(i % 2 ? " + 1]" : ",-,1)}");
+            } else {
+                printf("same => n,Set(BLOB=");
+                for (int i = 0; i < 16384 / 16; i++) printf("0123456789abcdef");
+            }
+            printf(")\n");
+        } else {
+            printf("same => n,%s\n", apps[generate_next(&rng) % (sizeof(apps) / sizeof(apps[0]))]);
+        }
+    }
+    fflush(stdout);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* --bench runs the two halves of run_file_job() as separate phases */
+static void bench_parse_job(void *ctx, int worker, int index) {
+    file_batch *batch = ctx;
+    file_result *result = &batch->results[batch->order ? batch->order[index] : index];
+    validator_state state = {0};
+    (void)worker;
+    
+    state.opts = &batch->opts;
+    validate_dialplan(result->filename, &state);
+    take_result(result, &state);
+}
+
+static void bench_patterns_job(void *ctx, int worker, int index) {
+    file_batch *batch = ctx;
+    (void)worker;
+    check_patterns(&batch->results[batch->order ? batch->order[index] : index]);
+}
+
+enum { PHASE_PARSE, PHASE_PATTERNS, PHASE_XREF, PHASE_EMIT, PHASE_COUNT };
+
+static int bench_files(const char **files, int nfiles, const validator_options *opts, double min_rate) {
+    static const char *const phase_names[PHASE_COUNT] = { "parse", "patterns", "xref", "emit" };
+    double best[PHASE_COUNT], best_total = 0;
+    long long lines = 0, bytes = 0;
+    int errors = 0, warnings = 0, status = 0;
+    int devnull = open("/dev/null", O_WRONLY);
+    file_batch batch;
+    
+    memset(&batch, 0, sizeof(batch));
+    batch.opts = *opts;
+    if (opts->jobs > 1 && nfiles > 1) batch.opts.jobs = 1;  // As validate_files() does
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        double t[PHASE_COUNT + 1];
+        
+        batch.results = calloc((size_t)nfiles, sizeof(file_result));
+        if (!batch.results) {
+            fprintf(stderr, "Error: Out of memory\n");
+            status = 1;
+            break;
+        }
+        for (int i = 0; i < nfiles; i++) batch.results[i].filename = files[i];
+        
+        t[PHASE_PARSE] = now_seconds();
+        if (opts->jobs <= 1 || nfiles == 1) {
+            for (int i = 0; i < nfiles; i++) bench_parse_job(&batch, 0, i);
+        } else {
+            batch.order = largest_first(batch.results, nfiles);
+            run_pool(nfiles, opts->jobs, bench_parse_job, &batch);
+        }
+        t[PHASE_PATTERNS] = now_seconds();
+        if (opts->check_patterns) run_pool(nfiles, opts->jobs, bench_patterns_job, &batch);
+        t[PHASE_XREF] = now_seconds();
+        if (opts->xref) xref_check(batch.results, nfiles);
+        if (opts->check_globals) globals_check(batch.results, nfiles);
+        t[PHASE_EMIT] = now_seconds();
+        
+        // Emit as a normal run would, into /dev/null
+        fflush(stdout);
+        fflush(stderr);
+        int out = dup(STDOUT_FILENO), err = dup(STDERR_FILENO);
+        if (devnull >= 0 && out >= 0 && err >= 0) {
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            emit_results(batch.results, nfiles, opts);
+            fflush(stderr);
+            dup2(out, STDOUT_FILENO);
+            dup2(err, STDERR_FILENO);
+        }
+        if (out >= 0) close(out);
+        if (err >= 0) close(err);
+        t[PHASE_COUNT] = now_seconds();
+        
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            if (run == 0 || t[p + 1] - t[p] < best[p]) best[p] = t[p + 1] - t[p];
+        }
+        if (run == 0 || t[PHASE_COUNT] - t[0] < best_total) best_total = t[PHASE_COUNT] - t[0];
+        
+        for (int i = 0; i < nfiles; i++) {
+            file_result *r = &batch.results[i];
+            if (run == 0) {
+                struct stat st;
+                lines += r->lines;
+                errors += r->errors;
+                warnings += r->warnings;
+                if (stat(r->filename, &st) == 0) bytes += st.st_size;
+                if (open_failed(r)) {
+                    fprintf(stderr, "Error: Cannot open file '%s'\n", r->filename);
+                    status = 1;
+                }
+            }
+            diag_free(&r->diags);
+        }
+        free(batch.results);
+        free(batch.order);
+        batch.order = NULL;
+        if (status) break;
+    }
+    if (devnull >= 0) close(devnull);
+    if (status) return status;
+    
+    struct rusage usage;
+    double rss_mb = 0;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+        rss_mb = (double)usage.ru_maxrss / (1024.0 * 1024.0);  // Bytes
+#else
+        rss_mb = (double)usage.ru_maxrss / 1024.0;             // Kilobytes
+#endif
+    }
+    
+    printf("Benchmark: %d file(s), %lld lines, %.1f MB, best of %d runs on %d thread(s)\n",
+           nfiles, lines, (double)bytes / (1024.0 * 1024.0), BENCH_RUNS, opts->jobs);
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        if ((p == PHASE_PATTERNS && !opts->check_patterns) || (p == PHASE_XREF && !opts->xref && !opts->check_globals)) continue;
+        printf("  %-12s %10.2f ms\n", phase_names[p], best[p] * 1000.0);
+    }
+    printf("  %-12s %10.2f ms   %.0f lines/s   %.1f MB/s\n", "total", best_total * 1000.0,
+           best_total > 0 ? (double)lines / best_total : 0.0,
+           best_total > 0 ? (double)bytes / (1024.0 * 1024.0) / best_total : 0.0);
+    printf("  %-12s %10.1f MB\n", "peak RSS", rss_mb);
+    printf("  %-12s %d error(s), %d warning(s)\n", "diagnostics", errors, warnings);
+    
+    double rate = best_total > 0 ? (double)lines / best_total : 0.0;
+    if (min_rate > 0 && rate < min_rate) {
+        fprintf(stderr, "Error: %.0f lines/s is below --min-rate %.0f\n", rate, min_rate);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * --watch: validate once, then keep every file's per-context results in
+ * memory and re-check a file whenever it changes on disk. Only contexts
+ * whose text changed are parsed again, and the report is the difference
+ * from the previous run of that file.
+ *
+ * Parent directories are watched (inotify on Linux) rather than the files
+ * themselves, because editors commonly save by writing a new file and
+ * renaming it over the old one. Events only prompt a re-stat; the stamps
+ * decide what changed, so missed or spurious events are harmless, and
+ * without inotify the same loop simply polls.
+ */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_ns;
+} file_stamp;   // All zero = missing
+
+typedef struct {
+    const char *filename;
+    file_stamp stamp;
+    block_cache cache;
+    file_result last;
+} watched_file;
+
+static volatile sig_atomic_t watch_stop;
+
+static void on_watch_signal(int sig) {
+    (void)sig;
+    watch_stop = 1;
+}
+
+static file_stamp stamp_file(const char *filename) {
+    file_stamp s;
+    struct stat st;
+    
+    memset(&s, 0, sizeof(s));
+    if (stat(filename, &st) == 0) {
+        s.dev = st.st_dev;
+        s.ino = st.st_ino;
+        s.size = st.st_size;
+        s.mtime = st.st_mtime;
+#if defined(__APPLE__)
+        s.mtime_ns = st.st_mtimespec.tv_nsec;
+#else
+        s.mtime_ns = st.st_mtim.tv_nsec;
+#endif
+    }
+    return s;
+}
+
+static int stamp_equal(const file_stamp *a, const file_stamp *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime == b->mtime && a->mtime_ns == b->mtime_ns;
+}
+
+static void watch_validate(watched_file *w, const validator_options *opts, file_result *result) {
+    validator_state state = {0};
+    
+    state.opts = opts;
+    state.resident = &w->cache;
+    result->filename = w->filename;
+    validate_dialplan(w->filename, &state);
+    take_result(result, &state);
+    if (opts->check_patterns) check_patterns(result);
+    if (opts->check_globals) globals_check(result, 1);
+}
+
+/* Identity of a diagnostic across edits: everything except where it is (line only orders equal ones) */
+typedef struct {
+    uint64_t hash;
+    int line;
+    uint32_t index;
+} diag_key;
+
+static int compare_diag_keys(const void *a, const void *b) {
+    const diag_key *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    if (x->line != y->line) return x->line < y->line ? -1 : 1;
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+static diag_key *diag_keys(const diag_buffer *d) {
+    diag_key *keys = malloc((d->count ? d->count : 1) * sizeof(diag_key));
+    if (!keys) return NULL;
+    
+    for (size_t i = 0; i < d->count; i++) {
+        const diagnostic *item = &d->items[i];
+        const char *message = diag_text(d, item->message);
+        const char *context = diag_text(d, item->context);
+        uint64_t h = ((uint64_t)item->code << 8) | item->level;
+        
+        if (message) h = hash_bytes(message, strlen(message), h);
+        if (context) h = hash_bytes(context, strlen(context), h ^ 0x5bd1e995);
+        keys[i].hash = h;
+        keys[i].line = item->line;
+        keys[i].index = (uint32_t)i;
+    }
+    qsort(keys, d->count, sizeof(diag_key), compare_diag_keys);
+    return keys;
+}
+
+#define PAIR_MAX_CELLS (1 << 18)   // Above this a run of equal diagnostics pairs in plain line order
+
+/*
+ * Pair a run of equal diagnostics, x (the shorter) with y, both in line
+ * order: every x gets a y, order kept, with the least total line distance,
+ * so the ones left over in y are the ones that really came or went rather
+ * than whichever sort last. dp[i][d] is the cost of x[0..i) with d of y
+ * skipped; a very long run, or no memory, just pairs in order.
+ */
+static void pair_run(const diag_key *x, size_t s, unsigned char *x_seen,
+                     const diag_key *y, size_t l, unsigned char *y_seen) {
+    size_t skip = l - s, cols = skip + 1;
+    uint64_t *dp = NULL;
+    unsigned char *matched = NULL;
+    
+    if (s && skip && (s + 1) <= PAIR_MAX_CELLS / cols) {
+        dp = malloc((s + 1) * cols * sizeof(*dp));
+        matched = malloc((s + 1) * cols);
+    }
+    if (!dp || !matched) {
+        for (size_t i = 0; i < s; i++) {
+            x_seen[x[i].index] = 1;
+            y_seen[y[i].index] = 1;
+        }
+        free(dp);
+        free(matched);
+        return;
+    }
+    
+    for (size_t i = 0; i <= s; i++) {
+        for (size_t d = 0; d <= skip; d++) {
+            uint64_t best = UINT64_MAX;
+            unsigned char pair = 0;
+            
+            if (i == 0 && d == 0) best = 0;
+            if (d > 0) best = dp[i * cols + d - 1];   // y[i + d - 1] left over
+            if (i > 0) {
+                int64_t gap = (int64_t)x[i - 1].line - y[i - 1 + d].line;
+                uint64_t cost = dp[(i - 1) * cols + d] + (uint64_t)(gap < 0 ? -gap : gap);
+                if (cost < best) {
+                    best = cost;
+                    pair = 1;
+                }
+            }
+            dp[i * cols + d] = best;
+            matched[i * cols + d] = pair;
+        }
+    }
+    for (size_t i = s, d = skip; i > 0;) {
+        if (matched[i * cols + d]) {
+            x_seen[x[i - 1].index] = 1;
+            y_seen[y[i - 1 + d].index] = 1;
+            i--;
+        } else {
+            d--;
+        }
+    }
+    free(dp);
+    free(matched);
+}
+
+/*
+ * Mark the diagnostics of old and new that have a counterpart in the other
+ * run. Equal diagnostics pair by nearest line (see pair_run), so an edit
+ * that only shifts lines reports nothing and a fixed or new one is shown
+ * at its own line.
+ */
+static int match_diags(const diag_buffer *old, const diag_buffer *new,
+                       unsigned char *old_seen, unsigned char *new_seen) {
+    diag_key *a = diag_keys(old), *b = diag_keys(new);
+    size_t i = 0, j = 0;
+    
+    if (!a || !b) {
+        free(a);
+        free(b);
+        return 0;
+    }
+    while (i < old->count && j < new->count) {
+        if (a[i].hash == b[j].hash) {
+            size_t m = i, k = j;
+            
+            while (m < old->count && a[m].hash == a[i].hash) m++;
+            while (k < new->count && b[k].hash == b[j].hash) k++;
+            if (m - i <= k - j) {
+                pair_run(a + i, m - i, old_seen, b + j, k - j, new_seen);
+            } else {
+                pair_run(b + j, k - j, new_seen, a + i, m - i, old_seen);
+            }
+            i = m;
+            j = k;
+        } else if (a[i].hash < b[j].hash) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    free(a);
+    free(b);
+    return 1;
+}
+
+/* Report a re-checked file as the change in its diagnostics */
+static void emit_watch_diff(const file_result *old, const file_result *new) {
+    unsigned char *old_seen = calloc(old->diags.count + 1, 1);
+    unsigned char *new_seen = calloc(new->diags.count + 1, 1);
+    char clock[16] = "";
+    time_t now = time(NULL);
+    struct tm tm;
+    int changes = 0;
+    
+    if (localtime_r(&now, &tm)) strftime(clock, sizeof(clock), "%H:%M:%S", &tm);
+    printf("\n[%s] %s: ", clock, new->filename);
+    if (open_failed(new)) {
+        printf("unreadable\n");
+    } else if (new->errors == 0 && new->warnings == 0) {
+        printf("✓ Syntax valid\n");
+    } else {
+        printf("%d error(s), %d warning(s)\n", new->errors, new->warnings);
+    }
+    
+    if (!old_seen || !new_seen || !match_diags(&old->diags, &new->diags, old_seen, new_seen)) {
+        // Out of memory: show the whole new result instead of a diff
+        for (size_t i = 0; i < new->diags.count; i++) {
+            printf("  ");
+            print_diag(stdout, &new->diags, &new->diags.items[i], NULL);
+        }
+        changes = 1;
+    } else {
+        for (size_t i = 0; i < old->diags.count; i++) {
+            if (old_seen[i]) continue;
+            printf("  - ");
+            print_diag(stdout, &old->diags, &old->diags.items[i], NULL);
+            changes++;
+        }
+        for (size_t i = 0; i < new->diags.count; i++) {
+            if (new_seen[i]) continue;
+            printf("  + ");
+            print_diag(stdout, &new->diags, &new->diags.items[i], NULL);
+            changes++;
+        }
+    }
+    if (!changes) printf("  (no change in diagnostics)\n");
+    if (new->stopped) printf("  Stopped after %d error(s) (--max-errors)\n", new->errors);
+    fflush(stdout);
+    
+    free(old_seen);
+    free(new_seen);
+}
+
+#ifdef __linux__
+/* Watch the directory holding each file; returns -1 if inotify is unavailable */
+static int watch_open(const watched_file *files, int nfiles) {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int watching = 0;
+    
+    if (fd < 0) return -1;
+    for (int i = 0; i < nfiles; i++) {
+        const char *slash = strrchr(files[i].filename, '/');
+        char dir[PATH_MAX];
+        
+        if (!slash) {
+            strcpy(dir, ".");
+        } else if ((size_t)(slash - files[i].filename) < sizeof(dir)) {
+            size_t n = slash == files[i].filename ? 1 : (size_t)(slash - files[i].filename);
+            memcpy(dir, files[i].filename, n);
+            dir[n] = '\0';
+        } else {
+            continue;
+        }
+        // The same directory twice just returns its existing watch
+        if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE |
+                              IN_DELETE | IN_MOVED_FROM | IN_ATTRIB) >= 0) {
+            watching++;
+        }
+    }
+    if (!watching) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#else
+static int watch_open(const watched_file *files, int nfiles) {
+    (void)files;
+    (void)nfiles;
+    return -1;
+}
+#endif
+
+/* Sleep until something may have changed (an event, a poll tick or a signal) */
+static void watch_wait(int fd) {
+    if (fd < 0) {
+        poll(NULL, 0, WATCH_POLL_MS);
+        return;
+    }
+    
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, WATCH_POLL_MS) > 0) {
+        char events[4096];
+        poll(NULL, 0, WATCH_SETTLE_MS);
+        while (read(fd, events, sizeof(events)) > 0) {
+            // Drain; the stamps say what actually changed
+        }
+    }
+}
+
+/* Run until SIGINT/SIGTERM; the status reflects the latest result of each file */
+static int watch_files(const char **files, int nfiles, const validator_options *opts) {
+    watched_file *watched = calloc((size_t)nfiles, sizeof(watched_file));
+    struct sigaction sa;
+    int status = 0;
+    
+    if (!watched) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+    
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_watch_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    
+    for (int i = 0; i < nfiles; i++) {
+        watched[i].filename = files[i];
+        watched[i].stamp = stamp_file(files[i]);
+        watch_validate(&watched[i], opts, &watched[i].last);
+        emit_text(&watched[i].last, 0, opts->max_errors, nfiles > 1);
+    }
+    
+    int fd = watch_open(watched, nfiles);
+    printf("\nWatching %d file(s) for changes%s; press Ctrl-C to stop\n",
+           nfiles, fd < 0 ? " (polling)" : "");
+    fflush(stdout);
+    
+    while (!watch_stop) {
+        watch_wait(fd);
+        
+        for (int i = 0; i < nfiles && !watch_stop; i++) {
+            watched_file *w = &watched[i];
+            file_stamp stamp = stamp_file(w->filename);
+            file_result result = {0};
+            
+            if (stamp_equal(&stamp, &w->stamp)) continue;
+            w->stamp = stamp;
+            watch_validate(w, opts, &result);
+            emit_watch_diff(&w->last, &result);
+            diag_free(&w->last.diags);
+            w->last = result;
+        }
+    }
+    
+    if (fd >= 0) close(fd);
+    for (int i = 0; i < nfiles; i++) {
+        if (result_status(&watched[i].last) != 0) status = 1;
+        diag_free(&watched[i].last.diags);
+        cache_free(&watched[i].cache);
+    }
+    free(watched);
+    return status;
+}
+
+/*
+ * Language server (--lsp)
+ *
+ * JSON-RPC over stdin/stdout, Content-Length framed, as LSP clients speak
+ * it. Open documents live in memory, each with its own per-context cache
+ * as in --watch, so an edit (incremental sync: ranges in UTF-16 code
+ * units) re-parses only the [context] blocks whose text changed; the rest
+ * are replayed. Diagnostics are published after every open and change.
+ * The JSON reader only finds and decodes the few values LSP messages need.
+ */
+#define LSP_MAX_MESSAGE (256L * 1024 * 1024)
+
+static const char *json_ws(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+    return p;
+}
+
+/* End of the JSON value starting at p, or NULL if it is malformed */
+static const char *json_skip(const char *p, const char *end) {
+    int depth = 0;
+    
+    p = json_ws(p, end);
+    do {
+        if (p >= end) return NULL;
+        if (*p == '"') {
+            for (p++; p < end && *p != '"'; p++) {
+                if (*p == '\\') p++;
+            }
+            if (p >= end) return NULL;
+            p++;
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+            p++;
+        } else if (*p == '}' || *p == ']') {
+            if (--depth < 0) return NULL;
+            p++;
+        } else if (*p == ',' || *p == ':') {
+            if (depth == 0) return NULL;
+            p++;
+        } else {
+            const char *start = p;
+            while (p < end && (isalnum((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.')) p++;
+            if (p == start) return NULL;
+        }
+        p = json_ws(p, end);
+    } while (depth > 0);
+    return p;
+}
+
+/* The value of member key of object v */
+static int json_member(str_view v, const char *key, str_view *value) {
+    const char *p = json_ws(v.ptr, v.ptr + v.len), *end = v.ptr + v.len;
+    size_t klen = strlen(key);
+    
+    if (p >= end || *p != '{') return 0;
+    for (p = json_ws(p + 1, end); p < end && *p == '"';) {
+        const char *name = p + 1, *after = json_skip(p, end);
+        if (!after || after >= end || *after != ':') return 0;
+        
+        const char *start = json_ws(after + 1, end), *stop = json_skip(start, end);
+        if (!stop) return 0;
+        // Keys LSP uses are plain ASCII, so the raw bytes can be compared
+        if ((size_t)(after - name) > klen && memcmp(name, key, klen) == 0 && name[klen] == '"') {
+            *value = make_view(start, (size_t)(stop - start));
+            while (value->len && isspace((unsigned char)value->ptr[value->len - 1])) value->len--;
+            return 1;
+        }
+        if (stop >= end || *stop != ',') return 0;
+        p = json_ws(stop + 1, end);
+    }
+    return 0;
+}
+
+/* Member at a dotted path, e.g. "params.textDocument.uri" */
+static int json_path(str_view v, const char *path, str_view *value) {
+    char key[64];
+    
+    while (*path) {
+        size_t n = strcspn(path, ".");
+        if (n >= sizeof(key)) return 0;
+        memcpy(key, path, n);
+        key[n] = '\0';
+        if (!json_member(v, key, &v)) return 0;
+        path += n + (path[n] == '.');
+    }
+    *value = v;
+    return 1;
+}
+
+static int json_long(str_view v, long *out) {
+    char *stop;
+    
+    if (!v.len || (v.ptr[0] != '-' && !isdigit((unsigned char)v.ptr[0]))) return 0;
+    errno = 0;
+    *out = strtol(v.ptr, &stop, 10);
+    return errno == 0 && stop == v.ptr + v.len;
+}
+
+static uint32_t json_hex4(const char *p) {
+    uint32_t u = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        int d = isdigit((unsigned char)c) ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+        if (d < 0) return UINT32_MAX;
+        u = u << 4 | (uint32_t)d;
+    }
+    return u;
+}
+
+/* Decode a JSON string into a new NUL-terminated UTF-8 buffer; NULL if malformed or OOM */
+static char *json_text(str_view v, size_t *len) {
+    const char *p = v.ptr, *end = v.ptr + v.len;
+    
+    if (v.len < 2 || *p != '"' || end[-1] != '"') return NULL;
+    char *out = malloc(v.len), *o = out;
+    if (!out) return NULL;
+    
+    for (p++, end--; p < end; p++) {
+        if (*p != '\\') {
+            *o++ = *p;
+            continue;
+        }
+        if (++p >= end) break;
+        switch (*p) {
+            case 'b': *o++ = '\b'; break;
+            case 'f': *o++ = '\f'; break;
+            case 'n': *o++ = '\n'; break;
+            case 'r': *o++ = '\r'; break;
+            case 't': *o++ = '\t'; break;
+            case 'u': {
+                uint32_t u = end - p > 4 ? json_hex4(p + 1) : UINT32_MAX;
+                if (u == UINT32_MAX) {
+                    free(out);
+                    return NULL;
+                }
+                p += 4;
+                if (u >= 0xD800 && u < 0xDC00 && end - p > 6 && p[1] == '\\' && p[2] == 'u') {
+                    uint32_t low = json_hex4(p + 3);
+                    if (low >= 0xDC00 && low < 0xE000) {
+                        u = 0x10000 + ((u - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    }
+                }
+                if (u >= 0xD800 && u < 0xE000) u = 0xFFFD;  // Lone surrogate
+                
+                // \uXXXX is at least 6 bytes of input, and UTF-8 needs at most 4
+                if (u < 0x80) {
+                    *o++ = (char)u;
+                } else if (u < 0x800) {
+                    *o++ = (char)(0xC0 | u >> 6);
+                    *o++ = (char)(0x80 | (u & 0x3F));
+                } else if (u < 0x10000) {
+                    *o++ = (char)(0xE0 | u >> 12);
+                    *o++ = (char)(0x80 | (u >> 6 & 0x3F));
+                    *o++ = (char)(0x80 | (u & 0x3F));
+                } else {
+                    *o++ = (char)(0xF0 | u >> 18);
+                    *o++ = (char)(0x80 | (u >> 12 & 0x3F));
+                    *o++ = (char)(0x80 | (u >> 6 & 0x3F));
+                    *o++ = (char)(0x80 | (u & 0x3F));
+                }
+                break;
+            }
+            default: *o++ = *p; break;  // \" \\ \/
+        }
+    }
+    *o = '\0';
+    *len = (size_t)(o - out);
+    return out;
+}
+
+/* UTF-16 code units in the UTF-8 text [p, end), the way LSP counts characters */
+static long utf16_units(const char *p, const char *end) {
+    long n = 0;
+    for (; p < end; p++) {
+        unsigned char c = (unsigned char)*p;
+        if ((c & 0xC0) != 0x80) n += c >= 0xF0 ? 2 : 1;
+    }
+    return n;
+}
+
+/* Byte offset of an LSP position in text; past the end of a line clamps to it */
+static size_t lsp_offset(const char *text, size_t len, long line, long character) {
+    const char *p = text, *end = text + len;
+    
+    for (; line > 0 && p < end; line--) {
+        const char *newline = memchr(p, '\n', (size_t)(end - p));
+        p = newline ? newline + 1 : end;
+    }
+    while (p < end && *p != '\n' && character > 0) {
+        unsigned char c = (unsigned char)*p;
+        int n = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        character -= n == 4 ? 2 : 1;
+        for (p++; --n > 0 && p < end && ((unsigned char)*p & 0xC0) == 0x80;) p++;
+    }
+    return (size_t)(p - text);
+}
+
+typedef struct {
+    char *uri;
+    char *text;
+    size_t len;
+    size_t cap;
+    long version;
+    block_cache cache;     // Per-context results of the last validation
+} lsp_document;
+
+typedef struct {
+    lsp_document *docs;
+    size_t count;
+    size_t cap;
+    const validator_options *opts;
+} lsp_server;
+
+static lsp_document *lsp_find(lsp_server *s, const char *uri) {
+    for (size_t i = 0; i < s->count; i++) {
+        if (strcmp(s->docs[i].uri, uri) == 0) return &s->docs[i];
+    }
+    return NULL;
+}
+
+/* Write one framed message, taking the body open_memstream() built */
+static void lsp_send(char *body, size_t len) {
+    printf("Content-Length: %zu\r\n\r\n", len);
+    fwrite(body, 1, len, stdout);
+    fflush(stdout);
+    free(body);
+}
+
+static void lsp_respond(str_view id, const char *result) {
+    char *body = NULL;
+    size_t len = 0;
+    if (!id.len) return;  // A notification gets no response
+    FILE *out = open_memstream(&body, &len);
+    if (!out) return;
+    fprintf(out, "{\"jsonrpc\":\"2.0\",\"id\":%.*s,\"result\":%s}", (int)id.len, id.ptr, result);
+    fclose(out);
+    lsp_send(body, len);
+}
+
+static void lsp_error(str_view id, int code, const char *message) {
+    char *body = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&body, &len);
+    if (!out) return;
+    fprintf(out, "{\"jsonrpc\":\"2.0\",\"id\":%.*s,\"error\":{\"code\":%d,\"message\":",
+            id.len ? (int)id.len : 4, id.len ? id.ptr : "null", code);
+    json_string(out, message);
+    fputs("}}", out);
+    fclose(out);
+    lsp_send(body, len);
+}
+
+/*
+ * Validate a document and publish its diagnostics. Diagnostics come in line
+ * order, so one forward walk over the text turns byte columns into UTF-16.
+ */
+static void lsp_publish(lsp_server *s, lsp_document *doc) {
+    validator_state state = {0};
+    file_result r = {0};
+    size_t skip = bom_length(doc->text, doc->len);
+    
+    state.opts = s->opts;
+    state.resident = &doc->cache;
+    note_line_endings(doc->text + skip, doc->len - skip, &state);
+    validate_resident(doc->text + skip, doc->len - skip, &state);
+    report_line_endings(&state);
+    r.filename = doc->uri;
+    take_result(&r, &state);
+    if (s->opts->check_patterns) check_patterns(&r);
+    if (s->opts->xref) xref_check(&r, 1);
+    if (s->opts->check_globals) globals_check(&r, 1);
+    
+    char *body = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&body, &len);
+    if (!out) {
+        diag_free(&r.diags);
+        return;
+    }
+    fputs("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":", out);
+    json_string(out, doc->uri);
+    fprintf(out, ",\"version\":%ld,\"diagnostics\":[", doc->version);
+    
+    const char *base = doc->text + skip, *end = doc->text + doc->len, *line_start = base;
+    int at_line = 1;
+    for (size_t i = 0; i < r.diags.count; i++) {
+        const diagnostic *item = &r.diags.items[i];
+        const char *message = diag_text(&r.diags, item->message);
+        if (!message) message = diag_info[item->code].description;
+        
+        int line = item->line > 0 ? item->line : 1;
+        if (line < at_line) {
+            line_start = base;  // Late diagnostics are merged in order, but be safe
+            at_line = 1;
+        }
+        for (; at_line < line && line_start < end; at_line++) {
+            const char *newline = memchr(line_start, '\n', (size_t)(end - line_start));
+            line_start = newline ? newline + 1 : end;
+        }
+        const char *eol = memchr(line_start, '\n', (size_t)(end - line_start));
+        if (!eol) eol = end;
+        
+        const char *from = line_start, *to = line_start;
+        if (item->line > 0 && item->column > 0) {
+            from = line_start + item->column - 1;
+            if (from > eol) from = eol;
+            to = from + item->span;
+            if (to > eol) to = eol;
+        }
+        long first = utf16_units(line_start, from), last = first + utf16_units(from, to);
+        fprintf(out, "%s{\"range\":{\"start\":{\"line\":%d,\"character\":%ld},"
+                "\"end\":{\"line\":%d,\"character\":%ld}},\"severity\":%d,\"code\":\"%s\","
+                "\"source\":\"dialplan_validator\",\"message\":",
+                i ? "," : "", line - 1, first, line - 1, last,
+                item->level == DIAG_WARNING ? 2 : 1, diag_info[item->code].id);
+        json_string(out, message);
+        fputc('}', out);
+    }
+    fputs("]}}", out);
+    fclose(out);
+    diag_free(&r.diags);
+    lsp_send(body, len);
+}
+
+static void lsp_publish_empty(const char *uri) {
+    char *body = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&body, &len);
+    if (!out) return;
+    fputs("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":", out);
+    json_string(out, uri);
+    fputs(",\"diagnostics\":[]}}", out);
+    fclose(out);
+    lsp_send(body, len);
+}
+
+/* Replace bytes [from, to) of doc with len bytes of text; 0 on OOM */
+static int lsp_edit(lsp_document *doc, size_t from, size_t to, const char *text, size_t len) {
+    size_t size = doc->len - (to - from) + len;
+    if (size + 1 > doc->cap) {
+        size_t cap = doc->cap ? doc->cap : 4096;
+        while (cap < size + 1) cap *= 2;
+        char *bigger = realloc(doc->text, cap);
+        if (!bigger) return 0;
+        doc->text = bigger;
+        doc->cap = cap;
+    }
+    memmove(doc->text + from + len, doc->text + to, doc->len - to);
+    memcpy(doc->text + from, text, len);
+    doc->len = size;
+    doc->text[size] = '\0';
+    return 1;
+}
+
+static void lsp_did_open(lsp_server *s, str_view msg) {
+    str_view uri_v, text_v, version_v;
+    size_t uri_len, text_len;
+    long version = 0;
+    
+    if (!json_path(msg, "params.textDocument.uri", &uri_v) ||
+        !json_path(msg, "params.textDocument.text", &text_v)) {
+        return;
+    }
+    if (json_path(msg, "params.textDocument.version", &version_v)) json_long(version_v, &version);
+    
+    char *uri = json_text(uri_v, &uri_len), *text = json_text(text_v, &text_len);
+    lsp_document *doc = uri ? lsp_find(s, uri) : NULL;
+    if (uri && text && !doc && s->count == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 8;
+        lsp_document *docs = realloc(s->docs, cap * sizeof(lsp_document));
+        if (docs) {
+            s->docs = docs;
+            s->cap = cap;
+        }
+    }
+    if (!uri || !text || (!doc && s->count == s->cap)) {
+        free(uri);
+        free(text);
+        return;
+    }
+    if (doc) {
+        free(uri);
+        free(doc->text);
+    } else {
+        doc = &s->docs[s->count++];
+        memset(doc, 0, sizeof(*doc));
+        doc->uri = uri;
+    }
+    doc->text = text;
+    doc->len = text_len;
+    doc->cap = text_len + 1;
+    doc->version = version;
+    lsp_publish(s, doc);
+}
+
+static void lsp_did_change(lsp_server *s, str_view msg) {
+    str_view uri_v, version_v, changes;
+    size_t uri_len;
+    
+    if (!json_path(msg, "params.textDocument.uri", &uri_v) ||
+        !json_path(msg, "params.contentChanges", &changes) || !changes.len || changes.ptr[0] != '[') {
+        return;
+    }
+    char *uri = json_text(uri_v, &uri_len);
+    lsp_document *doc = uri ? lsp_find(s, uri) : NULL;
+    free(uri);
+    if (!doc) return;
+    if (json_path(msg, "params.textDocument.version", &version_v)) json_long(version_v, &doc->version);
+    
+    // Each change applies to the text the previous one left
+    const char *p = json_ws(changes.ptr + 1, changes.ptr + changes.len), *end = changes.ptr + changes.len;
+    while (p < end && *p == '{') {
+        const char *stop = json_skip(p, end);
+        if (!stop) break;
+        str_view change = make_view(p, (size_t)(stop - p)), text_v, range;
+        size_t len;
+        char *text = json_member(change, "text", &text_v) ? json_text(text_v, &len) : NULL;
+        if (!text) break;
+        
+        size_t from = 0, to = doc->len;
+        if (json_member(change, "range", &range)) {
+            str_view v;
+            long l0 = 0, c0 = 0, l1 = 0, c1 = 0;
+            if (json_path(range, "start.line", &v)) json_long(v, &l0);
+            if (json_path(range, "start.character", &v)) json_long(v, &c0);
+            if (json_path(range, "end.line", &v)) json_long(v, &l1);
+            if (json_path(range, "end.character", &v)) json_long(v, &c1);
+            from = lsp_offset(doc->text, doc->len, l0, c0);
+            to = lsp_offset(doc->text, doc->len, l1, c1);
+            if (to < from) to = from;
+        }
+        int ok = lsp_edit(doc, from, to, text, len);
+        free(text);
+        if (!ok) break;
+        p = *stop == ',' ? json_ws(stop + 1, end) : stop;
+    }
+    lsp_publish(s, doc);
+}
+
+static void lsp_did_close(lsp_server *s, str_view msg) {
+    str_view uri_v;
+    size_t uri_len;
+    
+    if (!json_path(msg, "params.textDocument.uri", &uri_v)) return;
+    char *uri = json_text(uri_v, &uri_len);
+    lsp_document *doc = uri ? lsp_find(s, uri) : NULL;
+    free(uri);
+    if (!doc) return;
+    
+    lsp_publish_empty(doc->uri);
+    free(doc->uri);
+    free(doc->text);
+    cache_free(&doc->cache);
+    *doc = s->docs[--s->count];
+}
+
+/* Next message body from stdin into *body; 0 at end of input */
+static int lsp_read(char **body, size_t *cap, size_t *len) {
+    char header[1024];
+    long length = -1;
+    
+    while (fgets(header, sizeof(header), stdin)) {
+        if (header[0] == '\r' || header[0] == '\n') {
+            if (length < 0) continue;  // Blank line before any header
+            if (length > LSP_MAX_MESSAGE) return 0;
+            if ((size_t)length + 1 > *cap) {
+                char *bigger = realloc(*body, (size_t)length + 1);
+                if (!bigger) return 0;
+                *body = bigger;
+                *cap = (size_t)length + 1;
+            }
+            if (fread(*body, 1, (size_t)length, stdin) != (size_t)length) return 0;
+            (*body)[length] = '\0';
+            *len = (size_t)length;
+            return 1;
+        }
+        if (strncasecmp(header, "Content-Length:", 15) == 0) length = strtol(header + 15, NULL, 10);
+    }
+    return 0;
+}
+
+/* Serve until the client sends exit (0 after shutdown, as LSP asks) or stdin ends */
+static int lsp_serve(const validator_options *opts) {
+    lsp_server s = { NULL, 0, 0, opts };
+    char *body = NULL;
+    size_t cap = 0, len = 0;
+    int shutdown = 0, status = 1;
+    
+    while (lsp_read(&body, &cap, &len)) {
+        str_view msg = make_view(body, len), method_v, id = NO_VIEW;
+        size_t method_len;
+        
+        // Members are found as they are needed; a whole document is only checked this far
+        const char *first = json_ws(msg.ptr, msg.ptr + msg.len);
+        if (first == msg.ptr + msg.len || *first != '{') {
+            lsp_error(NO_VIEW, -32700, "Parse error");
+            continue;
+        }
+        json_member(msg, "id", &id);
+        char *method = json_member(msg, "method", &method_v) ? json_text(method_v, &method_len) : NULL;
+        if (!method) {
+            if (id.len) lsp_error(id, -32600, "Invalid request");
+            continue;  // A response to something we never send, or junk
+        }
+        
+        if (strcmp(method, "initialize") == 0) {
+            lsp_respond(id, "{\"capabilities\":{\"textDocumentSync\":{\"openClose\":true,\"change\":2}},"
+                            "\"serverInfo\":{\"name\":\"dialplan_validator\",\"version\":\"" VERSION "\"}}");
+        } else if (strcmp(method, "shutdown") == 0) {
+            shutdown = 1;
+            lsp_respond(id, "null");
+        } else if (strcmp(method, "exit") == 0) {
+            free(method);
+            status = shutdown ? 0 : 1;
+            break;
+        } else if (strcmp(method, "textDocument/didOpen") == 0) {
+            lsp_did_open(&s, msg);
+        } else if (strcmp(method, "textDocument/didChange") == 0) {
+            lsp_did_change(&s, msg);
+        } else if (strcmp(method, "textDocument/didClose") == 0) {
+            lsp_did_close(&s, msg);
+        } else if (id.len) {
+            lsp_error(id, -32601, "Method not found");
+        }
+        free(method);
+    }
+    
+    for (size_t i = 0; i < s.count; i++) {
+        free(s.docs[i].uri);
+        free(s.docs[i].text);
+        cache_free(&s.docs[i].cache);
+    }
+    free(s.docs);
+    free(body);
+    return status;
+}
+
+/*
+ * Library interface (dialplan_validator.h). A context is an options block
+ * that nothing writes after it is made; each call gets a fresh
+ * validator_state, so calls on one context can run in any number of threads.
+ */
+struct dpv_context {
+    validator_options opts;
+};
+
+/* What a dpv_result owns: the diagnostics whose text the items point into */
 typedef struct {
-    int errors;
-    int warnings;
-    int line_num;
-    char current_context[MAX_VAR_NAME];
-} validator_state;
+    file_result result;
+    dpv_diagnostic items[];
+} dpv_storage;
 
-/* Trim leading/trailing whitespace */
-static char *trim(char *str) {
-    char *end;
-    while (isspace(*str)) str++;
-    if (*str == 0) return str;
-    end = str + strlen(str) - 1;
-    while (end > str && isspace(*end)) end--;
-    *(end + 1) = 0;
-    return str;
+dpv_context *dpv_context_new(const dpv_options *opts) {
+    dpv_context *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) return NULL;
+    
+    ctx->opts.format = FORMAT_TEXT;
+    ctx->opts.jobs = 1;
+    if (opts) {
+        if (opts->jobs > 1) ctx->opts.jobs = opts->jobs;
+        if (opts->max_errors > 0) ctx->opts.max_errors = opts->max_errors;
+        ctx->opts.xref = opts->xref != 0;
+        ctx->opts.index = ctx->opts.xref;
+        ctx->opts.check_patterns = opts->check_patterns != 0;
+        ctx->opts.check_globals = opts->check_globals != 0;
+        ctx->opts.check_apps = opts->check_apps != 0;
+    }
+    return ctx;
 }
 
-/* Check if line is a comment or blank */
-static int is_comment_or_blank(const char *line) {
-    while (isspace(*line)) line++;
-    return (*line == ';' || *line == '\0' || *line == '#');
+void dpv_context_free(dpv_context *ctx) {
+    free(ctx);
 }
 
-/* Check balanced delimiters - EXCLUDES quotes (too context-sensitive in Asterisk) */
-static int check_balanced(const char *str, validator_state *state) {
-    int parens = 0, brackets = 0, braces = 0;
+int dpv_validate_buffer(const char *buf, size_t len, const dpv_context *ctx, dpv_result *result) {
+    validator_state state = {0};
+    file_result r = {0};
     
-    for (const char *p = str; *p; p++) {
-        switch (*p) {
-            case '(': parens++; break;
-            case ')': parens--; break;
-            case '[': brackets++; break;
-            case ']': brackets--; break;
-            case '{': braces++; break;
-            case '}': braces--; break;
-        }
-        
-        // Check for negative counts (too many closing delimiters)
-        if (parens < 0 || brackets < 0 || braces < 0) {
-            fprintf(stderr, "Line %d: Unbalanced delimiters (too many closing)\n", 
-                    state->line_num);
-            state->errors++;
-            return 0;
-        }
-    }
+    memset(result, 0, sizeof(*result));
+    state.opts = &ctx->opts;
+    size_t skip = bom_length(buf, len);
+    note_line_endings(buf + skip, len - skip, &state);
+    if (!validate_chunked(buf + skip, len - skip, &state)) validate_buffer(buf + skip, len - skip, &state);
+    report_line_endings(&state);
+    r.filename = "<buffer>";
+    take_result(&r, &state);
+    if (ctx->opts.check_patterns) check_patterns(&r);
+    if (ctx->opts.xref) xref_check(&r, 1);
+    if (ctx->opts.check_globals) globals_check(&r, 1);
     
-    // Check final balance
-    if (parens != 0 || brackets != 0 || braces != 0) {
-        fprintf(stderr, "Line %d: Unbalanced delimiters (parens=%d, brackets=%d, braces=%d)\n",
-                state->line_num, parens, brackets, braces);
-        state->errors++;
-        return 0;
+    dpv_storage *s = malloc(sizeof(*s) + r.diags.count * sizeof(dpv_diagnostic));
+    if (!s) {
+        diag_free(&r.diags);
+        return -1;
+    }
+    s->result = r;
+    for (size_t i = 0; i < r.diags.count; i++) {
+        const diagnostic *item = &r.diags.items[i];
+        dpv_diagnostic *out = &s->items[i];
+        out->code = diag_info[item->code].id;
+        out->message = diag_text(&r.diags, item->message);
+        if (!out->message) out->message = diag_info[item->code].description;
+        out->context = diag_text(&r.diags, item->context);
+        out->level = item->level == DIAG_WARNING ? DPV_WARNING : DPV_ERROR;
+        out->line = item->line;
+        out->column = item->column;
+        out->span = item->span;
     }
     
-    return 1;
+    result->errors = r.errors;
+    result->warnings = r.warnings;
+    result->stopped = r.stopped;
+    result->lines = r.lines;
+    result->count = r.diags.count;
+    result->items = s->items;
+    result->internal = s;
+    return r.errors;
 }
 
-/* Validate variable syntax ${...} and $[...] */
-static int check_variable_syntax(const char *str, validator_state *state) {
-    const char *p = str;
-    int valid = 1;
-    
-    while ((p = strchr(p, '$')) != NULL) {
-        if (*(p+1) == '{') {
-            // Found ${, look for closing }
-            int brace_count = 1;
-            p += 2;
-            
-            while (*p && brace_count > 0) {
-                if (*p == '{') brace_count++;
-                else if (*p == '}') brace_count--;
-                p++;
-            }
-            
-            if (brace_count != 0) {
-                fprintf(stderr, "Line %d: Unclosed ${...} variable reference\n", 
-                        state->line_num);
-                state->errors++;
-                valid = 0;
-            }
-        } else if (*(p+1) == '[') {
-            // Found $[, look for closing ]
-            int bracket_count = 1;
-            p += 2;
-            
-            while (*p && bracket_count > 0) {
-                if (*p == '[') bracket_count++;
-                else if (*p == ']') bracket_count--;
-                p++;
-            }
-            
-            if (bracket_count != 0) {
-                fprintf(stderr, "Line %d: Unclosed $[...] expression\n", 
-                        state->line_num);
-                state->errors++;
-                valid = 0;
-            }
-        } else {
-            p++;
-        }
+void dpv_result_free(dpv_result *result) {
+    dpv_storage *s = result->internal;
+    if (s) {
+        diag_free(&s->result.diags);
+        free(s);
     }
-    
-    return valid;
+    memset(result, 0, sizeof(*result));
 }
 
-/* Parse context line [context-name] */
-static int parse_context(char *line, validator_state *state) {
-    char *end = strchr(line, ']');
-    if (!end) {
-        fprintf(stderr, "Line %d: Malformed context (missing ']')\n", state->line_num);
-        state->errors++;
-        return 0;
-    }
+/*
+ * Fuzzing entry point for libFuzzer or AFL++ (-DDPV_FUZZ leaves out main):
+ *   clang -g -O1 -fsanitize=fuzzer,address,undefined -DDPV_FUZZ dialplan_validator.c -pthread -o dpv_fuzz
+ *   ./dialplan_validator --generate 500 --mix stress=5 > corpus/generated.conf
+ *   ./dpv_fuzz -max_len=65536 corpus
+ * The first byte picks the checks, so one corpus covers them all, and the
+ * rest is the dialplan. Besides crashes and sanitizer reports, it aborts
+ * when a result contradicts itself: counts that don't match the items, or
+ * a diagnostic placed outside its line.
+ */
+#ifdef DPV_FUZZ
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    dpv_options o = {0};
+    dpv_result result;
     
-    *end = '\0';
-    char *context = trim(line + 1);
+    if (size == 0) return 0;
+    o.xref = data[0] & 1;
+    o.check_patterns = (data[0] >> 1) & 1;
+    o.check_globals = (data[0] >> 2) & 1;
+    o.check_apps = (data[0] >> 3) & 1;
+    o.max_errors = (data[0] >> 4) & 3;
+    const char *text = (const char *)data + 1;
+    size_t len = size - 1;
     
-    if (strlen(context) == 0) {
-        fprintf(stderr, "Line %d: Empty context name\n", state->line_num);
-        state->errors++;
-        return 0;
+    dpv_context *ctx = dpv_context_new(&o);
+    if (!ctx) return 0;
+    int n = dpv_validate_buffer(text, len, ctx, &result);
+    if (n >= 0) {
+        int errors = 0, warnings = 0;
+        for (size_t i = 0; i < result.count; i++) {
+            const dpv_diagnostic *d = &result.items[i];
+            if (d->level == DPV_ERROR) errors++;
+            else warnings++;
+            if (!d->code || !d->message || d->line < 0 || d->line > result.lines || d->column < 0 || d->span < 0) abort();
+            if (d->line == 0 || d->column == 0) continue;
+            
+            // The line's text, to check the diagnostic lies within it
+            const char *p = text, *end = text + len;
+            for (int line = 1; line < d->line && p; line++) {
+                p = memchr(p, '\n', (size_t)(end - p));
+                if (p) p++;
+            }
+            if (!p) abort();
+            const char *eol = memchr(p, '\n', (size_t)(end - p));
+            size_t width = (size_t)((eol ? eol : end) - p);
+            if ((size_t)d->column - 1 + (size_t)d->span > width + 1) abort();
+        }
+        if (n != result.errors || errors != result.errors || warnings != result.warnings) abort();
     }
-    
-    strncpy(state->current_context, context, MAX_VAR_NAME - 1);
-    return 1;
+    dpv_result_free(&result);
+    dpv_context_free(ctx);
+    return 0;
 }
+#endif
 
-/* 
- * Extract label from priority string and validate priority
- * This mimics Asterisk's logic in pbx_config.c
- * 
- * Asterisk logic:
- *   if (strchr(pri, '(')) {
- *       char *lparen = strchr(pri, '(');
- *       char *rparen = strchr(lparen, ')');
- *       if (rparen) {
- *           *lparen = '\0';
- *           lparen++;
- *           *rparen = '\0';
- *           label = lparen;
- *       }
- *   }
+/* Number of worker threads for --jobs 0 (auto) */
+static int default_jobs(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Asterisk Dialplan Validator v%s\n", VERSION);
+    fprintf(stderr, "Usage: %s [options] <extensions.conf> [more.conf ...]\n", prog);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Examples:\n");
+    fprintf(stderr, "  %s /etc/asterisk/extensions.conf\n", prog);
+    fprintf(stderr, "  %s /etc/asterisk/extensions-test.conf\n", prog);
+    fprintf(stderr, "  %s --jobs 8 /etc/asterisk/extensions_*.conf\n", prog);
+    fprintf(stderr, "  generate-dialplan | %s -\n", prog);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Exit codes:\n");
+    fprintf(stderr, "  0 = Syntax valid\n");
+    fprintf(stderr, "  1 = Syntax errors found or file not found\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "For help: %s --help\n", prog);
+}
+
+static void print_help(const char *prog) {
+    printf("Asterisk Dialplan Validator v%s\n", VERSION);
+    printf("Based on actual Asterisk pbx_config.c parsing logic\n");
+    printf("\n");
+    printf("Usage: %s [options] <extensions.conf> [more.conf ...]\n", prog);
+    printf("\n");
+    printf("Options:\n");
+    printf("  -j, --jobs N          Validate files on N threads (default: one per CPU)\n");
+    printf("  --format FORMAT       Output format: text (default), json, or sarif\n");
+    printf("  --max-errors N        Stop checking a file after N errors\n");
+    printf("  --cache DIR           Reuse results for unchanged [context] blocks\n");
+    printf("  --watch               Re-check files as they change and print what changed\n");
+    printf("  --lsp                 Run as a language server on stdin/stdout (editors)\n");
+    printf("  --emit-snapshot FILE  Also write the results and the --xref index to FILE\n");
+    printf("  --read-snapshot FILE  Print a snapshot's results without reading its sources\n");
+    printf("  --diff OLD NEW        List contexts, extensions and includes that differ (files or snapshots)\n");
+    printf("  --dir DIR             Validate DIR/extensions*.conf and DIR/extensions*.d/*.conf\n");
+    printf("  --includes            Also validate files named by #include / #tryinclude\n");
+    printf("  --xref                Check include => and Goto/Gosub targets exist\n");
+    printf("  --check-patterns      Find duplicate priorities and patterns that are never used\n");
+    printf("  --check-globals       Find ${VAR} references to variables nothing sets\n");
+    printf("  --check-apps          Find unknown applications and functions, wrong argument counts\n");
+    printf("  --app-registry FILE   More applications and functions for --check-apps, one per line\n");
+    printf("  --app-table           Print the built-in application table as C, laid out again\n");
+    printf("  --stats               Report time and lines per validation stage on stderr\n");
+    printf("  --profile-contexts N  Report the N contexts that took longest, with their size\n");
+    printf("  --bench               Time validating the files (best of %d runs) and report\n", BENCH_RUNS);
+    printf("  --min-rate N          With --bench, fail (exit 1) below N lines/s\n");
+    printf("  --generate N          Write a synthetic N-line dialplan to stdout\n");
+    printf("  --mix SPEC            Its line mix in percent, e.g. set=10,nest=5,label=10,context=1,stress=1\n");
+    printf("\n");
+    printf("What it validates:\n");
+    printf("  ✓ Context definitions [context-name]\n");
+    printf("  ✓ Extension syntax: exten => pattern,priority,app(args)\n");
+    printf("  ✓ Continuation syntax: same => priority,app(args)\n");
+    printf("  ✓ Priority labels: n(label), 1(start), etc.\n");
+    printf("  ✓ Balanced parentheses, brackets, braces\n");
+    printf("  ✓ Variable syntax ${VAR} and $[EXPR]\n");
+    printf("  ✓ Expression operators and ? :: pairs in $[EXPR]\n");
+    printf("  ✓ Priority values (must be >=1, 'n', or 'hint')\n");
+    printf("  ✓ Priority sequence: 'same' after an 'exten', no priority or label twice\n");
+    printf("  ✓ Include and switch statements\n");
+    printf("\n");
+    printf("Examples:\n");
+    printf("  %s /etc/asterisk/extensions.conf\n", prog);
+    printf("  %s /etc/asterisk/extensions-test.conf\n", prog);
+    printf("  %s --jobs 8 /etc/asterisk/extensions_*.conf\n", prog);
+    printf("  %s --dir /etc/asterisk\n", prog);
+    printf("  generate-dialplan | %s -      (- reads standard input)\n", prog);
+    printf("\n");
+    printf("Supported priority formats:\n");
+    printf("  n              - Next priority\n");
+    printf("  n(label)       - Next priority with label\n");
+    printf("  1              - Explicit priority\n");
+    printf("  1(start)       - Explicit priority with label\n");
+    printf("  hint           - Hint priority\n");
+    printf("\n");
+    printf("Exit codes:\n");
+    printf("  0 = Syntax valid\n");
+    printf("  1 = Syntax errors found or file not found\n");
+    printf("\n");
+    printf("Note: Quote checking is intentionally disabled as Asterisk handles\n");
+    printf("      quotes in a context-dependent way that varies by application.\n");
+    printf("      Apostrophes in text (e.g., \"It's working\") are valid.\n");
+    printf("\n");
+    printf("GitHub: https://github.com/calvintwells/dialplan_validator\n");
+    printf("License: MIT\n");
+}
+
+/* Parse a non-negative count up to max; returns -1 if s isn't one */
+static int parse_count(const char *s, long max) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || n < 0 || n > max) return -1;
+    return (int)n;
+}
+
+/*
+ * Match an option that takes a value: "--name VALUE", "--name=VALUE" and,
+ * if short_name is given, "-x VALUE" / "-xVALUE". Returns 0 if arg is not
+ * this option, 1 with *value set, or -1 if the value is missing.
  */
-static int validate_priority_with_label(char *priority_str, validator_state *state) {
-    char *label = NULL;
-    char *pri_part = priority_str;
-    
-    // Check if priority contains a label: n(label) or 1(label)
-    char *lparen = strchr(priority_str, '(');
-    if (lparen) {
-        char *rparen = strchr(lparen, ')');
-        if (!rparen) {
-            fprintf(stderr, "Line %d: Unclosed '(' in priority label\n", state->line_num);
-            state->errors++;
-            return 0;
-        }
-        
-        // Extract label (between parentheses)
-        *lparen = '\0';
-        label = lparen + 1;
-        *rparen = '\0';
-        
-        // Now pri_part is just the priority without label
-        pri_part = trim(priority_str);
-        
-        // Validate label is not empty
-        if (strlen(label) == 0) {
-            fprintf(stderr, "Line %d: Empty label in priority\n", state->line_num);
-            state->errors++;
-            return 0;
-        }
-    }
+static int option_value(int argc, char *argv[], int *i, const char *name,
+                        const char *short_name, const char **value) {
+    const char *arg = argv[*i];
+    size_t n = strlen(name);
     
-    // Validate the priority part (without label)
-    // Valid formats: 'hint', 'n', or a positive integer
-    
-    if (strcmp(pri_part, "hint") == 0) {
-        return 1;  // 'hint' is valid
+    if (strcmp(arg, name) == 0 || (short_name && strcmp(arg, short_name) == 0)) {
+        if (*i + 1 >= argc) return -1;
+        *value = argv[++*i];
+        return 1;
     }
-    
-    if (strcmp(pri_part, "n") == 0) {
-        return 1;  // 'n' (next) is valid
+    if (strncmp(arg, name, n) == 0 && arg[n] == '=') {
+        *value = arg + n + 1;
+        return 1;
     }
-    
-    // Must be a positive integer
-    char *endptr;
-    long pri = strtol(pri_part, &endptr, 10);
-    
-    if (*endptr != '\0') {
-        fprintf(stderr, "Line %d: Invalid priority '%s' (must be number, 'n', or 'hint')\n",
-                state->line_num, priority_str);
-        state->errors++;
-        return 0;
+    if (short_name && strncmp(arg, short_name, 2) == 0 && arg[2] != '\0') {
+        *value = arg + 2;
+        return 1;
     }
-    
-    if (pri < 1) {
-        fprintf(stderr, "Line %d: Priority must be >= 1\n", state->line_num);
-        state->errors++;
-        return 0;
+    return 0;
+}
+
+static int bad_option(const char *name, int matched, const char *value) {
+    if (matched < 0) {
+        fprintf(stderr, "Error: %s requires a value\n", name);
+    } else {
+        fprintf(stderr, "Error: Invalid value for %s: '%s'\n", name, value);
     }
-    
     return 1;
 }
 
-/* Parse extension line: exten => pattern,priority,app(args) OR same => priority,app(args) */
-static int parse_extension(char *line, validator_state *state) {
-    char *arrow = strstr(line, "=>");
-    if (!arrow) {
-        fprintf(stderr, "Line %d: Missing '=>' in extension definition\n", state->line_num);
-        state->errors++;
-        return 0;
+/*
+ * Input names. --dir DIR stands for DIR/extensions*.conf plus the fragments
+ * in DIR/extensions*.d/, and a name with wildcards that isn't itself a file
+ * is expanded here, for callers without a shell or with more files than fit
+ * on a command line. Expanded names are owned by the list.
+ */
+typedef struct {
+    const char **names;
+    char **owned;      // Parallel to names; NULL for argv strings
+    int count;
+    int cap;
+} file_list;
+
+static int list_add(file_list *l, const char *name, char *owned) {
+    if (l->count == l->cap) {
+        int cap = l->cap ? l->cap * 2 : 16;
+        const char **names = realloc(l->names, (size_t)cap * sizeof(*names));
+        if (!names) return 0;
+        l->names = names;
+        char **own = realloc(l->owned, (size_t)cap * sizeof(*own));
+        if (!own) return 0;
+        l->owned = own;
+        l->cap = cap;
     }
+    l->names[l->count] = name;
+    l->owned[l->count++] = owned;
+    return 1;
+}
+
+/* Add the matches of pattern in sorted order; how many, or -1 if out of memory */
+static int list_glob(file_list *l, const char *pattern) {
+    glob_t matches;
+    int n = 0;
     
-    // Check if it's 'exten' or 'same'
-    char *keyword = line;
-    while (isspace(*keyword)) keyword++;
+    if (glob(pattern, 0, NULL, &matches) != 0) return 0;
+    for (size_t i = 0; i < matches.gl_pathc; i++, n++) {
+        char *name = strdup(matches.gl_pathv[i]);
+        if (!name || !list_add(l, name, name)) {
+            free(name);
+            n = -1;
+            break;
+        }
+    }
+    globfree(&matches);
+    return n;
+}
+
+static void list_free(file_list *l) {
+    for (int i = 0; i < l->count; i++) free(l->owned[i]);
+    free(l->names);
+    free(l->owned);
+}
+
+/*
+ * --app-registry FILE: one name per line, NAME for an application or
+ * NAME() for a function, optionally followed by the least and most number
+ * of arguments it takes; ';' or '#' starts a comment. Returns 0 after
+ * printing why if the file can't be used.
+ */
+static int app_registry_load(app_registry *reg, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    size_t len = 0, cap = 0, lines = 1;
+    int line = 0;
     
-    int is_same = 0;
-    if (strncasecmp(keyword, "exten", 5) == 0) {
-        is_same = 0;
-    } else if (strncasecmp(keyword, "same", 4) == 0) {
-        is_same = 1;
-    } else {
-        fprintf(stderr, "Line %d: Unknown keyword (expected 'exten' or 'same')\n", 
-                state->line_num);
-        state->errors++;
+    memset(reg, 0, sizeof(*reg));
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open app registry '%s': %s\n", path, strerror(errno));
         return 0;
     }
-    
-    // Parse data after =>
-    char *data = arrow + 2;
-    data = trim(data);
-    
-    // Split by commas (but respect balanced delimiters)
-    char *comma1 = NULL, *comma2 = NULL;
-    int parens = 0, brackets = 0;
-    
-    for (char *p = data; *p; p++) {
-        if (*p == '(') parens++;
-        else if (*p == ')') parens--;
-        else if (*p == '[') brackets++;
-        else if (*p == ']') brackets--;
-        else if (*p == ',' && parens == 0 && brackets == 0) {
-            if (!comma1) {
-                comma1 = p;
-            } else if (!comma2) {
-                comma2 = p;
-                break;
-            }
+    for (;;) {
+        if (len + 4096 + 1 > cap) {
+            char *text = realloc(reg->text, cap = (cap ? cap * 2 : 8192));
+            if (!text) break;
+            reg->text = text;
         }
+        size_t n = fread(reg->text + len, 1, cap - len - 1, fp);
+        if (n == 0) break;
+        len += n;
     }
+    int failed = ferror(fp) || !reg->text;
+    fclose(fp);
+    if (failed) {
+        fprintf(stderr, "Error: Cannot read app registry '%s'\n", path);
+        return 0;
+    }
+    reg->text[len] = '\0';
+    reg->fingerprint = hash_bytes(reg->text, len, 0);
+    for (size_t i = 0; i < len; i++) lines += reg->text[i] == '\n';
     
-    // Validation based on type
-    if (is_same) {
-        // same => priority,app(args)  (only 1 comma required)
-        if (!comma1) {
-            fprintf(stderr, "Line %d: 'same' must have format: same => priority,app(args)\n",
-                    state->line_num);
-            state->errors++;
-            return 0;
-        }
-        
-        *comma1 = '\0';
-        char *priority_str = trim(data);
-        char *app = trim(comma1 + 1);
+    reg->items = calloc(lines, sizeof(app_info));
+    for (reg->slots_cap = 16; reg->slots_cap < lines * 2; reg->slots_cap *= 2) {}
+    reg->slots = calloc(reg->slots_cap, sizeof(uint32_t));
+    if (!reg->items || !reg->slots) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 0;
+    }
+    
+    for (char *p = reg->text, *next; p; p = next) {
+        char *eol = strchr(p, '\n');
+        long min = 0, max = -1;
+        int function = 0;
         
-        // Validate priority (may contain label)
-        if (!validate_priority_with_label(priority_str, state)) {
-            return 0;
-        }
+        line++;
+        next = eol ? eol + 1 : NULL;
+        if (eol) *eol = '\0';
+        p[strcspn(p, ";#")] = '\0';
         
-        // Check if app has parentheses for arguments
-        if (strlen(app) > 0) {
-            char *paren = strchr(app, '(');
-            if (paren) {
-                if (!check_balanced(app, state)) {
-                    return 0;
-                }
-            }
+        char *name = strtok(p, " \t\r"), *lo = strtok(NULL, " \t\r"), *hi = strtok(NULL, " \t\r");
+        if (!name) continue;
+        size_t n = strlen(name);
+        if (n > 2 && strcmp(name + n - 2, "()") == 0) {
+            name[n -= 2] = '\0';
+            function = 1;
         }
-        
-        // Check variable syntax
-        check_variable_syntax(app, state);
-        
-    } else {
-        // exten => pattern,priority,app(args)  (2 commas required)
-        if (!comma1 || !comma2) {
-            fprintf(stderr, "Line %d: 'exten' must have format: exten => pattern,priority,app(args)\n",
-                    state->line_num);
-            state->errors++;
+        int ok = n > 0 && !strtok(NULL, " \t\r");
+        for (size_t i = 0; i < n && ok; i++) ok = isalnum((unsigned char)name[i]) || name[i] == '_';
+        if (ok && lo) ok = (min = parse_count(lo, 127)) >= 0;
+        if (ok && hi) ok = (max = parse_count(hi, 127)) >= min;
+        if (!ok) {
+            fprintf(stderr, "Error: %s:%d: expected NAME or NAME() and up to two argument counts\n", path, line);
             return 0;
         }
         
-        *comma1 = '\0';
-        *comma2 = '\0';
+        app_info *a = &reg->items[reg->count];
+        a->name = name;
+        a->min_args = (int8_t)min;
+        a->max_args = (int8_t)max;
+        a->function = (uint8_t)function;
         
-        // Pattern is in 'data'
-        trim(data);
-        char *priority_str = trim(comma1 + 1);
-        char *app = trim(comma2 + 1);
+        // A name given twice keeps its last line
+        size_t i = app_hash(name, n, function) & (reg->slots_cap - 1);
+        while (reg->slots[i] && !app_matches(&reg->items[reg->slots[i] - 1], make_view(name, n), function)) {
+            i = (i + 1) & (reg->slots_cap - 1);
+        }
+        if (reg->slots[i]) {
+            reg->items[reg->slots[i] - 1] = *a;
+        } else {
+            reg->slots[i] = (uint32_t)++reg->count;
+        }
+    }
+    return 1;
+}
+
+static void app_registry_free(app_registry *reg) {
+    free(reg->items);
+    free(reg->slots);
+    free(reg->text);
+    memset(reg, 0, sizeof(*reg));
+}
+
+static int compare_bucket_sizes(const void *a, const void *b) {
+    const size_t *x = a, *y = b;   // { size, bucket }
+    return x[0] != y[0] ? (x[0] < y[0]) - (x[0] > y[0]) : (x[1] > y[1]) - (x[1] < y[1]);
+}
+
+/*
+ * --app-table: lay app_table[] out again and print it as C. Buckets are
+ * placed largest first, each with the first displacement that sends all
+ * its names to free slots; with too few buckets for that, there are more.
+ */
+static int print_app_table(void) {
+    size_t n = APP_COUNT;
+    uint64_t *hash = malloc(n * sizeof(uint64_t));
+    size_t *order = malloc(n * 2 * sizeof(size_t));
+    size_t *slot_of = malloc(n * sizeof(size_t));
+    uint8_t *displace = malloc(n);
+    unsigned char *taken = malloc(n);
+    size_t buckets = 0;
+    int status = 1;
+    
+    if (!hash || !order || !slot_of || !displace || !taken) {
+        fprintf(stderr, "Error: Out of memory\n");
+        goto done;
+    }
+    for (size_t i = 0; i < n; i++) {
+        hash[i] = app_hash(app_table[i].name, strlen(app_table[i].name), app_table[i].function);
+    }
+    
+    for (buckets = (n + 3) / 4; buckets <= n; buckets++) {
+        int placed = 1;
         
-        // Validate priority (may contain label)
-        if (!validate_priority_with_label(priority_str, state)) {
-            return 0;
+        for (size_t b = 0; b < buckets; b++) {
+            order[b * 2] = 0;
+            order[b * 2 + 1] = b;
         }
+        for (size_t i = 0; i < n; i++) order[(hash[i] >> 32) % buckets * 2]++;
+        qsort(order, buckets, 2 * sizeof(size_t), compare_bucket_sizes);
+        memset(taken, 0, n);
+        memset(displace, 0, buckets);
         
-        // Check if app has parentheses for arguments
-        if (strlen(app) > 0) {
-            char *paren = strchr(app, '(');
-            if (paren) {
-                if (!check_balanced(app, state)) {
-                    return 0;
+        for (size_t k = 0; k < buckets && placed && order[k * 2]; k++) {
+            size_t b = order[k * 2 + 1];
+            int d;
+            
+            for (d = 0; d < 256; d++) {
+                size_t i;
+                displace[b] = (uint8_t)d;
+                for (i = 0; i < n; i++) {
+                    if ((hash[i] >> 32) % buckets != b) continue;
+                    size_t s = app_slot(hash[i], displace, buckets, n);
+                    if (taken[s]) break;
+                    taken[s] = 2;   // Tentative
+                    slot_of[i] = s;
+                }
+                for (size_t j = 0; j < n; j++) {
+                    if (taken[j] == 2) taken[j] = i == n ? 1 : 0;
                 }
+                if (i == n) break;
             }
+            if (d == 256) placed = 0;
         }
-        
-        // Check variable syntax
-        check_variable_syntax(app, state);
+        if (placed) break;
     }
-    
-    return 1;
-}
-
-/* Parse include line */
-static int parse_include(char *line, validator_state *state) {
-    char *arrow = strstr(line, "=>");
-    if (!arrow) {
-        fprintf(stderr, "Line %d: Missing '=>' in include statement\n", state->line_num);
-        state->errors++;
-        return 0;
+    if (buckets > n) {
+        fprintf(stderr, "Error: No perfect hash found for the application table\n");
+        goto done;
     }
     
-    char *context = trim(arrow + 2);
-    if (strlen(context) == 0) {
-        fprintf(stderr, "Line %d: Empty context in include statement\n", state->line_num);
-        state->errors++;
-        return 0;
+    printf("#define APP_BUCKETS %zu\n\nstatic const app_info app_table[] = {\n", buckets);
+    for (size_t s = 0; s < n; s++) {
+        for (size_t i = 0; i < n; i++) {
+            if (slot_of[i] != s) continue;
+            printf("    { \"%s\", %d, %d, %d },\n", app_table[i].name, app_table[i].min_args,
+                   app_table[i].max_args, app_table[i].function);
+        }
     }
+    printf("};\n\nstatic const uint8_t app_displace[APP_BUCKETS] = {");
+    for (size_t b = 0; b < buckets; b++) printf("%s%u%s", b % 16 ? " " : "\n    ", displace[b], b + 1 < buckets ? "," : "\n");
+    printf("};\n");
+    status = 0;
     
-    return 1;
+done:
+    free(hash);
+    free(order);
+    free(slot_of);
+    free(displace);
+    free(taken);
+    return status;
 }
 
-/* Main validator */
-static int validate_dialplan(const char *filename) {
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open file '%s'\n", filename);
+int dpv_main(int argc, char *argv[]) {
+    if (argc < 2) {
+        print_usage(argv[0]);
         return 1;
     }
     
-    validator_state state = {0};
-    char line[MAX_LINE];
-    int in_context = 0;
+    // Check for help flags
+    if (argc == 2 && strcmp(argv[1], "help") == 0) {
+        print_help(argv[0]);
+        return 0;
+    }
     
-    while (fgets(line, sizeof(line), fp)) {
-        state.line_num++;
-        
-        // Remove newline
-        char *newline = strchr(line, '\n');
-        if (newline) *newline = '\0';
-        
-        // Skip comments and blank lines
-        if (is_comment_or_blank(line)) {
-            continue;
-        }
-        
-        char *trimmed = trim(line);
-        
-        // Check for context
-        if (trimmed[0] == '[') {
-            parse_context(trimmed, &state);
-            in_context = 1;
-            continue;
-        }
+    file_list list = {0};
+    const char **files = NULL;
+    int nfiles = 0;
+    int status = 1;
+    validator_options opts = {0};
+    app_registry registry = {0};
+    int watch = 0;
+    int bench = 0;
+    int diff = 0;
+    int lsp = 0;
+    const char *snapshot = NULL;
+    long generate = 0;
+    long min_rate = 0;
+    generate_mix mix = { 10, 5, 10, 1, 0 };
+    
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = NULL;
+        int m;
         
-        if (!in_context) {
-            // Must be in [general] or [globals] or similar
-            if (strchr(trimmed, '=') && !strstr(trimmed, "=>")) {
-                // Variable assignment in [general] or [globals]
-                continue;
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_help(argv[0]);
+            status = 0;
+            goto done;
+        } else if (strcmp(arg, "--watch") == 0) {
+            watch = 1;
+        } else if (strcmp(arg, "--stats") == 0) {
+            opts.stats = 1;
+        } else if ((m = option_value(argc, argv, &i, "--profile-contexts", NULL, &value)) != 0) {
+            opts.profile_contexts = m > 0 ? parse_count(value, INT32_MAX) : -1;
+            if (opts.profile_contexts <= 0) {
+                bad_option("--profile-contexts", m, value);
+                goto done;
+            }
+        } else if (strcmp(arg, "--bench") == 0) {
+            bench = 1;
+        } else if ((m = option_value(argc, argv, &i, "--min-rate", NULL, &value)) != 0) {
+            min_rate = m > 0 ? parse_count(value, INT32_MAX) : -1;
+            if (min_rate <= 0) {
+                bad_option("--min-rate", m, value);
+                goto done;
+            }
+        } else if ((m = option_value(argc, argv, &i, "--generate", NULL, &value)) != 0) {
+            generate = m > 0 ? parse_count(value, INT32_MAX) : -1;
+            if (generate <= 0) {
+                bad_option("--generate", m, value);
+                goto done;
+            }
+        } else if ((m = option_value(argc, argv, &i, "--mix", NULL, &value)) != 0) {
+            if (m < 0 || !parse_mix(value, &mix)) {
+                bad_option("--mix", m, value);
+                goto done;
+            }
+        } else if (strcmp(arg, "--includes") == 0) {
+            opts.follow_includes = 1;
+        } else if (strcmp(arg, "--xref") == 0) {
+            opts.xref = 1;
+        } else if (strcmp(arg, "--lsp") == 0) {
+            lsp = 1;
+        } else if (strcmp(arg, "--diff") == 0) {
+            diff = 1;
+        } else if (strcmp(arg, "--check-patterns") == 0) {
+            opts.check_patterns = 1;
+        } else if (strcmp(arg, "--check-globals") == 0) {
+            opts.check_globals = 1;
+        } else if (strcmp(arg, "--check-apps") == 0) {
+            opts.check_apps = 1;
+        } else if (strcmp(arg, "--app-table") == 0) {
+            status = print_app_table();
+            goto done;
+        } else if ((m = option_value(argc, argv, &i, "--app-registry", NULL, &value)) != 0) {
+            if (m < 0 || value[0] == '\0') {
+                bad_option("--app-registry", m, value);
+                goto done;
+            }
+            app_registry_free(&registry);
+            if (!app_registry_load(&registry, value)) goto done;
+            opts.apps = &registry;
+            opts.check_apps = 1;
+        } else if ((m = option_value(argc, argv, &i, "--jobs", "-j", &value)) != 0) {
+            opts.jobs = m > 0 ? parse_count(value, 4096) : -1;
+            if (opts.jobs < 0) {
+                bad_option("--jobs", m, value);
+                goto done;
+            }
+        } else if ((m = option_value(argc, argv, &i, "--max-errors", NULL, &value)) != 0) {
+            opts.max_errors = m > 0 ? parse_count(value, INT32_MAX) : -1;
+            if (opts.max_errors < 0) {
+                bad_option("--max-errors", m, value);
+                goto done;
+            }
+        } else if ((m = option_value(argc, argv, &i, "--cache", NULL, &value)) != 0) {
+            if (m < 0 || value[0] == '\0') {
+                bad_option("--cache", m, value);
+                goto done;
+            }
+            opts.cache_dir = value;
+        } else if ((m = option_value(argc, argv, &i, "--emit-snapshot", NULL, &value)) != 0) {
+            if (m < 0 || value[0] == '\0') {
+                bad_option("--emit-snapshot", m, value);
+                goto done;
+            }
+            opts.snapshot = value;
+        } else if ((m = option_value(argc, argv, &i, "--read-snapshot", NULL, &value)) != 0) {
+            if (m < 0 || value[0] == '\0') {
+                bad_option("--read-snapshot", m, value);
+                goto done;
+            }
+            snapshot = value;
+        } else if ((m = option_value(argc, argv, &i, "--format", NULL, &value)) != 0) {
+            if (m > 0 && strcmp(value, "text") == 0) {
+                opts.format = FORMAT_TEXT;
+            } else if (m > 0 && strcmp(value, "json") == 0) {
+                opts.format = FORMAT_JSON;
+            } else if (m > 0 && strcmp(value, "sarif") == 0) {
+                opts.format = FORMAT_SARIF;
+            } else {
+                bad_option("--format", m, value);
+                goto done;
+            }
+        } else if ((m = option_value(argc, argv, &i, "--dir", NULL, &value)) != 0) {
+            char pattern[PATH_MAX];
+            int found = 0, n = 0;
+            
+            if (m < 0 || value[0] == '\0') {
+                bad_option("--dir", m, value);
+                goto done;
+            }
+            snprintf(pattern, sizeof(pattern), "%s/extensions*.conf", value);
+            if ((n = list_glob(&list, pattern)) > 0) found += n;
+            snprintf(pattern, sizeof(pattern), "%s/extensions*.d/*.conf", value);
+            if (n >= 0 && (n = list_glob(&list, pattern)) > 0) found += n;
+            if (n < 0) {
+                fprintf(stderr, "Error: Out of memory\n");
+                goto done;
+            }
+            if (found == 0) {
+                fprintf(stderr, "Error: No extensions*.conf files in '%s'\n", value);
+                goto done;
+            }
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            fprintf(stderr, "Error: Unknown option '%s'\n", arg);
+            print_usage(argv[0]);
+            goto done;
+        } else {
+            // A pattern that matches nothing stays as given, and fails to open
+            int n = (strpbrk(arg, "*?[") && access(arg, F_OK) != 0) ? list_glob(&list, arg) : 0;
+            if (n < 0 || (n == 0 && !list_add(&list, arg, NULL))) {
+                fprintf(stderr, "Error: Out of memory\n");
+                goto done;
             }
         }
-        
-        // Check for exten/same
-        if (strncasecmp(trimmed, "exten", 5) == 0 || strncasecmp(trimmed, "same", 4) == 0) {
-            parse_extension(trimmed, &state);
-            continue;
+    }
+    files = list.names;
+    nfiles = list.count;
+    
+    if (generate) {
+        if (nfiles) {
+            fprintf(stderr, "Error: --generate writes to stdout and takes no files\n");
+            goto done;
         }
-        
-        // Check for include
-        if (strncasecmp(trimmed, "include", 7) == 0) {
-            parse_include(trimmed, &state);
-            continue;
+        generate_dialplan(generate, &mix);
+        status = 0;
+        goto done;
+    }
+    
+    if (snapshot) {
+        if (nfiles) {
+            fprintf(stderr, "Error: --read-snapshot takes no files\n");
+            goto done;
         }
-        
-        // Check for switch
-        if (strncasecmp(trimmed, "switch", 6) == 0 ||
-            strncasecmp(trimmed, "eswitch", 7) == 0 ||
-            strncasecmp(trimmed, "lswitch", 7) == 0) {
-            // Switch statement, basic validation
-            if (!strstr(trimmed, "=>")) {
-                fprintf(stderr, "Line %d: Missing '=>' in switch statement\n", state.line_num);
-                state.errors++;
-            }
-            continue;
+        status = read_snapshot(snapshot, &opts);
+        goto done;
+    }
+    
+    if (lsp) {
+        if (nfiles || watch || bench || diff || opts.snapshot || opts.follow_includes || opts.profile_contexts ||
+            opts.format != FORMAT_TEXT) {
+            fprintf(stderr, "Error: --lsp reads documents from its client and takes no files or output options\n");
+            goto done;
         }
-        
-        // Unknown line type
-        if (in_context && strlen(trimmed) > 0) {
-            fprintf(stderr, "Line %d: Warning: Unknown directive '%s'\n", 
-                    state.line_num, trimmed);
-            state.warnings++;
+        opts.jobs = 1;
+        opts.index = opts.xref;
+        status = lsp_serve(&opts);
+        goto done;
+    }
+    
+    if (nfiles == 0) {
+        print_usage(argv[0]);
+        goto done;
+    }
+    
+    if (diff && (nfiles != 2 || bench || watch || opts.follow_includes || opts.snapshot ||
+                 opts.format != FORMAT_TEXT)) {
+        fprintf(stderr, "Error: --diff compares exactly two files or snapshots, as text%s\n",
+                opts.follow_includes ? " (diff snapshots written with --includes instead)" : "");
+        goto done;
+    }
+    if ((bench || watch) && opts.snapshot) {
+        fprintf(stderr, "Error: --emit-snapshot can't be combined with %s\n", bench ? "--bench" : "--watch");
+        goto done;
+    }
+    if (opts.profile_contexts && (bench || watch || diff || opts.cache_dir)) {
+        // Contexts replayed from a cache or between saves would cost nothing
+        fprintf(stderr, "Error: --profile-contexts times one full run, so it can't be combined with %s\n",
+                bench ? "--bench" : watch ? "--watch" : diff ? "--diff" : "--cache");
+        goto done;
+    }
+    if (min_rate && !bench) {
+        fprintf(stderr, "Error: --min-rate is only used with --bench\n");
+        goto done;
+    }
+    if (bench && (watch || opts.follow_includes)) {
+        fprintf(stderr, "Error: --bench can't be combined with %s\n", watch ? "--watch" : "--includes");
+        goto done;
+    }
+    for (int i = 0; bench && i < nfiles; i++) {
+        if (strcmp(files[i], "-") == 0) {
+            fprintf(stderr, "Error: --bench reads its files more than once, so it can't use '-'\n");
+            goto done;
         }
     }
     
-    fclose(fp);
+    if (watch && opts.format != FORMAT_TEXT) {
+        fprintf(stderr, "Error: --watch only supports text output\n");
+        goto done;
+    }
+    for (int i = 0; watch && i < nfiles; i++) {
+        if (strcmp(files[i], "-") == 0) {
+            fprintf(stderr, "Error: --watch can't re-read standard input\n");
+            goto done;
+        }
+    }
     
-    // Summary
-    printf("\n");
-    if (state.errors == 0 && state.warnings == 0) {
-        printf("✓ Syntax valid: %s\n", filename);
-        return 0;
+    if (opts.jobs == 0) opts.jobs = default_jobs();
+    opts.index = opts.xref || opts.snapshot || diff;
+    opts.steps = opts.snapshot || diff;
+    
+    // Diagnostics are written in bulk; don't pay for an unbuffered stderr
+    setvbuf(stderr, NULL, _IOFBF, 64 * 1024);
+    
+    if (bench) {
+        status = bench_files(files, nfiles, &opts, (double)min_rate);
+    } else if (diff) {
+        status = diff_files(files[0], files[1], &opts);
     } else {
-        printf("Validation complete: %d error(s), %d warning(s)\n", 
-               state.errors, state.warnings);
-        return (state.errors > 0) ? 1 : 0;
+        status = watch ? watch_files(files, nfiles, &opts) : validate_files(files, nfiles, &opts);
     }
+    
+done:
+    list_free(&list);
+    app_registry_free(&registry);
+    return status;
 }
 
+/* Leave out with -DDPV_NO_MAIN to build the library */
+#if !defined(DPV_NO_MAIN) && !defined(DPV_FUZZ)
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Asterisk Dialplan Validator v%s\n", VERSION);
-        fprintf(stderr, "Usage: %s <extensions.conf>\n", argv[0]);
-        fprintf(stderr, "\n");
-        fprintf(stderr, "Examples:\n");
-        fprintf(stderr, "  %s /etc/asterisk/extensions.conf\n", argv[0]);
-        fprintf(stderr, "  %s /etc/asterisk/extensions-test.conf\n", argv[0]);
-        fprintf(stderr, "\n");
-        fprintf(stderr, "Exit codes:\n");
-        fprintf(stderr, "  0 = Syntax valid\n");
-        fprintf(stderr, "  1 = Syntax errors found or file not found\n");
-        fprintf(stderr, "\n");
-        fprintf(stderr, "For help: %s --help\n", argv[0]);
-        return 1;
-    }
-    
-    // Check for help flags
-    if (strcmp(argv[1], "-h") == 0 || 
-        strcmp(argv[1], "--help") == 0 || 
-        strcmp(argv[1], "help") == 0) {
-        printf("Asterisk Dialplan Validator v%s\n", VERSION);
-        printf("Based on actual Asterisk pbx_config.c parsing logic\n");
-        printf("\n");
-        printf("Usage: %s <extensions.conf>\n", argv[0]);
-        printf("\n");
-        printf("What it validates:\n");
-        printf("  ✓ Context definitions [context-name]\n");
-        printf("  ✓ Extension syntax: exten => pattern,priority,app(args)\n");
-        printf("  ✓ Continuation syntax: same => priority,app(args)\n");
-        printf("  ✓ Priority labels: n(label), 1(start), etc.\n");
-        printf("  ✓ Balanced parentheses, brackets, braces\n");
-        printf("  ✓ Variable syntax ${VAR} and $[EXPR]\n");
-        printf("  ✓ Priority values (must be >=1, 'n', or 'hint')\n");
-        printf("  ✓ Include and switch statements\n");
-        printf("\n");
-        printf("Examples:\n");
-        printf("  %s /etc/asterisk/extensions.conf\n", argv[0]);
-        printf("  %s /etc/asterisk/extensions-test.conf\n", argv[0]);
-        printf("\n");
-        printf("Supported priority formats:\n");
-        printf("  n              - Next priority\n");
-        printf("  n(label)       - Next priority with label\n");
-        printf("  1              - Explicit priority\n");
-        printf("  1(start)       - Explicit priority with label\n");
-        printf("  hint           - Hint priority\n");
-        printf("\n");
-        printf("Exit codes:\n");
-        printf("  0 = Syntax valid\n");
-        printf("  1 = Syntax errors found or file not found\n");
-        printf("\n");
-        printf("Note: Quote checking is intentionally disabled as Asterisk handles\n");
-        printf("      quotes in a context-dependent way that varies by application.\n");
-        printf("      Apostrophes in text (e.g., \"It's working\") are valid.\n");
-        printf("\n");
-        printf("GitHub: https://github.com/calvintwells/dialplan_validator\n");
-        printf("License: MIT\n");
-        return 0;
-    }
-    
-    return validate_dialplan(argv[1]);
+    return dpv_main(argc, argv);
 }
+#endif
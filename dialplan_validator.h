@@ -0,0 +1,81 @@
+/* dialplan_validator.h
+ * In-process interface to the Asterisk dialplan validator
+ *
+ * The library is the same source with the command line left out:
+ *   gcc -c -O2 -DDPV_NO_MAIN dialplan_validator.c -Wall -pthread
+ *   ar rcs libdialplanvalidator.a dialplan_validator.o
+ * Link programs that use it with -pthread.
+ *
+ * A dpv_context holds options and nothing else, and is never written after
+ * dpv_context_new(), so one context can be shared by any number of threads
+ * validating at once. Every call works on its own state and does no I/O.
+ *
+ * GitHub: https://github.com/calvintwells/dialplan_validator
+ * License: MIT
+ */
+
+#ifndef DIALPLAN_VALIDATOR_H
+#define DIALPLAN_VALIDATOR_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    int jobs;             // Threads one large buffer may be split across (0 or 1 = caller's only)
+    int max_errors;       // Stop after this many errors (0 = no limit)
+    int xref;             // Check include => and Goto/Gosub targets within the buffer
+    int check_patterns;   // Duplicate priorities, patterns that can never match
+    int check_globals;    // ${VAR} references to variables the buffer never sets
+    int check_apps;       // Unknown applications and functions, argument counts
+} dpv_options;
+
+typedef enum {
+    DPV_ERROR,
+    DPV_WARNING
+} dpv_level;
+
+typedef struct {
+    const char *code;     // Stable name, as in --format json, e.g. "E_UNBALANCED"
+    const char *message;
+    const char *context;  // Context the line is in, or NULL
+    dpv_level level;
+    int line;             // 0 for problems with the buffer as a whole
+    int column;           // 1-based; 0 if unknown
+    int span;             // Bytes covered from column; 0 if unknown
+} dpv_diagnostic;
+
+typedef struct {
+    int errors;
+    int warnings;
+    int stopped;                  // max_errors was reached
+    int lines;
+    size_t count;
+    const dpv_diagnostic *items;  // Strings stay valid until dpv_result_free()
+    void *internal;
+} dpv_result;
+
+typedef struct dpv_context dpv_context;
+
+/* NULL options give the command line's defaults. Returns NULL if out of memory. */
+dpv_context *dpv_context_new(const dpv_options *opts);
+void dpv_context_free(dpv_context *ctx);
+
+/*
+ * Validates len bytes of dialplan text; the buffer needn't be NUL-terminated.
+ * Returns the number of errors (0 = valid) or -1 if out of memory. The result
+ * must be released with dpv_result_free() either way.
+ */
+int dpv_validate_buffer(const char *buf, size_t len, const dpv_context *ctx, dpv_result *result);
+void dpv_result_free(dpv_result *result);
+
+/* The command line, for programs that embed it */
+int dpv_main(int argc, char *argv[]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
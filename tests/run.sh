@@ -0,0 +1,206 @@
+#!/bin/sh
+# Regression checks for dialplan_validator:
+#   1. every tests/corpus/*.conf against its expected text (.txt) and JSON
+#      (.json) output; a "; args: ..." line in the file gives the options
+#   2. behaviour that takes more than one run: --jobs, --watch, --cache,
+#      --profile-contexts byte totals, --read-snapshot of a damaged snapshot
+#   3. with BENCH=1, --bench throughput against a build of BENCH_REF (a git
+#      revision, default HEAD) timed on the same machine
+#
+#   tests/run.sh                    build, then run checks 1 and 2
+#   BENCH=1 BENCH_REF=main tests/run.sh   also compare speed with main
+#   tests/run.sh --update           rewrite the expected outputs
+#
+# DPV=path checks an existing binary instead of building one. BENCH_DROP is
+# the largest slowdown from BENCH_REF accepted, in percent (default 15).
+
+cd "$(dirname "$0")/.." || exit 2
+root=$(pwd)
+update=0
+[ "$1" = "--update" ] && update=1
+tmp=$(mktemp -d) || exit 2
+trap 'rm -rf "$tmp"' EXIT INT TERM
+failed=0
+
+if [ -z "$DPV" ]; then
+    DPV="$tmp/dialplan_validator"
+    ${CC:-gcc} ${CFLAGS:--O2} -o "$DPV" dialplan_validator.c -Wall -pthread || exit 2
+fi
+case "$DPV" in
+    /*) ;;
+    *) DPV="$root/$DPV" ;;
+esac
+
+fail() {
+    echo "FAIL: $*"
+    failed=$((failed + 1))
+}
+
+# Compare a result with its expected file, or replace the file with --update
+expect() {
+    if [ $update = 1 ]; then
+        cp "$2" "$1"
+    elif ! diff -u "$1" "$2"; then
+        fail "$1"
+    fi
+}
+
+# Diagnostics (stderr), then the summary (stdout), then the exit code
+run_text() {
+    "$DPV" "$@" > "$tmp/out" 2> "$tmp/err"
+    rc=$?
+    cat "$tmp/err" "$tmp/out"
+    echo "exit $rc"
+}
+
+args_of() {
+    sed -n 's/^; args: //p' "$1" | head -n 1
+}
+
+# 1. Corpus
+cd tests/corpus || exit 2
+for conf in *.conf; do
+    name=${conf%.conf}
+    args=$(args_of "$conf")
+    # shellcheck disable=SC2086  # args is a list of options
+    run_text $args "$conf" > "$tmp/$name.txt"
+    # shellcheck disable=SC2086
+    run_text --format json $args "$conf" > "$tmp/$name.json"
+    expect "$name.txt" "$tmp/$name.txt"
+    expect "$name.json" "$tmp/$name.json"
+done
+
+# 2a. Output is the same for any --jobs value
+run_text --jobs 1 syntax.conf clean.conf two-files.conf > "$tmp/jobs1"
+run_text --jobs 4 syntax.conf clean.conf two-files.conf > "$tmp/jobs4"
+cmp -s "$tmp/jobs1" "$tmp/jobs4" || fail "--jobs 4 output differs from --jobs 1"
+
+# 2b. --watch: fixing the first of two equal errors reports that one, not the second
+cp watch.conf "$tmp/watch.conf"
+"$DPV" --watch "$tmp/watch.conf" > "$tmp/watch.out" 2>&1 &
+watcher=$!
+tries=0
+until grep -q '^Watching' "$tmp/watch.out" || [ $tries -ge 50 ]; do
+    sleep 0.1
+    tries=$((tries + 1))
+done
+sed 's/^exten => 1,1,NoOp(x$/exten => 1,1,NoOp(x)/' watch.conf > "$tmp/watch.new"
+mv "$tmp/watch.new" "$tmp/watch.conf"
+tries=0
+until grep -q '^\[' "$tmp/watch.out" || [ $tries -ge 50 ]; do
+    sleep 0.1
+    tries=$((tries + 1))
+done
+kill $watcher 2> /dev/null
+wait $watcher 2> /dev/null
+grep -q '^  - Line 3: ' "$tmp/watch.out" && ! grep -q '^  - Line 7: ' "$tmp/watch.out" ||
+    fail "--watch paired the fixed error with the wrong line: $(cat "$tmp/watch.out")"
+
+# 2c. --cache replays the same output, and a damaged cache file is a miss
+for conf in syntax.conf semantic.conf clean.conf; do
+    args=$(args_of "$conf")
+    # shellcheck disable=SC2086
+    run_text $args "$conf" > "$tmp/plain"
+    rm -rf "$tmp/cache"
+    # shellcheck disable=SC2086
+    run_text --cache "$tmp/cache" $args "$conf" > "$tmp/cold"
+    # shellcheck disable=SC2086
+    run_text --cache "$tmp/cache" $args "$conf" > "$tmp/warm"
+    cmp -s "$tmp/plain" "$tmp/cold" && cmp -s "$tmp/plain" "$tmp/warm" ||
+        fail "--cache output differs for $conf"
+
+    file=$(ls "$tmp"/cache/*.dpvc 2> /dev/null)
+    if [ -z "$file" ]; then
+        fail "--cache wrote no file for $conf"
+        continue
+    fi
+    cp "$file" "$tmp/saved.dpvc"
+    size=$(wc -c < "$tmp/saved.dpvc")
+    off=24   # Past magic, fingerprint and count: damage the payload and its checksum
+    replayed=""
+    while [ "$off" -lt "$size" ]; do
+        cp "$tmp/saved.dpvc" "$file"
+        printf '\377' | dd of="$file" bs=1 seek="$off" conv=notrunc 2> /dev/null
+        # shellcheck disable=SC2086
+        run_text --cache "$tmp/cache" $args "$conf" > "$tmp/damaged"
+        cmp -s "$tmp/plain" "$tmp/damaged" || replayed="$replayed $off"
+        off=$((off + 5))
+    done
+    [ -z "$replayed" ] || fail "$conf: cache damaged at byte(s)$replayed was replayed"
+done
+
+# 2d. --profile-contexts charges every byte of a file to exactly one context
+for conf in *.conf; do
+    bytes=$("$DPV" --profile-contexts 1000 "$conf" 2>&1 > /dev/null |
+            awk '/^  context / { rows = 1; next } rows && NF >= 6 { sum += $(NF - 4) } END { print sum + 0 }')
+    [ "$bytes" = "$(wc -c < "$conf" | tr -d ' ')" ] ||
+        fail "--profile-contexts counts $bytes bytes for $conf, which has $(wc -c < "$conf")"
+done
+# 2e. --read-snapshot of a damaged snapshot ends, without crashing: every byte is
+# set to 2 (which turns the second record's included_by into a self-reference)
+# and every third to 255
+limit=""
+command -v timeout > /dev/null && limit="timeout 10"
+"$DPV" --includes --emit-snapshot "$tmp/saved.dpvs" includes-main.conf > /dev/null 2>&1
+size=$(wc -c < "$tmp/saved.dpvs")
+off=0
+hung=""
+while [ "$off" -lt "$size" ]; do
+    for byte in '\002' '\377'; do
+        [ "$byte" = '\377' ] && [ $((off % 3)) != 0 ] && continue
+        cp "$tmp/saved.dpvs" "$tmp/damaged.dpvs"
+        printf "$byte" | dd of="$tmp/damaged.dpvs" bs=1 seek="$off" conv=notrunc 2> /dev/null
+        $limit "$DPV" --read-snapshot "$tmp/damaged.dpvs" > /dev/null 2>&1
+        [ $? -lt 2 ] || hung="$hung $off"
+    done
+    off=$((off + 1))
+done
+[ -z "$hung" ] || fail "--read-snapshot hung or crashed on a snapshot damaged at byte(s)$hung"
+cd "$root" || exit 2
+
+# Best lines/s of one --bench run (itself the best of 5) on one thread
+bench_rate() {
+    "$@" | awk '$1 == "total" { print $4 }'
+}
+
+# 3. Throughput against BENCH_REF, built with the same compiler and flags. The
+# two binaries take turns, three rounds each, and the best rate of each counts,
+# so a busy moment on the machine doesn't land on one side only.
+if [ -n "$BENCH" ]; then
+    ref=${BENCH_REF:-HEAD}
+    mkdir "$tmp/ref"
+    git show "$ref:dialplan_validator.h" > "$tmp/ref/dialplan_validator.h" 2> /dev/null
+    if ! git show "$ref:dialplan_validator.c" > "$tmp/ref/dialplan_validator.c" ||
+       ! ${CC:-gcc} ${CFLAGS:--O2} -o "$tmp/ref/dialplan_validator" "$tmp/ref/dialplan_validator.c" -Wall -pthread; then
+        fail "can't build BENCH_REF $ref"
+    else
+        "$DPV" --generate 100000 > "$tmp/bench.conf"
+        "$DPV" --generate 20000 --mix stress=5 > "$tmp/stress.conf"
+        drop=${BENCH_DROP:-15}
+        for bench in "default bench.conf" "stress stress.conf --check-apps"; do
+            set -- $bench
+            name=$1 conf=$2
+            shift 2
+            best=0 best_ref=0
+            for round in 1 2 3; do
+                r=$(bench_rate "$tmp/ref/dialplan_validator" --bench --jobs 1 "$@" "$tmp/$conf")
+                c=$(bench_rate "$DPV" --bench --jobs 1 "$@" "$tmp/$conf")
+                best_ref=$(awk -v a="$best_ref" -v b="${r:-0}" 'BEGIN { print (b > a ? b : a) }')
+                best=$(awk -v a="$best" -v b="${c:-0}" 'BEGIN { print (b > a ? b : a) }')
+            done
+            echo "bench $name: $best lines/s, $ref $best_ref lines/s"
+            if [ "$best" = 0 ] || [ "$best_ref" = 0 ]; then
+                fail "--bench $name gave no rate"
+            else
+                awk -v r="$best" -v b="$best_ref" -v d="$drop" 'BEGIN { exit !(r >= b * (100 - d) / 100) }' ||
+                    fail "--bench $name: $best lines/s is more than $drop% below $ref ($best_ref)"
+            fi
+        done
+    fi
+fi
+
+if [ $failed -gt 0 ]; then
+    echo "$failed check(s) failed"
+    exit 1
+fi
+[ $update = 1 ] && echo "Expected outputs updated" || echo "All checks passed"